@@ -1,64 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include "errors.h"
+#include "log.h"
 #include "app.h"
 
 namespace zlynx {
-	static const auto content_type_s = "content-type"s;
-
 	void AppConnection::on_get() {
-		logger << "GET " << path_view << "\n";
+		LOG(Debug) << "GET " << path_view;
+
+		if(in_documents()) {
+			write_document();
+			return;
+		}
 
-		auto entry = store->get(path_view);
+		// Ranges are of the value as it is, so they are not compressed.
+		auto encoding = get_header(HeaderId::Range).empty()
+			? preferred_encoding(get_header(HeaderId::AcceptEncoding))
+			: Encoding::Identity;
+		// The loop's clock, so a GET makes no system call for it.
+		int64_t now = sockets->wall_time() / 1000;
+		auto entry = store->get(path_view, encoding, now);
+		Freshness fresh;
+		if(entry.max_age >= 0)
+			fresh = Freshness{entry.max_age, std::max(now - entry.modified, int64_t(0))};
+
+		if(!entry.body.empty()) {
+			// Polling clients mostly already have the value.
+			if(not_modified(entry.etag, entry.modified)) {
+				write_not_modified(entry.etag, entry.last_modified, fresh);
+				return;
+			}
+			switch(find_ranges(entry.body.size(), entry.etag, entry.modified)) {
+				case Ranges::Full:
+					break;
+				case Ranges::Partial:
+					write_ranges(entry.content_type, entry.etag, entry.last_modified, entry.body, entry.owner, fresh);
+					return;
+				case Ranges::Unsatisfiable:
+					write_range_not_satisfiable(entry.body.size());
+					return;
+			}
+		}
+
+		// Usually the whole response is ready made.
+		if(!entry.body.empty() && keep_alive && proto_view == "HTTP/1.1"sv) {
+			write_response(entry.response_head, entry.body, entry.owner, fresh);
+			return;
+		}
 
-		write(proto_view);
 		if(entry.body.empty()) {
-			writeln(" 404 Not Found");
+			write_status("404 Not Found");
 		} else {
-			writeln(" 200 OK");
+			write_status("200 OK");
 			write("Content-Type: ");
 			writeln(entry.content_type);
+			if(entry.content_encoding.empty()) {
+				writeln("Accept-Ranges: bytes");
+			} else {
+				write("Content-Encoding: ");
+				writeln(entry.content_encoding);
+			}
+			if(compressible_type(entry.content_type))
+				writeln("Vary: Accept-Encoding");
+			write_validators(entry.etag, entry.last_modified, fresh);
+		}
+		write_body(entry.body, entry.owner);
+	}
+
+	bool AppConnection::in_documents() const {
+		if(!documents)
+			return false;
+		std::string_view path = path_view;
+		return path.substr(0, documents->prefix.size()) == documents->prefix;
+	}
+
+	void AppConnection::write_document() {
+		std::string_view path = path_view;
+		path.remove_prefix(documents->prefix.size());
+		path = path.substr(0, path.find('?'));
+		int error = 0;
+		auto file = documents->files.open(path, sockets->now(), error);
+		if(!file) {
+			switch(error) {
+				case ENOENT:
+				case ENOTDIR:
+				case ENAMETOOLONG:
+					write_status("404 Not Found");
+					break;
+				// Out of file handles, which may not last.
+				case EMFILE:
+				case ENFILE:
+				case ENOMEM:
+					write_status("503 Service Unavailable");
+					break;
+				default:
+					LOG(Warning) << "opening document " << path << ": " << std::strerror(error);
+					write_status("500 Internal Server Error");
+			}
+			write_body();
+			return;
+		}
+		if(not_modified(file->etag, file->modified.tv_sec)) {
+			write_not_modified(file->etag, file->last_modified);
+			return;
+		}
+		// A file can only be sent in one piece, so a request for
+		// several ranges gets all of it.
+		switch(find_ranges(file->size, file->etag, file->modified.tv_sec, 1)) {
+			case Ranges::Full:
+				break;
+			case Ranges::Partial:
+				write_range_file(file->content_type, file->etag, file->last_modified, file->handle, file->size, file);
+				return;
+			case Ranges::Unsatisfiable:
+				write_range_not_satisfiable(file->size);
+				return;
+		}
+		write_status("200 OK");
+		write("Content-Type: ");
+		writeln(file->content_type);
+		writeln("Accept-Ranges: bytes");
+		write_validators(file->etag, file->last_modified);
+		write_body_file(file->handle, 0, file->size, file);
+	}
+
+	void AppConnection::write_snapshot() {
+		if(!store->snapshots_enabled())
+			write_status("404 Not Found");
+		else if(store->start_dump())
+			write_status("202 Accepted");
+		else
+			write_status("409 Conflict");
+		write_body();
+	}
+
+	void AppConnection::write_not_allowed() {
+		write_status("405 Method Not Allowed");
+		writeln("Allow: GET");
+		write_body();
+	}
+
+	void AppConnection::write_bad_request() {
+		write_status("400 Bad Request");
+		write_body();
+	}
+
+	bool AppConnection::request_max_age(int64_t &max_age) const {
+		if(!parse_max_age(get_header(HeaderId::CacheControl), max_age))
+			return false;
+		auto expires = get_header(HeaderId::Expires);
+		if(max_age >= 0 || expires.empty())
+			return true;
+		int64_t when;
+		if(!parse_http_date(expires, when))
+			return false;
+		// A date in the past stores the value already expired.
+		max_age = std::clamp(when - sockets->wall_time() / 1000, int64_t(0), max_delta_seconds);
+		return true;
+	}
+
+	bool AppConnection::on_body_start() {
+		// Answers known from the head are sent before the body is asked
+		// for, and the connection closed instead of reading through it.
+		if(in_documents()) {
+			keep_alive = false;
+			write_not_allowed();
+			return false;
+		}
+		if(method_view == "POST"sv && path_view == snapshot_path) {
+			keep_alive = false;
+			write_snapshot();
+			return false;
+		}
+		if(method_view != "PUT"sv && method_view != "POST"sv)
+			return false;
+		int64_t max_age;
+		if(!request_max_age(max_age)) {
+			keep_alive = false;
+			write_bad_request();
+			return false;
+		}
+		upload = store->start_upload(
+			get_header(HeaderId::ContentType),
+			chunked ? Datastore::unknown_size : content_length,
+			max_age
+		);
+		// Too much is being uploaded at once.
+		if(!upload) {
+			write_error("503 Service Unavailable");
+			return false;
+		}
+		return true;
+	}
+
+	void AppConnection::on_body(std::string_view data) {
+		// A chunked body outgrew what is left of the upload budget.
+		if(!upload.append(data)) {
+			upload = Datastore::Upload();
+			write_error("503 Service Unavailable");
 		}
-		write_body(entry.body);
+	}
+
+	bool AppConnection::store_body(std::string_view content_type, int64_t max_age) {
+		if(upload)
+			return store->set(path_view, std::move(upload));
+		Entry entry{content_type, body_view};
+		entry.max_age = max_age;
+		return store->set(path_view, entry);
 	}
 
 	void AppConnection::on_put() {
-		auto content_type_view = get_header(content_type_s);
-		logger << "PUT " << path_view << ' ' << content_type_view << '\n';
+		if(in_documents()) {
+			write_not_allowed();
+			return;
+		}
+		auto content_type_view = get_header(HeaderId::ContentType);
+		LOG(Debug) << "PUT " << path_view << ' ' << content_type_view;
 
-		auto entry = store->get(path_view);
-		store->set(path_view, Entry{content_type_view,  body_view});
+		int64_t max_age;
+		if(!request_max_age(max_age)) {
+			write_bad_request();
+			return;
+		}
+		bool replaced = store_body(content_type_view, max_age);
 
-		write(proto_view);
-		if(entry.body.empty()) {
-			writeln(" 201 Created");
+		if(!replaced) {
+			write_status("201 Created");
 			write("Location: ");
 			writeln(path_view);
 		} else {
-			writeln(" 204 No Content");
+			write_status("204 No Content");
 		}
 		write_body();
 	}
 
 	void AppConnection::on_post() {
-		auto content_type_view = get_header(content_type_s);
-		//logger << "POST " << path_view << ' ' << content_type_view << '\n' << body_view << '\n';
-		logger << "POST " << path_view << ' ' << content_type_view << " body size: " << body_view.size() << '\n';
+		if(in_documents()) {
+			write_not_allowed();
+			return;
+		}
+		if(path_view == snapshot_path) {
+			write_snapshot();
+			return;
+		}
 
-		store->set(path_view, Entry{content_type_view,  body_view});
+		auto content_type_view = get_header(HeaderId::ContentType);
+		LOG(Debug) << "POST " << path_view << ' ' << content_type_view << " body size: " << content_length;
 
-		write(proto_view);
-		writeln(" 201 Created");
+		int64_t max_age;
+		if(!request_max_age(max_age)) {
+			write_bad_request();
+			return;
+		}
+		store_body(content_type_view, max_age);
+
+		write_status("201 Created");
 		write("Location: ");
 		writeln(path_view);
 		write_body();
 	}
 
 	void AppConnection::on_delete() {
-		logger << "DELETE " << path_view << "\n";
+		if(in_documents()) {
+			write_not_allowed();
+			return;
+		}
+		LOG(Debug) << "DELETE " << path_view;
 
 		store->del(path_view);
 
-		write(proto_view);
-		writeln(" 204 No Content");
+		write_status("204 No Content");
 		write_body();
 	}
 }
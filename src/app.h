@@ -1,29 +1,72 @@
 #pragma once
 #include "datastore.h"
+#include "files.h"
 #include "http.h"
 
 namespace zlynx {
+	// Files from a directory served by GET under a path prefix, such
+	// as /static/. One for each event loop.
+	struct DocumentRoot {
+		std::string prefix;
+		FileCache files;
+
+		DocumentRoot(const std::string &prefix, const std::string &directory, size_t capacity):
+			prefix(prefix),
+			files(directory, capacity)
+		{
+		}
+	};
+
 	class AppConnection : public HTTPConnection {
 		public:
 		AppConnection(
 			int h,
 			const sockaddr_in6 &remote,
-			time_t timeout,
-			std::shared_ptr<Datastore> store
+			int64_t timeout,
+			int64_t header_timeout,
+			HTTPLimits limits,
+			Datastore *store,
+			std::shared_ptr<DocumentRoot> documents
 		):
-			HTTPConnection(h, remote, timeout),
-			store(store)
+			HTTPConnection(h, remote, timeout, header_timeout, limits),
+			store(store),
+			documents(std::move(documents))
 		{
 		}
 
+		// POST here writes a snapshot of the store.
+		static constexpr std::string_view snapshot_path = "/_snapshot"sv;
+
 		protected:
+		// Large and chunked PUT and POST bodies go straight into an Upload.
+		bool on_body_start() override;
+		void on_body(std::string_view data) override;
 		void on_get() override;
 		void on_put() override;
 		void on_post() override;
 		void on_delete() override;
 
 		private:
-		std::shared_ptr<Datastore> store;
+		// Owned by the AppListener. Every Sockets loop is gone before
+		// the store is, so connections do not need to hold a count on
+		// it, which every accept on every thread would contend on.
+		Datastore *store;
+		std::shared_ptr<DocumentRoot> documents;
+		Datastore::Upload upload;
+
+		// Store the request body under the path.
+		bool store_body(std::string_view content_type, int64_t max_age);
+		// The time to live in seconds the request asks for by
+		// Cache-Control max-age or else Expires, -1 for none. False if
+		// either is malformed.
+		bool request_max_age(int64_t &max_age) const;
+		void write_bad_request();
+		// True if the path is under the document root prefix.
+		bool in_documents() const;
+		void write_document();
+		void write_not_allowed();
+		// Start a snapshot and answer how that went.
+		void write_snapshot();
 	};
 
 	class AppListener : public Listener {
@@ -31,31 +74,37 @@ namespace zlynx {
 		AppListener(
 			uint16_t port,
 			std::shared_ptr<Datastore> store,
-			time_t connection_timeout = 5
+			int64_t connection_timeout = 5000,
+			int64_t header_timeout = 5000,
+			HTTPLimits limits = HTTPLimits(),
+			std::shared_ptr<DocumentRoot> documents = nullptr
 		) :
 			Listener(port),
 			store(store),
-			connection_timeout(connection_timeout)
+			documents(std::move(documents)),
+			connection_timeout(connection_timeout),
+			header_timeout(header_timeout),
+			limits(limits)
 		{
 		}
 
 		protected:
-		Action on_input() override {
-			if(!sockets->running)
-				return REMOVE;
-			auto result = do_accept();
-			if(result.ok) {
-				auto conn = std::make_shared<AppConnection>(
-					result.handle, result.remote_addr, connection_timeout,
-					store
-				);
-				sockets->add_socket(conn);
-			}
-			return KEEP;
+		void on_accept(const AcceptResult &result) override {
+			auto conn = std::allocate_shared<AppConnection>(
+				PoolAllocator<AppConnection>(),
+				result.handle, result.remote_addr,
+				connection_timeout, header_timeout,
+				limits, store.get(), documents
+			);
+			sockets->add_socket(conn);
 		}
 
 		private:
 		std::shared_ptr<Datastore> store;
-		time_t connection_timeout = 0;
+		std::shared_ptr<DocumentRoot> documents;
+		// Milliseconds
+		int64_t connection_timeout = 0;
+		int64_t header_timeout = 0;
+		HTTPLimits limits;
 	};
 }
@@ -0,0 +1,701 @@
+// HTTP load generator for the server, built on the same Sockets and
+// Connection classes. Each thread runs its own event loop with a share
+// of the connections.
+// Run with --help for the options.
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <unistd.h>
+#include "errors.h"
+#include "headers.h"
+#include "histogram.h"
+#include "log.h"
+#include "sockets.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	int64_t monotonic_ns() {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+	}
+
+	// Sizes of the values sent by PUT and POST.
+	// "N" is fixed, "A-B" is uniform and "exp:N" is exponential with
+	// mean N.
+	struct ValueSize {
+		enum Kind {
+			Fixed,
+			Uniform,
+			Exponential
+		};
+		Kind kind = Fixed;
+		size_t a = 4096;
+		size_t b = 4096;
+
+		static ValueSize parse(std::string_view s) {
+			ValueSize v;
+			auto number = [&s](std::string_view n) {
+				size_t x = 0;
+				auto r = std::from_chars(n.data(), n.data() + n.size(), x);
+				if(r.ec != std::errc() || r.ptr != n.data() + n.size())
+					throw std::invalid_argument("bad value size: " + std::string(s));
+				return x;
+			};
+			if(s.substr(0, 4) == "exp:") {
+				v.kind = Exponential;
+				v.a = v.b = number(s.substr(4));
+			} else if(auto dash = s.find('-'); dash != s.npos) {
+				v.kind = Uniform;
+				v.a = number(s.substr(0, dash));
+				v.b = number(s.substr(dash + 1));
+				if(v.b < v.a)
+					std::swap(v.a, v.b);
+			} else {
+				v.a = v.b = number(s);
+			}
+			return v;
+		}
+
+		// The largest size pick() returns.
+		size_t limit() const {
+			return kind == Exponential ? a * 8 : b;
+		}
+
+		template<class Rng>
+		size_t pick(Rng &rng) const {
+			switch(kind) {
+				case Uniform:
+					return std::uniform_int_distribution<size_t>(a, b)(rng);
+				case Exponential:
+					return std::min(limit(), size_t(std::exponential_distribution<double>(1.0 / a)(rng)));
+				default:
+					return a;
+			}
+		}
+
+		std::string describe() const {
+			switch(kind) {
+				case Uniform:
+					return std::to_string(a) + "-" + std::to_string(b);
+				case Exponential:
+					return "exp:" + std::to_string(a);
+				default:
+					return std::to_string(a);
+			}
+		}
+	};
+
+	enum Method {
+		Get,
+		Put,
+		Post,
+		Delete,
+		method_count
+	};
+	constexpr std::array<std::string_view, method_count> method_names = {
+		"GET"sv, "PUT"sv, "POST"sv, "DELETE"sv
+	};
+
+	struct BenchConfig {
+		std::string host = "127.0.0.1";
+		uint16_t port = 8080;
+		unsigned threads = 1;
+		unsigned connections = 16;
+		double duration = 10;
+		// Relative weights of GET, PUT, POST and DELETE.
+		std::array<unsigned, method_count> mix = {{ 90, 10, 0, 0 }};
+		unsigned keys = 1000;
+		ValueSize value_size;
+		unsigned pipeline = 1;
+		bool keep_alive = true;
+		bool prefill = true;
+		bool json = false;
+		EventBackendType events = EventBackendType::Epoll;
+
+		BenchConfig(int argc, char *argv[]);
+	};
+
+	struct option {
+		std::string_view long_option;
+		char short_option;
+		int argument;
+		std::string_view help;
+		std::function<void(BenchConfig&, std::string_view)> f;
+	};
+
+	template<class T>
+	T parse_number(std::string_view v) {
+		T x{};
+		auto r = std::from_chars(v.data(), v.data() + v.size(), x);
+		if(r.ec != std::errc() || r.ptr != v.data() + v.size())
+			throw std::invalid_argument("bad number: " + std::string(v));
+		return x;
+	}
+
+	void display_help(BenchConfig&, std::string_view);
+
+	const std::array<option, 14> options = {
+		option{"host", 'H', 1, "server address", [](BenchConfig& c, std::string_view v) {
+			c.host = v;
+		}},
+		option{"port", 'p', 1, "server port", [](BenchConfig& c, std::string_view v) {
+			c.port = parse_number<uint16_t>(v);
+		}},
+		option{"threads", 't', 1, "event loop threads", [](BenchConfig& c, std::string_view v) {
+			c.threads = std::max(1u, parse_number<unsigned>(v));
+		}},
+		option{"connections", 'c', 1, "connections over all threads", [](BenchConfig& c, std::string_view v) {
+			c.connections = std::max(1u, parse_number<unsigned>(v));
+		}},
+		option{"duration", 'd', 1, "seconds to run", [](BenchConfig& c, std::string_view v) {
+			c.duration = parse_number<unsigned>(v);
+		}},
+		option{"mix", 'm', 1, "GET:PUT:POST:DELETE weights, such as 90:10:0:0", [](BenchConfig& c, std::string_view v) {
+			for(auto &m: c.mix) {
+				auto colon = v.find(':');
+				m = parse_number<unsigned>(v.substr(0, colon));
+				v = colon == v.npos ? ""sv : v.substr(colon + 1);
+			}
+		}},
+		option{"keys", 'k', 1, "number of distinct paths", [](BenchConfig& c, std::string_view v) {
+			c.keys = std::max(1u, parse_number<unsigned>(v));
+		}},
+		option{"value-size", 's', 1, "PUT and POST body size: N, A-B or exp:N", [](BenchConfig& c, std::string_view v) {
+			c.value_size = ValueSize::parse(v);
+		}},
+		option{"pipeline", 'P', 1, "requests in flight per connection", [](BenchConfig& c, std::string_view v) {
+			c.pipeline = std::max(1u, parse_number<unsigned>(v));
+		}},
+		option{"close", 0, 0, "one request per connection", [](BenchConfig& c, std::string_view) {
+			c.keep_alive = false;
+		}},
+		option{"no-prefill", 0, 0, "do not PUT every key first", [](BenchConfig& c, std::string_view) {
+			c.prefill = false;
+		}},
+		option{"json", 0, 0, "print the results as JSON", [](BenchConfig& c, std::string_view) {
+			c.json = true;
+		}},
+		option{"events", 'e', 1, "epoll or poll", [](BenchConfig& c, std::string_view v) {
+			c.events = parse_event_backend_type(v);
+			if(c.events == EventBackendType::Uring)
+				throw std::invalid_argument("bench connects its own sockets and needs epoll or poll");
+		}},
+		option{"help", 'h', 0, "", display_help},
+	};
+
+	void display_help(BenchConfig&, std::string_view) {
+		std::clog << "Usage:\n";
+		for(auto &o: options) {
+			std::clog << "  ";
+			if(o.short_option)
+				std::clog << '-' << o.short_option << ", ";
+			else
+				std::clog << "    ";
+			std::clog << "--" << std::left << std::setw(14) << o.long_option << o.help << '\n';
+		}
+		std::exit(0);
+	}
+
+	BenchConfig::BenchConfig(int argc, char *argv[]) {
+		for(int i = 1; i < argc; ++i) {
+			std::string_view arg = argv[i];
+			auto o = std::find_if(begin(options), end(options), [arg](const option &o) {
+				return
+					(arg.size() == 2 && arg[0] == '-' && o.short_option && arg[1] == o.short_option) ||
+					(arg.substr(0, 2) == "--" && arg.substr(2) == o.long_option);
+			});
+			if(o == end(options))
+				throw std::invalid_argument("unknown option: " + std::string(arg));
+			std::string_view value;
+			if(o->argument) {
+				if(++i == argc)
+					throw std::invalid_argument("missing value for " + std::string(arg));
+				value = argv[i];
+			}
+			o->f(*this, value);
+		}
+		if(!keep_alive)
+			pipeline = 1;
+	}
+
+	// Resolve to an IPv6 address, IPv4 addresses are mapped.
+	sockaddr_in6 resolve(const BenchConfig &config) {
+		addrinfo hints;
+		std::memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_INET6;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_V4MAPPED;
+		addrinfo *result = nullptr;
+		int err = getaddrinfo(config.host.c_str(), nullptr, &hints, &result);
+		if(err)
+			throw std::runtime_error("cannot resolve " + config.host + ": " + gai_strerror(err));
+		sockaddr_in6 addr;
+		std::memcpy(&addr, result->ai_addr, sizeof addr);
+		freeaddrinfo(result);
+		addr.sin6_port = htons(config.port);
+		return addr;
+	}
+
+	struct Stats {
+		Histogram latency;
+		uint64_t requests = 0;
+		uint64_t errors = 0;
+		uint64_t bytes = 0;
+		std::map<unsigned, uint64_t> status;
+
+		void merge(const Stats &other) {
+			latency.merge(other.latency);
+			requests += other.requests;
+			errors += other.errors;
+			bytes += other.bytes;
+			for(auto &s: other.status) {
+				status[s.first] += s.second;
+			}
+		}
+	};
+
+	class Worker;
+
+	// One client connection. Keeps up to pipeline requests in flight and
+	// times each from being queued to its response being complete.
+	class BenchConnection : public Connection {
+		public:
+		BenchConnection(int h, const sockaddr_in6 &remote, Worker &worker);
+
+		protected:
+		Action on_input() override;
+		Action on_output() override;
+		Action on_received() override;
+		Action on_timeout() override;
+
+		private:
+		Worker &worker;
+		bool connected = false;
+		// Send times of the requests in flight.
+		std::deque<int64_t> sent;
+		// The response being read, once its head is complete.
+		bool have_head = false;
+		size_t head_size = 0;
+		size_t body_size = 0;
+		unsigned status = 0;
+		bool server_closes = false;
+		// A chunked body is complete once its last chunk is in. Until
+		// then body_size is zero and chunk_end is how far it was read.
+		bool chunked = false;
+		size_t chunk_end = 0;
+
+		void send_requests();
+		bool parse_head();
+		bool parse_chunks();
+		Action lost();
+	};
+
+	class Worker {
+		public:
+		Worker(const BenchConfig &config, const sockaddr_in6 &address, unsigned connections, unsigned seed):
+			config(config),
+			address(address),
+			connections(connections),
+			rng(seed),
+			sockets(std::make_shared<Sockets>(make_event_backend(config.events)))
+		{
+			unsigned total = 0;
+			for(auto w: config.mix) {
+				total += w;
+			}
+			if(!total)
+				throw std::invalid_argument("the request mix is empty");
+			mix_total = total;
+			payload = std::make_shared<const std::string>(config.value_size.limit(), 'x');
+		}
+
+		void run(int64_t until) {
+			end_time = until;
+			for(unsigned i = 0; i < connections; ++i) {
+				connect();
+			}
+			started = true;
+			sockets->start();
+		}
+
+		const BenchConfig &config;
+		Stats stats;
+
+		// True once the time is up or the loop was interrupted.
+		bool finished() const {
+			return monotonic_ns() >= end_time || (started && !sockets->running);
+		}
+
+		void connect() {
+			if(finished())
+				return;
+			int h = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			throw_posix_errno_if(h < 0);
+			int r = ::connect(h, reinterpret_cast<const sockaddr*>(&address), sizeof address);
+			if(r < 0 && errno != EINPROGRESS) {
+				int err = errno;
+				::close(h);
+				throw posix_error("connect", err);
+			}
+			int val = 1;
+			throw_posix_errno_if( ::setsockopt(h, IPPROTO_TCP, TCP_NODELAY, &val, sizeof val) );
+			// Writable once connected.
+			sockets->add_socket(std::make_shared<BenchConnection>(h, address, *this), Sockets::Write);
+		}
+
+		// Append the next request to out. Returns the body to send after it.
+		std::string_view next_request(std::string &out) {
+			unsigned pick = std::uniform_int_distribution<unsigned>(0, mix_total - 1)(rng);
+			unsigned m = 0;
+			while(pick >= config.mix[m]) {
+				pick -= config.mix[m++];
+			}
+			unsigned key = std::uniform_int_distribution<unsigned>(0, config.keys - 1)(rng);
+			std::string_view body;
+			if(m == Put || m == Post)
+				body = std::string_view(*payload).substr(0, config.value_size.pick(rng));
+			append_request(out, method_names[m], key, body.size(), config.keep_alive);
+			return body;
+		}
+
+		static void append_request(std::string &out, std::string_view method, unsigned key, size_t length, bool keep_alive) {
+			out += method;
+			out += " /bench/"sv;
+			out += std::to_string(key);
+			out += " HTTP/1.1\r\nHost: bench\r\n"sv;
+			if(!keep_alive)
+				out += "Connection: close\r\n"sv;
+			if(method == "PUT"sv || method == "POST"sv) {
+				out += "Content-Type: application/octet-stream\r\nContent-Length: "sv;
+				out += std::to_string(length);
+				out += "\r\n"sv;
+			}
+			out += "\r\n"sv;
+		}
+
+		std::shared_ptr<const std::string> payload;
+
+		private:
+		sockaddr_in6 address;
+		unsigned connections;
+		unsigned mix_total;
+		std::mt19937_64 rng;
+		int64_t end_time = 0;
+		bool started = false;
+		std::shared_ptr<Sockets> sockets;
+	};
+
+	BenchConnection::BenchConnection(int h, const sockaddr_in6 &remote, Worker &worker):
+		Connection(h, remote, 10000),
+		worker(worker)
+	{
+	}
+
+	Socket::Action BenchConnection::on_output() {
+		if(!connected) {
+			int err = 0;
+			socklen_t len = sizeof err;
+			throw_posix_errno_if( ::getsockopt(handle, SOL_SOCKET, SO_ERROR, &err, &len) );
+			if(err) {
+				LOG(Error) << "connect: " << std::strerror(err);
+				++worker.stats.errors;
+				return REMOVE;
+			}
+			connected = true;
+			send_requests();
+			// Connected after the time was up.
+			if(sent.empty())
+				return REMOVE;
+		}
+		return Connection::on_output();
+	}
+
+	Socket::Action BenchConnection::on_input() {
+		Action act = Connection::on_input();
+		if(act != KEEP && !sent.empty())
+			return lost();
+		return act;
+	}
+
+	Socket::Action BenchConnection::on_timeout() {
+		return lost();
+	}
+
+	Socket::Action BenchConnection::lost() {
+		// Requests still in flight failed. Carry on with a new connection.
+		worker.stats.errors += sent.size();
+		sent.clear();
+		worker.connect();
+		return REMOVE;
+	}
+
+	void BenchConnection::send_requests() {
+		std::string head;
+		while(sent.size() < worker.config.pipeline && !worker.finished()) {
+			head.clear();
+			std::string_view body = worker.next_request(head);
+			output.append(head.data(), head.data() + head.size());
+			queue_ref(body, worker.payload);
+			sent.push_back(monotonic_ns());
+		}
+		output_queued();
+	}
+
+	bool BenchConnection::parse_head() {
+		const char *begin = input.data();
+		const char *end = static_cast<const char*>(memmem(begin, input.size(), "\r\n\r\n", 4));
+		if(!end)
+			return false;
+		head_size = end - begin + 4;
+		std::string_view head(begin, end - begin);
+		if(head.size() < 12 || head.substr(0, 5) != "HTTP/"sv)
+			throw std::runtime_error("bad response");
+		std::from_chars(head.data() + 9, head.data() + 12, status);
+		body_size = 0;
+		server_closes = false;
+		chunked = false;
+		chunk_end = 0;
+		// Look through the header lines for the ones that matter.
+		size_t pos = head.find("\r\n"sv);
+		while(pos != head.npos) {
+			size_t start = pos + 2;
+			pos = head.find("\r\n"sv, start);
+			auto line = head.substr(start, pos == head.npos ? head.npos : pos - start);
+			auto colon = line.find(':');
+			if(colon == line.npos)
+				continue;
+			auto name = line.substr(0, colon);
+			auto value = line.substr(colon + 1);
+			while(!value.empty() && value.front() == ' ')
+				value.remove_prefix(1);
+			if(equal_ignore_case(name, "Content-Length"sv))
+				std::from_chars(value.data(), value.data() + value.size(), body_size);
+			else if(equal_ignore_case(name, "Connection"sv))
+				server_closes = equal_ignore_case(value, "close"sv);
+			else if(equal_ignore_case(name, "Transfer-Encoding"sv))
+				chunked = equal_ignore_case(value, "chunked"sv);
+		}
+		// These have no body whatever the headers say.
+		if(status / 100 == 1 || status == 204 || status == 304) {
+			body_size = 0;
+			chunked = false;
+		}
+		have_head = true;
+		return true;
+	}
+
+	bool BenchConnection::parse_chunks() {
+		std::string_view body(input.data() + head_size, input.size() - head_size);
+		for(;;) {
+			size_t eol = body.find("\r\n"sv, chunk_end);
+			if(eol == body.npos)
+				return false;
+			size_t size = 0;
+			auto r = std::from_chars(body.data() + chunk_end, body.data() + eol, size, 16);
+			if(r.ptr == body.data() + chunk_end)
+				throw std::runtime_error("bad chunk size");
+			if(size) {
+				if(body.size() < eol + 2 + size + 2)
+					return false;
+				chunk_end = eol + 2 + size + 2;
+				continue;
+			}
+			// The last chunk, then trailers up to a blank line.
+			for(size_t line = eol + 2; ; ) {
+				size_t next = body.find("\r\n"sv, line);
+				if(next == body.npos)
+					return false;
+				if(next == line) {
+					body_size = next + 2;
+					return true;
+				}
+				line = next + 2;
+			}
+		}
+	}
+
+	Socket::Action BenchConnection::on_received() {
+		while(!sent.empty()) {
+			if(!have_head && !parse_head())
+				return KEEP;
+			if(chunked && !body_size && !parse_chunks())
+				return KEEP;
+			if(input.size() < head_size + body_size)
+				return KEEP;
+
+			Stats &stats = worker.stats;
+			stats.latency.record(monotonic_ns() - sent.front());
+			sent.pop_front();
+			++stats.requests;
+			++stats.status[status];
+			// 404 is expected for keys that were deleted.
+			if(status >= 400 && status != 404)
+				++stats.errors;
+			stats.bytes += head_size + body_size;
+			input.consume(head_size + body_size);
+			have_head = false;
+
+			if(server_closes || !worker.config.keep_alive) {
+				worker.connect();
+				return REMOVE;
+			}
+			send_requests();
+		}
+		// Done once the time is up and nothing is in flight.
+		return worker.finished() ? REMOVE : KEEP;
+	}
+
+	// PUT every key once so that GETs find something.
+	void prefill(const BenchConfig &config, const sockaddr_in6 &address) {
+		int h = ::socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		throw_posix_errno_if(h < 0);
+		throw_posix_errno_if( ::connect(h, reinterpret_cast<const sockaddr*>(&address), sizeof address) );
+		std::mt19937_64 rng(1);
+		std::string payload(config.value_size.limit(), 'x');
+		std::string batch;
+		std::string reply;
+		std::array<char, 64 * 1024> buf;
+		constexpr unsigned batch_size = 32;
+		for(unsigned first = 0; first < config.keys; first += batch_size) {
+			unsigned n = std::min(batch_size, config.keys - first);
+			batch.clear();
+			for(unsigned key = first; key < first + n; ++key) {
+				size_t size = config.value_size.pick(rng);
+				Worker::append_request(batch, "PUT"sv, key, size, true);
+				batch.append(payload, 0, size);
+			}
+			for(size_t done = 0; done < batch.size(); ) {
+				ssize_t r = ::write(h, batch.data() + done, batch.size() - done);
+				throw_posix_errno_if(r < 0);
+				done += r;
+			}
+			// The responses have no bodies, so count the blank lines.
+			reply.clear();
+			unsigned replies = 0;
+			size_t scanned = 0;
+			while(replies < n) {
+				ssize_t r = ::read(h, buf.data(), buf.size());
+				throw_posix_errno_if(r < 0);
+				if(r == 0)
+					throw std::runtime_error("server closed the connection during prefill");
+				reply.append(buf.data(), r);
+				size_t pos;
+				while((pos = reply.find("\r\n\r\n", scanned)) != reply.npos) {
+					++replies;
+					scanned = pos + 4;
+				}
+			}
+		}
+		::close(h);
+	}
+
+	void report(const BenchConfig &config, const Stats &stats, double seconds) {
+		auto us = [](uint64_t ns) { return ns / 1000.0; };
+		const Histogram &l = stats.latency;
+		if(config.json) {
+			std::cout
+				<< std::fixed << std::setprecision(1)
+				<< "{\"threads\":" << config.threads
+				<< ",\"connections\":" << config.connections
+				<< ",\"pipeline\":" << config.pipeline
+				<< ",\"keep_alive\":" << (config.keep_alive ? "true" : "false")
+				<< ",\"mix\":[" << config.mix[0] << ',' << config.mix[1] << ',' << config.mix[2] << ',' << config.mix[3] << ']'
+				<< ",\"keys\":" << config.keys
+				<< ",\"value_size\":\"" << config.value_size.describe() << '"'
+				<< ",\"seconds\":" << seconds
+				<< ",\"requests\":" << stats.requests
+				<< ",\"errors\":" << stats.errors
+				<< ",\"requests_per_second\":" << stats.requests / seconds
+				<< ",\"bytes_received\":" << stats.bytes
+				<< ",\"status\":{";
+			bool first = true;
+			for(auto &s: stats.status) {
+				std::cout << (first ? "" : ",") << '"' << s.first << "\":" << s.second;
+				first = false;
+			}
+			std::cout
+				<< "},\"latency_us\":{"
+				<< "\"mean\":" << l.mean() / 1000
+				<< ",\"p50\":" << us(l.percentile(0.5))
+				<< ",\"p90\":" << us(l.percentile(0.9))
+				<< ",\"p99\":" << us(l.percentile(0.99))
+				<< ",\"p999\":" << us(l.percentile(0.999))
+				<< ",\"max\":" << us(l.max())
+				<< "}}\n";
+			return;
+		}
+		std::cout
+			<< std::fixed << std::setprecision(1)
+			<< config.threads << " threads, " << config.connections << " connections, pipeline "
+			<< config.pipeline << (config.keep_alive ? ", keep-alive" : ", close") << '\n'
+			<< "mix GET " << config.mix[0] << " PUT " << config.mix[1]
+			<< " POST " << config.mix[2] << " DELETE " << config.mix[3]
+			<< ", " << config.keys << " keys, value size " << config.value_size.describe() << '\n'
+			<< "requests: " << stats.requests << " in " << seconds << " s, "
+			<< stats.requests / seconds << "/s, errors " << stats.errors << '\n'
+			<< "received: " << stats.bytes / 1e6 << " MB, " << stats.bytes / 1e6 / seconds << " MB/s\n"
+			<< "status:";
+		for(auto &s: stats.status) {
+			std::cout << ' ' << s.first << " x" << s.second;
+		}
+		std::cout
+			<< "\nlatency us: mean " << l.mean() / 1000
+			<< ", p50 " << us(l.percentile(0.5))
+			<< ", p90 " << us(l.percentile(0.9))
+			<< ", p99 " << us(l.percentile(0.99))
+			<< ", p999 " << us(l.percentile(0.999))
+			<< ", max " << us(l.max()) << '\n';
+	}
+}
+
+int main(int argc, char *argv[]) {
+	try {
+		BenchConfig config(argc, argv);
+		// Keep standard output for the results.
+		LogWriter log_writer("/dev/stderr");
+		auto address = resolve(config);
+		if(config.prefill && config.mix[Get] + config.mix[Delete])
+			prefill(config, address);
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		for(unsigned i = 0; i < config.threads; ++i) {
+			// Spread the connections as evenly as they go.
+			unsigned n = config.connections / config.threads + (i < config.connections % config.threads);
+			if(n)
+				workers.push_back(std::make_unique<Worker>(config, address, n, i + 1));
+		}
+		int64_t start = monotonic_ns();
+		int64_t until = start + int64_t(config.duration * 1e9);
+		std::vector<std::thread> threads;
+		for(auto &w: workers) {
+			threads.emplace_back([&w, until] { w->run(until); });
+		}
+		Stats total;
+		for(size_t i = 0; i < threads.size(); ++i) {
+			threads[i].join();
+			total.merge(workers[i]->stats);
+		}
+		report(config, total, (monotonic_ns() - start) / 1e9);
+	} catch(const std::exception &e) {
+		std::cerr << "bench: " << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "headers.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace {
+		// Values are compressed once per write, so these lean towards
+		// size over speed, short of the levels that get very slow.
+		constexpr int gzip_level = 6;
+		constexpr int zstd_level = 9;
+
+		std::string_view trim(std::string_view s) {
+			while(!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+				s.remove_prefix(1);
+			while(!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+				s.remove_suffix(1);
+			return s;
+		}
+
+		// A qvalue in thousandths, or -1 if it is malformed.
+		int parse_qvalue(std::string_view q) {
+			if(q.empty() || q.size() > 5 || (q[0] != '0' && q[0] != '1'))
+				return -1;
+			int value = (q[0] - '0') * 1000;
+			if(q.size() == 1)
+				return value;
+			if(q[1] != '.')
+				return -1;
+			int scale = 100;
+			for(char c: q.substr(2)) {
+				if(c < '0' || c > '9')
+					return -1;
+				value += (c - '0') * scale;
+				scale /= 10;
+			}
+			return value > 1000 ? -1 : value;
+		}
+
+#ifdef HAVE_ZLIB
+		std::string gzip(std::string_view data) {
+			z_stream z{};
+			// 16 more window bits asks for a gzip header.
+			if(deflateInit2(&z, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				throw std::runtime_error("deflateInit2 failed");
+			std::string out;
+			out.resize(deflateBound(&z, data.size()));
+			z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+			z.next_out = reinterpret_cast<Bytef*>(out.data());
+			// avail_in and avail_out are 32 bits, so feed large values a
+			// piece at a time.
+			constexpr size_t piece = 1 << 30;
+			size_t in_left = data.size();
+			size_t out_left = out.size();
+			int result;
+			do {
+				z.avail_in = std::min(in_left, piece);
+				z.avail_out = std::min(out_left, piece);
+				uInt in = z.avail_in, avail = z.avail_out;
+				result = deflate(&z, in_left <= piece ? Z_FINISH : Z_NO_FLUSH);
+				in_left -= in - z.avail_in;
+				out_left -= avail - z.avail_out;
+			} while(result == Z_OK);
+			deflateEnd(&z);
+			if(result != Z_STREAM_END)
+				throw std::runtime_error("deflate failed");
+			out.resize(out.size() - out_left);
+			return out;
+		}
+#endif
+
+#ifdef HAVE_ZSTD
+		std::string zstd(std::string_view data) {
+			std::string out;
+			out.resize(ZSTD_compressBound(data.size()));
+			size_t n = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), zstd_level);
+			if(ZSTD_isError(n))
+				throw std::runtime_error("ZSTD_compress: "s + ZSTD_getErrorName(n));
+			out.resize(n);
+			return out;
+		}
+#endif
+	}
+
+	std::string_view encoding_name(Encoding e) {
+		switch(e) {
+			case Encoding::Gzip:
+				return "gzip"sv;
+			case Encoding::Zstd:
+				return "zstd"sv;
+			default:
+				return ""sv;
+		}
+	}
+
+	bool encoding_available(Encoding e) {
+		switch(e) {
+			case Encoding::Identity:
+				return true;
+#ifdef HAVE_ZLIB
+			case Encoding::Gzip:
+				return true;
+#endif
+#ifdef HAVE_ZSTD
+			case Encoding::Zstd:
+				return true;
+#endif
+			default:
+				return false;
+		}
+	}
+
+	bool compressible_type(std::string_view content_type) {
+		auto type = trim(content_type.substr(0, content_type.find(';')));
+		if(type.size() >= 5 && equal_ignore_case(type.substr(0, 5), "text/"sv))
+			return true;
+		// Structured syntax suffixes, such as application/ld+json.
+		for(auto suffix: {"+json"sv, "+xml"sv}) {
+			if(type.size() > suffix.size() && equal_ignore_case(type.substr(type.size() - suffix.size()), suffix))
+				return true;
+		}
+		for(auto t: {
+			"application/json"sv,
+			"application/javascript"sv,
+			"application/xml"sv,
+			"application/x-ndjson"sv,
+			"application/wasm"sv
+		}) {
+			if(equal_ignore_case(type, t))
+				return true;
+		}
+		return false;
+	}
+
+	Encoding preferred_encoding(std::string_view accept_encoding) {
+		// Thousandths, -1 for not mentioned.
+		std::array<int, size_t(Encoding::Count)> q;
+		q.fill(-1);
+		int any = -1;
+		while(!accept_encoding.empty()) {
+			size_t comma = accept_encoding.find(',');
+			auto element = accept_encoding.substr(0, comma);
+			accept_encoding = comma == accept_encoding.npos ? ""sv : accept_encoding.substr(comma + 1);
+			size_t semicolon = element.find(';');
+			auto name = trim(element.substr(0, semicolon));
+			int value = 1000;
+			if(semicolon != element.npos) {
+				auto param = trim(element.substr(semicolon + 1));
+				if(param.size() < 2 || (param[0] | 0x20) != 'q' || param[1] != '=')
+					continue;
+				value = parse_qvalue(param.substr(2));
+				if(value < 0)
+					continue;
+			}
+			if(equal_ignore_case(name, "gzip"sv) || equal_ignore_case(name, "x-gzip"sv))
+				q[size_t(Encoding::Gzip)] = value;
+			else if(equal_ignore_case(name, "zstd"sv))
+				q[size_t(Encoding::Zstd)] = value;
+			else if(name == "*"sv)
+				any = value;
+		}
+		Encoding best = Encoding::Identity;
+		int best_q = 0;
+		// Later codings win ties.
+		for(auto e: {Encoding::Gzip, Encoding::Zstd}) {
+			int value = q[size_t(e)] < 0 ? any : q[size_t(e)];
+			if(encoding_available(e) && value > 0 && value >= best_q) {
+				best = e;
+				best_q = value;
+			}
+		}
+		return best;
+	}
+
+	std::string compress(Encoding e, std::string_view data) {
+		switch(e) {
+#ifdef HAVE_ZLIB
+			case Encoding::Gzip:
+				return gzip(data);
+#endif
+#ifdef HAVE_ZSTD
+			case Encoding::Zstd:
+				return zstd(data);
+#endif
+			default:
+				return std::string();
+		}
+	}
+};
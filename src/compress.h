@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace zlynx {
+	// Content codings a response body can be stored in. Which ones are
+	// built in depends on the libraries found by cmake.
+	enum class Encoding : uint8_t {
+		Identity,
+		Gzip,
+		Zstd,
+		Count
+	};
+
+	// The name as in Content-Encoding, empty for Identity.
+	std::string_view encoding_name(Encoding e);
+	bool encoding_available(Encoding e);
+
+	// Whether a body of this type is worth compressing. Text, JSON, XML
+	// and the like are. Images, video and archives already are
+	// compressed.
+	bool compressible_type(std::string_view content_type);
+
+	// The best available coding the client accepts by its
+	// Accept-Encoding. zstd wins a tie with gzip.
+	Encoding preferred_encoding(std::string_view accept_encoding);
+
+	// data in the coding, or an empty string if it is not available.
+	std::string compress(Encoding e, std::string_view data);
+};
@@ -4,6 +4,7 @@
 #include <functional>
 #include <charconv>
 #include "config.h"
+#include "http.h"
 
 namespace zlynx {
 	namespace {
@@ -17,10 +18,70 @@ namespace zlynx {
 			std::function<void(Config&, const std::string_view)> f;
 		};
 
-		const std::array<config_key, 3> keys = {
+		const std::array<config_key, 21> keys = {
 			config_key{"SERVER_PORT", "port", 'p', 1, [](Config& c, const std::string_view v) {
 				 std::from_chars(v.begin(), v.end(), c.port);
 			}},
+			config_key{"SERVER_EVENTS", "events", 'e', 1, [](Config& c, const std::string_view v) {
+				 c.events = parse_event_backend_type(v);
+			}},
+			config_key{"SERVER_THREADS", "threads", 't', 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.threads);
+				 if(c.threads < 1)
+					 c.threads = 1;
+			}},
+			config_key{"SERVER_IDLE_TIMEOUT", "idle-timeout", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.idle_timeout);
+			}},
+			config_key{"SERVER_HEADER_TIMEOUT", "header-timeout", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.header_timeout);
+			}},
+			config_key{"SERVER_MAX_HEADER_SIZE", "max-header-size", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.max_header_size);
+			}},
+			config_key{"SERVER_MAX_BODY_SIZE", "max-body-size", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.max_body_size);
+			}},
+			config_key{"SERVER_COMPRESS_MIN_SIZE", "compress-min-size", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.compress_min_size);
+			}},
+			config_key{"SERVER_COMPRESS_SET_SIZE", "compress-set-size", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.compress_set_size);
+			}},
+			config_key{"SERVER_CACHE_SIZE", "cache-size", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.cache_size);
+			}},
+			config_key{"SERVER_UPLOAD_BUDGET", "upload-budget", 0, 1, [](Config& c, const std::string_view v) {
+				 std::from_chars(v.begin(), v.end(), c.upload_budget);
+			}},
+			config_key{"SERVER_LOG_LEVEL", "log-level", 0, 1, [](Config& c, const std::string_view v) {
+				 c.log_level = parse_log_level(v);
+			}},
+			config_key{"SERVER_LOG_FILE", "log-file", 0, 1, [](Config& c, const std::string_view v) {
+				 c.log_file = v;
+			}},
+			config_key{"SERVER_ACCESS_LOG", "access-log", 0, 1, [](Config& c, const std::string_view v) {
+				 c.access_log = v;
+			}},
+			config_key{"SERVER_ACCESS_LOG_FORMAT", "access-log-format", 0, 1, [](Config& c, const std::string_view v) {
+				 c.access_log_format = parse_access_log_format(v);
+			}},
+			config_key{"SERVER_DATA_DIR", "data-dir", 0, 1, [](Config& c, const std::string_view v) {
+				 c.data_dir = v;
+			}},
+			config_key{"SERVER_SNAPSHOT", "snapshot", 0, 1, [](Config& c, const std::string_view v) {
+				 c.snapshot = v;
+			}},
+			config_key{"SERVER_DOC_ROOT", "doc-root", 0, 1, [](Config& c, const std::string_view v) {
+				 c.doc_root = v;
+			}},
+			config_key{"SERVER_DOC_PREFIX", "doc-prefix", 0, 1, [](Config& c, const std::string_view v) {
+				 c.doc_prefix = v;
+				 if(c.doc_prefix.empty() || c.doc_prefix.front() != '/')
+					 c.doc_prefix.insert(0, 1, '/');
+				 if(c.doc_prefix.back() != '/')
+					 c.doc_prefix += '/';
+			}},
 			config_key{"", "help", 'h', 0, display_help},
 			config_key{"", "test",   0, 0, display_help},
 		};
@@ -47,7 +108,20 @@ namespace zlynx {
 	};
 
 	Config::Config(int argc, char *argv[]):
-		port(8080)
+		port(8080),
+		events(EventBackendType::Epoll),
+		threads(1),
+		idle_timeout(5000),
+		header_timeout(5000),
+		max_header_size(HTTPLimits().max_header_size),
+		max_body_size(HTTPLimits().max_body_size),
+		compress_min_size(1024),
+		compress_set_size(1024 * 1024),
+		cache_size(0),
+		upload_budget(256 << 20),
+		log_level(LogLevel::Info),
+		access_log_format(AccessLogFormat::Text),
+		doc_prefix("/static/")
 	{
 		// Environment variables
 		for(auto& k: keys) {
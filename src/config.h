@@ -1,8 +1,48 @@
+#include <cstddef>
 #include <cstdint>
+#include <string>
+#include "events.h"
+#include "log.h"
 
 namespace zlynx {
 	struct Config  {
 		std::uint16_t port;
+		EventBackendType events;
+		unsigned threads;
+		// Milliseconds
+		std::int64_t idle_timeout;
+		std::int64_t header_timeout;
+		// Bytes. Larger requests are refused with a 431 or 413.
+		std::size_t max_header_size;
+		std::size_t max_body_size;
+		// Bytes. Stored values from compress_min_size up are sent
+		// compressed to clients that accept it, zero for never. From
+		// compress_set_size up they are compressed when stored.
+		std::size_t compress_min_size;
+		std::size_t compress_set_size;
+		// Bytes of memory the Datastore may take before it evicts keys,
+		// zero for no limit.
+		std::size_t cache_size;
+		// Bytes of memory uploads in progress may take together, zero
+		// for no limit. More are refused with a 503.
+		std::size_t upload_budget;
+		LogLevel log_level;
+		// Empty for standard output.
+		std::string log_file;
+		// Empty for no access log.
+		std::string access_log;
+		AccessLogFormat access_log_format;
+		// Directory of the persistent Datastore. Empty keeps it in
+		// memory.
+		std::string data_dir;
+		// Snapshot file loaded on startup and written on SIGUSR1 or a
+		// POST to /_snapshot. Empty for none. With a data_dir it is only
+		// loaded if the directory has no records yet.
+		std::string snapshot;
+		// Directory of static files served under doc_prefix. Empty for
+		// none.
+		std::string doc_root;
+		std::string doc_prefix;
 
 		Config(int argc, char *argv[]);
 	};
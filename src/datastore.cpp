@@ -1,21 +1,940 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <unistd.h>
 #include "datastore.h"
+#include "errors.h"
+#include "headers.h"
+#include "log.h"
+#include "metrics.h"
+#include "snapshot.h"
 
 namespace zlynx {
-	Entry Datastore::get(std::string_view key) const {
-		auto r = store.find(std::string(key));
-		if(r == store.end())
+	using namespace std::literals;
+
+	namespace {
+		// Always 16 digits, so a tag can be filled in after the head
+		// around it is rendered.
+		void format_tag(uint64_t tag, char *digits) {
+			for(size_t i = 16; i--; tag >>= 4) {
+				digits[i] = "0123456789abcdef"[tag & 15];
+			}
+		}
+	}
+
+	Datastore::EntryInternal::EntryInternal(std::string_view type, std::string_view shared_type, size_t length, int64_t max_age):
+		content_type(shared_type)
+	{
+		std::string head = render_head(type, length, ""sv, quote_tag(0), format_http_date(0), max_age);
+		std::string_view copied_type = shared_type.empty() ? type : ""sv;
+		size = copied_type.size() + head.size() + length;
+		data.reset(new char[size]);
+		char *p = data.get();
+		for(auto [part, view]: {
+			std::pair{copied_type, &content_type},
+			std::pair{std::string_view(head), &response_head}
+		}) {
+			if(part.empty())
+				continue;
+			std::memcpy(p, part.data(), part.size());
+			*view = std::string_view(p, part.size());
+			p += part.size();
+		}
+		body = std::string_view(p, length);
+		find_validators();
+		// The date in the head is filled in later by stamp.
+		this->max_age = max_age;
+	}
+
+	Datastore::EntryInternal::EntryInternal(const Entry& e, std::string_view shared_type):
+		EntryInternal(e.content_type, shared_type, e.body.size(), e.max_age)
+	{
+		std::memcpy(const_cast<char*>(body.data()), e.body.data(), e.body.size());
+		stamp(e.modified);
+	}
+
+	Datastore::EntryInternal::EntryInternal(const SegmentLog::Location &l):
+		content_type(l.record.content_type),
+		body(l.record.body),
+		response_head(l.record.response_head),
+		mapping(l.segment),
+		segment(l.segment.get()),
+		offset(l.offset),
+		size(l.record.size)
+	{
+		find_validators();
+	}
+
+	Datastore::EntryInternal::EntryInternal(const Entry& e, std::shared_ptr<const void> mapping):
+		content_type(e.content_type),
+		body(e.body),
+		response_head(e.response_head),
+		mapping(std::move(mapping))
+	{
+		find_validators();
+	}
+
+	void Datastore::EntryInternal::stamp(int64_t modified) {
+		this->modified = modified;
+		format_tag(entity_tag(content_type, body), const_cast<char*>(etag.data()) + 1);
+		std::string date = format_http_date(modified);
+		std::memcpy(const_cast<char*>(last_modified.data()), date.data(), date.size());
+	}
+
+	const Datastore::EntryInternal::Variant* Datastore::EntryInternal::variant(Encoding e) const {
+		const VariantSlot &slot = variants[size_t(e) - 1];
+		if(slot.state.load(std::memory_order_acquire) == VariantSlot::Ready)
+			return slot.variant.get();
+		return nullptr;
+	}
+
+	bool Datastore::EntryInternal::claim(Encoding e) const {
+		uint8_t state = VariantSlot::Empty;
+		return variants[size_t(e) - 1].state.compare_exchange_strong(state, VariantSlot::Building);
+	}
+
+	void Datastore::EntryInternal::unclaim(Encoding e) const {
+		variants[size_t(e) - 1].state.store(VariantSlot::Empty, std::memory_order_relaxed);
+	}
+
+	const Datastore::EntryInternal::Variant* Datastore::EntryInternal::build(Encoding e) const {
+		VariantSlot &slot = variants[size_t(e) - 1];
+		std::string compressed;
+		try {
+			compressed = compress(e, body);
+		} catch(const std::exception &ex) {
+			LOG(Warning) << "compressing a value: " << ex.what();
+		}
+		// Less than an eighth smaller is not worth a Vary miss in caches
+		// and the memory.
+		if(compressed.empty() || compressed.size() > body.size() - body.size() / 8) {
+			slot.state.store(VariantSlot::None, std::memory_order_relaxed);
+			return nullptr;
+		}
+		auto v = std::make_unique<Variant>();
+		auto name = encoding_name(e);
+		std::string tag;
+		// A tag of its own, as it is a different representation.
+		if(etag.size() > 2)
+			tag.append(etag.substr(0, etag.size() - 1)).append("-"sv).append(name).append("\""sv);
+		v->body = std::move(compressed);
+		v->head = render_head(content_type, v->body.size(), name, tag, last_modified, max_age);
+		if(!tag.empty())
+			v->etag = std::string_view(v->head).substr(v->head.find(tag), tag.size());
+		slot.variant = std::move(v);
+		slot.state.store(VariantSlot::Ready, std::memory_order_release);
+		return slot.variant.get();
+	}
+
+	size_t Datastore::EntryInternal::memory() const {
+		// With the control block of make_shared, about two pointers. A
+		// value in a mapped file is counted as if it were in memory.
+		return sizeof(*this) + 2 * sizeof(void*) + (data ? size : response_head.size() + body.size());
+	}
+
+	void Datastore::EntryInternal::find_validators() {
+		auto header = [this](std::string_view name) {
+			size_t start = response_head.find(name);
+			if(start == response_head.npos)
+				return std::string_view();
+			start += name.size();
+			return response_head.substr(start, response_head.find('\r', start) - start);
+		};
+		etag = header("\r\nETag: "sv);
+		last_modified = header("\r\nLast-Modified: "sv);
+		if(!parse_http_date(last_modified, modified))
+			modified = 0;
+		// A time to live is only of use from a known time.
+		if(!modified || !parse_max_age(header("\r\nCache-Control: "sv), max_age))
+			max_age = -1;
+	}
+
+	Datastore::Node* Datastore::Node::make(std::string_view key, Value value) {
+		if(key.size() > UINT32_MAX)
+			throw std::length_error("key too long");
+		void *p = ::operator new(sizeof(Node) + key.size());
+		Node *n = new(p) Node(std::move(value), key.size());
+		std::memcpy(static_cast<char*>(p) + sizeof(Node), key.data(), key.size());
+		return n;
+	}
+
+	void Datastore::Node::destroy(void *p) {
+		static_cast<Node*>(p)->~Node();
+		::operator delete(p);
+	}
+
+	Datastore::ContentTypes::~ContentTypes() {
+		for(auto &t: types) {
+			delete t.load(std::memory_order_relaxed);
+		}
+	}
+
+	std::string_view Datastore::ContentTypes::intern(std::string_view type) {
+		if(type.size() > max_size)
+			return std::string_view();
+		size_t h = std::hash<std::string_view>()(type);
+		std::unique_ptr<const std::string> added;
+		for(size_t i = 0; i < max_probes; ++i) {
+			auto &slot = types[(h + i) % capacity];
+			const std::string *t = slot.load(std::memory_order_acquire);
+			if(!t) {
+				if(!added)
+					added = std::make_unique<const std::string>(type);
+				// Another thread may fill the slot first, with this type
+				// or another.
+				if(slot.compare_exchange_strong(t, added.get(), std::memory_order_acq_rel))
+					return *added.release();
+			}
+			if(*t == type)
+				return *t;
+		}
+		return std::string_view();
+	}
+
+	Datastore::Datastore() {
+		for(auto &s: shards) {
+			s.table.store(new Table(initial_slots));
+			account(sizeof(Table) + initial_slots * sizeof(Slot));
+		}
+	}
+
+	Datastore::Datastore(const std::string &directory):
+		Datastore()
+	{
+		log = std::make_unique<SegmentLog>(directory);
+		loading = true;
+		size_t records = 0;
+		log->recover([this, &records](const std::shared_ptr<Segment> &segment, uint64_t offset, const Record &r) {
+			uint64_t h = hash(r.key);
+			Shard &s = shards[shard_index(h)];
+			std::lock_guard lock(s.mutex);
+			Value v;
+			if(!r.tombstone)
+				v = std::make_shared<const EntryInternal>(SegmentLog::Location{segment, offset, r});
+			discard(exchange(s, h, r.key, std::move(v)));
+			++records;
+		});
+		loading = false;
+		size_t keys = 0;
+		bool expiring = false;
+		for(auto &s: shards) {
+			s.retired.reclaim();
+			keys += s.count;
+			expiring |= !s.expiring.empty();
+		}
+		LOG(Info) << "loaded " << keys << " keys from " << records << " records";
+		if(expiring)
+			start_expiry();
+		log->start([this](const std::shared_ptr<Segment> &segment, uint64_t offset, const Record &r) {
+			relocate(*segment, offset, r);
+		});
+	}
+
+	Datastore::~Datastore() {
+		{
+			std::lock_guard lock(expiry_mutex);
+			stopping = true;
+		}
+		expiry_wake.notify_all();
+		if(expiry_thread.joinable())
+			expiry_thread.join();
+		{
+			std::lock_guard lock(compress_mutex);
+			compress_stopping = true;
+		}
+		compress_wake.notify_all();
+		if(compress_thread.joinable())
+			compress_thread.join();
+		if(dump_thread.joinable())
+			dump_thread.join();
+		// Stop compaction before the index goes.
+		log.reset();
+		for(auto &s: shards) {
+			Table *t = s.table.load();
+			for(size_t i = 0; i < t->size(); ++i) {
+				Node *n = t->slots[i].node.load(std::memory_order_relaxed);
+				if(n && n != tombstone())
+					Node::destroy(n);
+			}
+			delete_table(t);
+		}
+	}
+
+	uint64_t Datastore::hash(std::string_view key) {
+		return std::hash<std::string_view>()(key);
+	}
+
+	size_t Datastore::shard_index(uint64_t h) {
+		// Mix so the shard does not use the same bits as the bucket.
+		return (h * 0x9e3779b97f4a7c15) >> (64 - shard_bits);
+	}
+
+	void Datastore::delete_table(void *p) {
+		// The nodes are still in the table that replaced it.
+		delete static_cast<Table*>(p);
+	}
+
+	std::string Datastore::render_head(
+		std::string_view content_type, size_t length,
+		std::string_view encoding,
+		std::string_view etag, std::string_view last_modified,
+		int64_t max_age
+	) {
+		std::array<char, 32> digits;
+		auto result = std::to_chars(digits.begin(), digits.end(), length);
+		std::string head;
+		head
+			.append("HTTP/1.1 200 OK\r\nContent-Type: "sv)
+			.append(content_type)
+			.append("\r\nContent-Length: "sv)
+			.append(digits.data(), result.ptr);
+		// Ranges are only served from the value as it is.
+		if(encoding.empty())
+			head.append("\r\nAccept-Ranges: bytes"sv);
+		else
+			head.append("\r\nContent-Encoding: "sv).append(encoding);
+		if(compressible_type(content_type))
+			head.append("\r\nVary: Accept-Encoding"sv);
+		if(!etag.empty())
+			head.append("\r\nETag: "sv).append(etag);
+		if(!last_modified.empty())
+			head.append("\r\nLast-Modified: "sv).append(last_modified);
+		if(max_age >= 0)
+			head.append("\r\nCache-Control: max-age="sv).append(std::to_string(max_age));
+		head.append("\r\n\r\n"sv);
+		return head;
+	}
+
+	std::string Datastore::quote_tag(uint64_t tag) {
+		std::string quoted(18, '"');
+		format_tag(tag, quoted.data() + 1);
+		return quoted;
+	}
+
+	uint64_t Datastore::entity_tag(std::string_view content_type, std::string_view body) {
+		return checksum(body, checksum(content_type));
+	}
+
+	int64_t Datastore::wall_clock() {
+		timespec ts;
+		::clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec;
+	}
+
+	Entry Datastore::get(std::string_view key, Encoding encoding, int64_t now) const {
+		uint64_t h = hash(key);
+		const Shard &s = shards[shard_index(h)];
+		Value v;
+		{
+			EpochGuard guard;
+			const Table *t = s.table.load(std::memory_order_acquire);
+			for(size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+				const Slot &slot = t->slots[i];
+				Node *n = slot.node.load(std::memory_order_acquire);
+				if(!n)
+					break;
+				// The hash is stored before the node, so it is this
+				// node's or a later one's if the slot was reused.
+				if(n != tombstone() && slot.hash.load(std::memory_order_relaxed) == h && n->key() == key) {
+					// Only written when the CLOCK hand has cleared it, so
+					// hot keys are not written on every read.
+					if(!n->referenced.load(std::memory_order_relaxed))
+						n->referenced.store(true, std::memory_order_relaxed);
+					v = n->value;
+					break;
+				}
+			}
+		}
+		// An expired value is left for the expiry thread.
+		if(!v || v->expired(now)) {
+			thread_metrics().add(Counter::StoreMisses);
 			return Entry();
+		}
+		thread_metrics().add(Counter::StoreHits);
+		// Until the compression thread has made it, the value is sent
+		// as it is.
+		if(encoding != Encoding::Identity && compressible(*v)) {
+			if(auto variant = v->variant(encoding)) {
+				return Entry{
+					v->content_type,
+					variant->body,
+					v,
+					variant->head,
+					variant->etag,
+					v->last_modified,
+					v->modified,
+					encoding_name(encoding),
+					v->max_age
+				};
+			}
+			compress_later(v, encoding);
+		}
 		return Entry{
-			r->second.content_type,
-			r->second.body
+			v->content_type,
+			v->body,
+			v,
+			v->response_head,
+			v->etag,
+			v->last_modified,
+			v->modified,
+			""sv,
+			v->max_age
 		};
 	}
 
-	void Datastore::set(std::string_view key, Entry value) {
-		store[std::string(key)] = EntryInternal(value);
+	bool Datastore::compressible(const EntryInternal &v) const {
+		return
+			compress_min_size && v.body.size() >= compress_min_size &&
+			compressible_type(v.content_type);
+	}
+
+	void Datastore::compress_later(const Value &v, Encoding e) const {
+		if(!v->claim(e))
+			return;
+		std::call_once(compress_started, [this] {
+			compress_thread = std::thread([this] { run_compression(); });
+		});
+		{
+			std::lock_guard lock(compress_mutex);
+			if(compress_queue.size() < max_compress_queue) {
+				compress_queue.push_back(CompressJob{v, e});
+				compress_wake.notify_one();
+				return;
+			}
+		}
+		v->unclaim(e);
+	}
+
+	void Datastore::run_compression() const {
+		std::unique_lock lock(compress_mutex);
+		for(;;) {
+			compress_wake.wait(lock, [this] { return compress_stopping || !compress_queue.empty(); });
+			if(compress_stopping)
+				return;
+			CompressJob job = std::move(compress_queue.front());
+			compress_queue.pop_front();
+			lock.unlock();
+			// Not worth making for a value that has already gone.
+			if(job.value->variant_bytes.load(std::memory_order_relaxed) & EntryInternal::removed) {
+				job.value->unclaim(job.encoding);
+			} else if(auto variant = job.value->build(job.encoding)) {
+				account_variant(*job.value, *variant);
+			}
+			job.value.reset();
+			lock.lock();
+		}
+	}
+
+	void Datastore::precompress(const Value &v) const {
+		if(v->body.size() < compress_set_size || !compressible(*v))
+			return;
+		for(size_t e = 1; e < size_t(Encoding::Count); ++e) {
+			if(encoding_available(Encoding(e)))
+				compress_later(v, Encoding(e));
+		}
+	}
+
+	Datastore::Value Datastore::insert(std::string_view key, const std::function<Value()> &make) {
+		uint64_t h = hash(key);
+		Shard &s = shards[shard_index(h)];
+		Value v;
+		Value old;
+		{
+			std::lock_guard lock(s.mutex);
+			v = make();
+			old = exchange(s, h, key, v);
+			discard(old);
+			s.retired.reclaim();
+		}
+		precompress(v);
+		evict(v.get());
+		return old;
+	}
+
+	bool Datastore::set(std::string_view key, Entry value) {
+		// Read once, for the value and for whether the old one expired.
+		int64_t now = wall_clock();
+		if(!value.modified)
+			value.modified = now;
+		Value v;
+		// Copy the value before taking the lock.
+		if(!log)
+			v = std::make_shared<const EntryInternal>(value, content_types.intern(value.content_type));
+		Value old = insert(key, [&]() {
+			// Appending under the shard lock keeps the records of a key
+			// in the same order on disk as in the index.
+			if(log) {
+				auto head = render_head(
+					value.content_type, value.body.size(), ""sv,
+					quote_tag(entity_tag(value.content_type, value.body)),
+					format_http_date(value.modified),
+					value.max_age
+				);
+				v = std::make_shared<const EntryInternal>(log->append(key, value.content_type, head, value.body));
+			}
+			return v;
+		});
+		// An expired value is as good as gone.
+		return old && !old->expired(now);
+	}
+
+	Datastore::Spool::Spool(int handle, std::string_view content_type, int64_t max_age):
+		handle(handle),
+		content_type(content_type),
+		max_age(max_age),
+		tag(checksum(content_type)),
+		block(new char[block_size])
+	{
+	}
+
+	Datastore::Spool::~Spool() {
+		::close(handle);
+	}
+
+	void Datastore::Spool::append(std::string_view data) {
+		while(!data.empty()) {
+			size_t n = std::min(data.size(), block_size - used);
+			std::memcpy(block.get() + used, data.data(), n);
+			used += n;
+			data.remove_prefix(n);
+			if(used == block_size)
+				flush();
+		}
+	}
+
+	void Datastore::Spool::flush() {
+		std::string_view data(block.get(), used);
+		tag = checksum(data, tag);
+		while(!data.empty()) {
+			ssize_t n = ::pwrite(handle, data.data(), data.size(), written);
+			if(n < 0 && errno == EINTR)
+				continue;
+			throw_posix_errno_if(n < 0);
+			data.remove_prefix(n);
+			written += n;
+		}
+		used = 0;
+	}
+
+	bool Datastore::Upload::append(std::string_view data) {
+		data = data.substr(0, remaining());
+		if(value) {
+			std::memcpy(const_cast<char*>(value->body.data()) + received, data.data(), data.size());
+		} else if(spool) {
+			spool->append(data);
+		} else {
+			// Doubled as it fills, with the budget charged for each step.
+			std::string &body = buffer->body;
+			if(body.size() + data.size() > body.capacity()) {
+				size_t capacity = std::max(body.size() + data.size(), 2 * body.capacity());
+				if(!reservation.grow(capacity - body.capacity(), budget))
+					return false;
+				body.reserve(capacity);
+			}
+			body.append(data);
+		}
+		received += data.size();
+		return true;
+	}
+
+	Datastore::Upload Datastore::start_upload(std::string_view content_type, size_t size, int64_t max_age) {
+		size_t memory = log ? Spool::block_size : size == unknown_size ? 0 : size;
+		size_t taken = upload_bytes.fetch_add(memory, std::memory_order_relaxed);
+		Reservation reservation(&upload_bytes, memory);
+		if(upload_budget && taken + memory > upload_budget)
+			return Upload();
+		Upload u;
+		if(log)
+			u.spool = std::make_unique<Spool>(log->temp_file(), content_type, max_age);
+		else if(size == unknown_size)
+			u.buffer = std::make_unique<Buffer>(Buffer{std::string(content_type), max_age, std::string()});
+		else
+			u.value = std::make_shared<EntryInternal>(content_type, content_types.intern(content_type), size, max_age);
+		u.reservation = std::move(reservation);
+		u.budget = upload_budget;
+		u.size = size;
+		return u;
+	}
+
+	bool Datastore::set(std::string_view key, Upload value) {
+		if(!value || (value.size != unknown_size && value.remaining()))
+			throw std::logic_error("set of an incomplete upload");
+		if(value.buffer) {
+			Entry e{value.buffer->content_type, value.buffer->body};
+			e.max_age = value.buffer->max_age;
+			return set(key, e);
+		}
+		value.size = value.received;
+		int64_t now = wall_clock();
+		Value old;
+		if(log) {
+			// The record is appended once the body is complete. Holding
+			// a place in a segment open for a slow upload would hold up
+			// sealing.
+			Spool &spool = *value.spool;
+			spool.flush();
+			auto head = render_head(
+				spool.content_type, value.size, ""sv,
+				quote_tag(spool.tag), format_http_date(now), spool.max_age
+			);
+			old = insert(key, [&]() {
+				return std::make_shared<const EntryInternal>(
+					log->append(key, spool.content_type, head, spool.handle, value.size)
+				);
+			});
+		} else {
+			value.value->stamp(now);
+			Value v = std::move(value.value);
+			old = insert(key, [&v]() { return v; });
+		}
+		// An expired value is as good as gone.
+		return old && !old->expired(now);
 	}
 
 	void Datastore::del(std::string_view key) {
-		store.erase(std::string(key));
+		uint64_t h = hash(key);
+		Shard &s = shards[shard_index(h)];
+		std::lock_guard lock(s.mutex);
+		if(!find(s, h, key))
+			return;
+		if(log)
+			log->append(key, ""sv, ""sv, ""sv, true);
+		discard(exchange(s, h, key, nullptr));
+		s.retired.reclaim();
+	}
+
+	Datastore::Value Datastore::find(const Shard &s, uint64_t h, std::string_view key) const {
+		const Table *t = s.table.load(std::memory_order_relaxed);
+		for(size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+			const Slot &slot = t->slots[i];
+			Node *n = slot.node.load(std::memory_order_relaxed);
+			if(!n)
+				return nullptr;
+			if(n != tombstone() && slot.hash.load(std::memory_order_relaxed) == h && n->key() == key)
+				return n->value;
+		}
+	}
+
+	Datastore::Value Datastore::exchange(Shard &s, uint64_t h, std::string_view key, Value v) {
+		Table *t = s.table.load(std::memory_order_relaxed);
+		if(v && v->max_age >= 0)
+			schedule(s, h, *v);
+		// Where a new key goes, the first tombstone or the empty slot
+		// that ended the probe.
+		Slot *free = nullptr;
+		for(size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+			Slot &slot = t->slots[i];
+			Node *n = slot.node.load(std::memory_order_relaxed);
+			if(n == tombstone()) {
+				if(!free)
+					free = &slot;
+				continue;
+			}
+			if(!n) {
+				if(!free)
+					free = &slot;
+				break;
+			}
+			if(slot.hash.load(std::memory_order_relaxed) == h && n->key() == key) {
+				// Readers may be on n. Put a replacement in its place.
+				replace(s, slot, n, v ? make_node(key, std::move(v)) : nullptr);
+				return n->value;
+			}
+		}
+		if(v) {
+			bool empty = !free->node.load(std::memory_order_relaxed);
+			free->hash.store(h, std::memory_order_relaxed);
+			free->node.store(make_node(key, std::move(v)), std::memory_order_release);
+			++s.count;
+			if(empty && ++s.used > t->limit())
+				rebuild(s);
+		}
+		return nullptr;
+	}
+
+	Datastore::Node* Datastore::make_node(std::string_view key, Value v) {
+		account(sizeof(Node) + key.size() + v->memory());
+		return Node::make(key, std::move(v));
+	}
+
+	void Datastore::replace(Shard &s, Slot &slot, Node *n, Node *replacement) {
+		slot.node.store(replacement ? replacement : tombstone(), std::memory_order_release);
+		if(!replacement)
+			--s.count;
+		if(n->value->max_age >= 0)
+			--s.expiring_count;
+		account(-int64_t(removed_memory(*n)));
+		s.retired.retire(n, Node::destroy);
+	}
+
+	void Datastore::schedule(Shard &s, uint64_t h, const EntryInternal &v) {
+		s.expiring.push_back(Expiry{v.expires(), h, &v});
+		std::push_heap(s.expiring.begin(), s.expiring.end(), std::greater<>());
+		++s.expiring_count;
+		if(s.expiring.size() > 2 * s.expiring_count + 64) {
+			// Mostly replaced values, which could otherwise pile up for
+			// as long as their time to live.
+			auto end = std::remove_if(s.expiring.begin(), s.expiring.end(), [&](const Expiry &e) {
+				return e.value != &v && !find_slot(s, e.hash, e.value);
+			});
+			s.expiring.erase(end, s.expiring.end());
+			std::make_heap(s.expiring.begin(), s.expiring.end(), std::greater<>());
+		}
+		if(!loading)
+			start_expiry();
+	}
+
+	Datastore::Slot* Datastore::find_slot(const Shard &s, uint64_t h, const EntryInternal *v) const {
+		Table *t = s.table.load(std::memory_order_relaxed);
+		for(size_t i = h & t->mask; ; i = (i + 1) & t->mask) {
+			Slot &slot = t->slots[i];
+			Node *n = slot.node.load(std::memory_order_relaxed);
+			if(!n)
+				return nullptr;
+			if(n != tombstone() && n->value.get() == v)
+				return &slot;
+		}
+	}
+
+	void Datastore::start_expiry() {
+		std::call_once(expiry_started, [this] {
+			expiry_thread = std::thread([this] {
+				std::unique_lock lock(expiry_mutex);
+				while(!stopping) {
+					lock.unlock();
+					bool more = false;
+					try {
+						more = expire(wall_clock());
+					} catch(const std::exception &e) {
+						LOG(Error) << "expiring keys: " << e.what();
+					}
+					lock.lock();
+					if(!more)
+						expiry_wake.wait_for(lock, std::chrono::seconds(1), [this] { return stopping; });
+				}
+			});
+		});
+	}
+
+	bool Datastore::expire(int64_t now) {
+		bool more = false;
+		for(auto &s: shards) {
+			std::lock_guard lock(s.mutex);
+			size_t n = 0;
+			for(; n < expire_batch && !s.expiring.empty() && s.expiring.front().when <= now; ++n) {
+				Expiry e = s.expiring.front();
+				std::pop_heap(s.expiring.begin(), s.expiring.end(), std::greater<>());
+				s.expiring.pop_back();
+				Slot *slot = find_slot(s, e.hash, e.value);
+				if(!slot)
+					continue;
+				Node *node = slot->node.load(std::memory_order_relaxed);
+				// A new value at the address of a replaced one has its
+				// own entry.
+				if(!node->value->expired(now))
+					continue;
+				if(log)
+					log->append(node->key(), ""sv, ""sv, ""sv, true);
+				discard(node->value);
+				replace(s, *slot, node, nullptr);
+				thread_metrics().add(Counter::StoreExpirations);
+			}
+			if(n == expire_batch)
+				more = true;
+			s.retired.reclaim();
+		}
+		return more;
+	}
+
+	void Datastore::account(int64_t bytes) const {
+		resident.fetch_add(bytes, std::memory_order_relaxed);
+		if(bytes >= 0)
+			thread_metrics().add(Counter::StoreBytesAdded, bytes);
+		else
+			thread_metrics().add(Counter::StoreBytesRemoved, -bytes);
+	}
+
+	void Datastore::account_variant(const EntryInternal &v, const EntryInternal::Variant &variant) const {
+		uint64_t bytes = sizeof(variant) + variant.head.size() + variant.body.size();
+		uint64_t counted = v.variant_bytes.load(std::memory_order_relaxed);
+		while(!(counted & EntryInternal::removed)) {
+			if(v.variant_bytes.compare_exchange_weak(counted, counted + bytes, std::memory_order_relaxed)) {
+				account(bytes);
+				return;
+			}
+		}
+	}
+
+	size_t Datastore::removed_memory(const Node &n) {
+		uint64_t variants = n.value->variant_bytes.fetch_or(EntryInternal::removed, std::memory_order_relaxed);
+		return sizeof(Node) + n.key_size + n.value->memory() + (variants & ~EntryInternal::removed);
+	}
+
+	void Datastore::set_cache_size(size_t bytes) {
+		if(log && bytes) {
+			LOG(Warning) << "cache size ignored, values are kept on disk";
+			return;
+		}
+		cache_size = bytes;
+		evict();
+	}
+
+	void Datastore::evict(const EntryInternal *keep) {
+		if(!cache_size)
+			return;
+		// The shards are taken in turn, as if their slots were one clock.
+		// A shard whose keys were all read since the hand last passed is
+		// left to the next round. Two rounds with nothing evicted means
+		// the empty index is over the size.
+		for(size_t idle = 0; idle < 2 * shards.size() && resident.load(std::memory_order_relaxed) > int64_t(cache_size); ) {
+			Shard &s = shards[clock_shard.fetch_add(1, std::memory_order_relaxed) % shards.size()];
+			std::lock_guard lock(s.mutex);
+			if(evict_one(s, keep)) {
+				idle = 0;
+				s.retired.reclaim();
+			} else {
+				++idle;
+			}
+		}
+	}
+
+	bool Datastore::evict_one(Shard &s, const EntryInternal *keep) {
+		Table *t = s.table.load(std::memory_order_relaxed);
+		for(size_t i = 0; i < t->size(); ++i) {
+			Slot &slot = t->slots[s.hand++ & t->mask];
+			Node *n = slot.node.load(std::memory_order_relaxed);
+			if(!n || n == tombstone() || n->value.get() == keep)
+				continue;
+			if(n->referenced.load(std::memory_order_relaxed)) {
+				n->referenced.store(false, std::memory_order_relaxed);
+				continue;
+			}
+			replace(s, slot, n, nullptr);
+			thread_metrics().add(Counter::StoreEvictions);
+			return true;
+		}
+		return false;
+	}
+
+	void Datastore::discard(const Value &v) {
+		if(v && v->segment)
+			log->discard(*v->segment, v->size);
+	}
+
+	void Datastore::relocate(const Segment &segment, uint64_t offset, const Record &r) {
+		uint64_t h = hash(r.key);
+		Shard &s = shards[shard_index(h)];
+		std::lock_guard lock(s.mutex);
+		Value current = find(s, h, r.key);
+		if(r.tombstone) {
+			// Still needed while it may hide an older record of the key.
+			if(!current && log->has_older(segment))
+				log->append(r.key, ""sv, ""sv, ""sv, true);
+			return;
+		}
+		if(!current || current->segment != &segment || current->offset != offset)
+			return;
+		exchange(s, h, r.key, std::make_shared<const EntryInternal>(
+			log->append(r.key, r.content_type, r.response_head, r.body)
+		));
+		s.retired.reclaim();
+	}
+
+	void Datastore::dump(const std::string &path) const {
+		SnapshotWriter writer(path);
+		std::vector<std::pair<std::string, Value>> batch;
+		for(auto &s: shards) {
+			// Copy out one shard at a time. The values stay alive for
+			// the write without holding up reclamation.
+			{
+				EpochGuard guard;
+				const Table *t = s.table.load(std::memory_order_acquire);
+				for(size_t i = 0; i < t->size(); ++i) {
+					Node *n = t->slots[i].node.load(std::memory_order_acquire);
+					if(n && n != tombstone())
+						batch.emplace_back(n->key(), n->value);
+				}
+			}
+			for(auto &[key, v]: batch) {
+				writer.add(key, v->content_type, v->response_head, v->body);
+			}
+			batch.clear();
+		}
+		writer.finish();
+	}
+
+	bool Datastore::start_dump() {
+		if(snapshot_path.empty() || dumping.exchange(true))
+			return false;
+		if(dump_thread.joinable())
+			dump_thread.join();
+		dump_thread = std::thread([this, path = snapshot_path] {
+			try {
+				LOG(Info) << "writing snapshot " << path;
+				dump(path);
+				LOG(Info) << "wrote snapshot " << path;
+			} catch(const std::exception &e) {
+				LOG(Error) << "snapshot " << path << ": " << e.what();
+			}
+			dumping = false;
+		});
+		return true;
+	}
+
+	size_t Datastore::restore(const std::string &path) {
+		if(log && !log->empty())
+			throw std::runtime_error("the data directory already has records, which take precedence");
+		auto file = std::make_shared<const SnapshotFile>(path);
+		size_t count = 0;
+		file->for_each([&](auto key, auto content_type, auto response_head, auto body) {
+			auto v = std::make_shared<const EntryInternal>(Entry{content_type, body, nullptr, response_head}, file);
+			if(log) {
+				// Persistent values have to be in the segments. They keep
+				// the time they were set.
+				set(key, Entry{v->content_type, v->body, nullptr, v->response_head, v->etag, v->last_modified, v->modified, ""sv, v->max_age});
+			} else {
+				uint64_t h = hash(key);
+				Shard &s = shards[shard_index(h)];
+				std::lock_guard lock(s.mutex);
+				exchange(s, h, key, std::move(v));
+			}
+			++count;
+		});
+		for(auto &s: shards) {
+			std::lock_guard lock(s.mutex);
+			s.retired.reclaim();
+		}
+		evict();
+		return count;
+	}
+
+	void Datastore::rebuild(Shard &s) {
+		// Readers may still be probing the old table, so fill a new one
+		// and retire the old one whole. The nodes move over as they are.
+		Table *old = s.table.load(std::memory_order_relaxed);
+		size_t n = old->size();
+		if(s.count > n / 2)
+			n *= 2;
+		Table *t = new Table(n);
+		for(size_t i = 0; i < old->size(); ++i) {
+			Node *node = old->slots[i].node.load(std::memory_order_relaxed);
+			if(!node || node == tombstone())
+				continue;
+			uint64_t h = old->slots[i].hash.load(std::memory_order_relaxed);
+			size_t j = h & t->mask;
+			while(t->slots[j].node.load(std::memory_order_relaxed))
+				j = (j + 1) & t->mask;
+			t->slots[j].hash.store(h, std::memory_order_relaxed);
+			t->slots[j].node.store(node, std::memory_order_relaxed);
+		}
+		s.used = s.count;
+		account(int64_t(t->size()) * sizeof(Slot) - int64_t(old->size()) * sizeof(Slot));
+		s.table.store(t, std::memory_order_release);
+		s.retired.retire(old, delete_table);
 	}
-}
+}
\ No newline at end of file
@@ -1,32 +1,517 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "compress.h"
+#include "epoch.h"
+#include "segments.h"
 
 namespace zlynx {
 	struct Entry {
 		std::string_view content_type;
 		std::string_view body;
+		// Keeps the stored value alive while the views are in use, even
+		// if another thread replaces or deletes it.
+		std::shared_ptr<const void> owner = nullptr;
+		// Filled in by get(). The status line and headers of an HTTP/1.1
+		// 200 response with this body, ending with the blank line.
+		std::string_view response_head = std::string_view();
+		// Also from get(), as in the response head. The ETag is a hash
+		// of the body and content type with its quotes. modified is
+		// when the value was set in seconds since the epoch and
+		// last_modified the same as an HTTP date. Values stored before
+		// these were kept have neither. set() takes modified if given.
+		std::string_view etag = std::string_view();
+		std::string_view last_modified = std::string_view();
+		int64_t modified = 0;
+		// The Content-Encoding of body, empty for none.
+		std::string_view content_encoding = std::string_view();
+		// How many seconds after modified the value expires, or -1 for
+		// never. It is sent as Cache-Control: max-age. set() takes it.
+		int64_t max_age = -1;
 	};
 
+	// Datastore may be shared by every event loop thread.
+	// Keys are hashed into shards. Each shard is an open addressing
+	// hash table whose slots are atomic, so get() never takes a lock.
+	// Writers lock only their shard and never change a published node.
+	// They put a new node in its slot and retire the old one.
+	// With a cache size the store is a bounded cache. Once the keys,
+	// values and index take more memory than that, writers evict keys
+	// that have not been read lately, by CLOCK.
+	// Values can have a time to live. Once it has passed get() does not
+	// find them, and a background thread removes them in the order they
+	// expire.
+	// Values are held in memory, or with a directory they are appended
+	// to a SegmentLog there and read back from its mapped segments. The
+	// index is rebuilt from the segments on startup.
 	class Datastore {
+		struct EntryInternal;
+		struct Spool;
+		struct Buffer;
+
+		// Bytes of the upload budget, given back when destroyed.
+		class Reservation {
+			public:
+			Reservation() {}
+			Reservation(std::atomic<size_t> *pool, size_t bytes):
+				pool(pool),
+				bytes(bytes)
+			{
+			}
+			Reservation(Reservation &&r):
+				pool(r.pool),
+				bytes(std::exchange(r.bytes, 0))
+			{
+			}
+			Reservation& operator=(Reservation &&r) {
+				release();
+				pool = r.pool;
+				bytes = std::exchange(r.bytes, 0);
+				return *this;
+			}
+			~Reservation() { release(); }
+
+			// Take more bytes. Returns false if the pool is then over
+			// budget, zero for no limit.
+			bool grow(size_t more, size_t budget) {
+				size_t taken = pool->fetch_add(more, std::memory_order_relaxed);
+				bytes += more;
+				return !budget || taken + more <= budget;
+			}
+
+			private:
+			std::atomic<size_t> *pool = nullptr;
+			size_t bytes = 0;
+
+			void release() {
+				if(bytes)
+					pool->fetch_sub(bytes, std::memory_order_relaxed);
+				bytes = 0;
+			}
+		};
+
 		public:
-		Entry get(std::string_view key) const;
-		void set(std::string_view, Entry value);
+		// A value whose body is filled in as it arrives, so a large
+		// upload is copied once, into the place it is kept. Pass it to
+		// set() when complete.
+		// In memory that is the value itself. With a directory the body
+		// is written a block at a time to an unlinked file there, and
+		// copied by the kernel into a segment by set().
+		// A body of unknown size in memory is gathered in a buffer that
+		// grows as it arrives, and copied into the value by set().
+		class Upload {
+			public:
+			Upload() {}
+
+			// Copy in the next part of the body. Bytes past the size
+			// given to start_upload are dropped. Returns false if a
+			// body of unknown size no longer fits in the upload budget.
+			bool append(std::string_view data);
+			size_t remaining() const { return size - received; }
+			explicit operator bool() const { return value || spool || buffer; }
+
+			private:
+			friend class Datastore;
+			std::shared_ptr<EntryInternal> value;
+			std::unique_ptr<Spool> spool;
+			std::unique_ptr<Buffer> buffer;
+			Reservation reservation;
+			size_t budget = 0;
+			uint64_t size = 0;
+			uint64_t received = 0;
+		};
+		// The size to start an upload with when it is not known ahead,
+		// as for a chunked body.
+		static constexpr size_t unknown_size = SIZE_MAX;
+
+		Datastore();
+		explicit Datastore(const std::string &directory);
+		~Datastore();
+		Datastore(const Datastore&) = delete;
+		void operator=(const Datastore&) = delete;
+
+		// With an encoding, a compressed copy of the value is returned
+		// if there is one. The first such request after a set queues it
+		// to be made on a background thread, unless set already did, and
+		// gets the value as it is. So do values that are small, of a
+		// type that does not compress, or do not get much smaller.
+		// now is the time in seconds since the epoch, for values with a
+		// max_age. Zero returns them even if expired.
+		Entry get(std::string_view key, Encoding encoding = Encoding::Identity, int64_t now = 0) const;
+		// Returns true if an existing value was replaced.
+		bool set(std::string_view, Entry value);
+		// Returns an empty Upload if the uploads in progress already take
+		// the upload budget. size may be unknown_size.
+		Upload start_upload(std::string_view content_type, size_t size, int64_t max_age = -1);
+		// Throws if the upload is not complete.
+		bool set(std::string_view key, Upload value);
 		void del(std::string_view key);
 
+		// Write every key to a snapshot file. Writers are not held up,
+		// so each key is saved with its value at some point during the
+		// dump.
+		void dump(const std::string &path) const;
+		// Where start_dump writes. Empty turns snapshots off.
+		void set_snapshot_path(const std::string &path) { snapshot_path = path; }
+		bool snapshots_enabled() const { return !snapshot_path.empty(); }
+		// Run dump to the snapshot path in the background. Returns false
+		// if one is already running.
+		bool start_dump();
+
+		// Compress values of at least min_size bytes for clients that
+		// accept it, zero for never. From set_size up set queues them
+		// for compressing instead of the first GET.
+		void set_compression(size_t min_size, size_t set_size) {
+			compress_min_size = min_size;
+			compress_set_size = set_size;
+		}
+		// The most memory uploads in progress may take together, zero
+		// for no limit. In memory that is the size of each, with a
+		// directory one block.
+		void set_upload_budget(size_t bytes) { upload_budget = bytes; }
+		// Evict keys to keep the memory they take under bytes, zero for
+		// no limit. Only for a store held in memory.
+		void set_cache_size(size_t bytes);
+		// Memory the keys, values and index take, as counted against the
+		// cache size. Values still being sent after they were replaced
+		// or evicted are not counted.
+		size_t resident_bytes() const { return std::max<int64_t>(resident.load(std::memory_order_relaxed), 0); }
+		// Load a snapshot written by dump. In memory the values are
+		// left in the mapped file and paged in when first read. Returns
+		// the number of keys loaded.
+		// With a directory the segments win. A snapshot is only loaded
+		// into one with no records yet, and throws otherwise, since it
+		// would bring back older values and deleted keys.
+		size_t restore(const std::string &path);
+
 		private:
 		struct EntryInternal {
+			std::string_view content_type;
+			std::string_view body;
+			// Rendered once when stored instead of on every GET.
+			std::string_view response_head;
+			// Views into response_head.
+			std::string_view etag;
+			std::string_view last_modified;
+			int64_t modified = 0;
+			// From the Cache-Control in response_head.
+			int64_t max_age = -1;
+			// The bytes of an in memory value.
+			std::unique_ptr<char[]> data;
+			// Or the mapped file they are in.
+			std::shared_ptr<const void> mapping;
+			// For a persistent value, where its record is.
+			Segment *segment = nullptr;
+			uint64_t offset = 0;
+			uint64_t size = 0;
+
+			// Room for a body of size, to be filled in. shared_type is
+			// content_type from ContentTypes, or empty to keep a copy.
+			EntryInternal(std::string_view content_type, std::string_view shared_type, size_t size, int64_t max_age);
+			EntryInternal(const Entry& e, std::string_view shared_type);
+			EntryInternal(const SegmentLog::Location &l);
+			EntryInternal(const Entry& e, std::shared_ptr<const void> mapping);
+
+			// A compressed copy of the body with its own response head.
+			struct Variant {
+				std::string head;
+				std::string body;
+				std::string_view etag;
+			};
+			// Built at most once, on the compression thread. Until Ready,
+			// the value is sent as it is.
+			struct VariantSlot {
+				enum State : uint8_t {
+					Empty,
+					Building,
+					Ready,
+					// Not available or not worth it.
+					None
+				};
+				std::atomic<uint8_t> state{Empty};
+				std::unique_ptr<const Variant> variant;
+			};
+			// By Encoding, less Identity.
+			mutable std::array<VariantSlot, size_t(Encoding::Count) - 1> variants;
+			// The memory of the variants, counted as resident when they
+			// were made. Once the value has left the index, removed is
+			// set and variants made after are not counted.
+			static constexpr uint64_t removed = uint64_t(1) << 63;
+			mutable std::atomic<uint64_t> variant_bytes{0};
+
+			// The variant for e once it is Ready, else null.
+			const Variant* variant(Encoding e) const;
+			// Take on making the variant for e. False if it is made, on
+			// its way or not worth it. unclaim gives it up unmade.
+			bool claim(Encoding e) const;
+			void unclaim(Encoding e) const;
+			// Make the claimed variant. Returns null if it is not worth
+			// keeping.
+			const Variant* build(Encoding e) const;
+			// What the value takes in memory, less its variants.
+			size_t memory() const;
+			int64_t expires() const { return modified + max_age; }
+			bool expired(int64_t now) const { return now && max_age >= 0 && now >= expires(); }
+
+			// Fill in the ETag and Last-Modified of a head rendered for
+			// the body before it was complete.
+			void stamp(int64_t modified);
+			// Find them in a head that was stored.
+			void find_validators();
+		};
+		typedef std::shared_ptr<const EntryInternal> Value;
+
+		// The body of an upload to a persistent store, on its way to an
+		// unlinked file in the directory. The ETag is worked out as the
+		// blocks are written, which as a multiple of 8 bytes gives the
+		// same checksum as the whole body.
+		struct Spool {
+			static constexpr size_t block_size = 64 * 1024;
+
+			Spool(int handle, std::string_view content_type, int64_t max_age);
+			~Spool();
+			Spool(const Spool&) = delete;
+			void operator=(const Spool&) = delete;
+
+			void append(std::string_view data);
+			// Write out the last partial block.
+			void flush();
+
+			const int handle;
+			const std::string content_type;
+			const int64_t max_age;
+			uint64_t tag;
+			uint64_t written = 0;
+			std::unique_ptr<char[]> block;
+			size_t used = 0;
+		};
+
+		// The body of an upload of unknown size to a store in memory.
+		struct Buffer {
 			std::string content_type;
+			int64_t max_age;
 			std::string body;
+		};
+
+		// A key and its value. The key is stored inline after the node,
+		// so a node is one allocation. Nodes are never changed once
+		// published but for the reference bit, a new value gets a new
+		// node.
+		struct Node {
+			const Value value;
+			const uint32_t key_size;
+			// Set by get, cleared as the CLOCK hand passes. Starts set so
+			// a new key gets one pass.
+			mutable std::atomic<bool> referenced{true};
+
+			std::string_view key() const {
+				return std::string_view(reinterpret_cast<const char*>(this + 1), key_size);
+			}
+			static Node* make(std::string_view key, Value value);
+			static void destroy(void *p);
 
-			EntryInternal() {}
-			EntryInternal(const Entry& e):
-				content_type(e.content_type),
-				body(e.body)
+			private:
+			Node(Value value, uint32_t key_size):
+				value(std::move(value)),
+				key_size(key_size)
 			{
 			}
 		};
-		std::unordered_map<std::string, EntryInternal> store;
+
+		// Open addressing with linear probing. The hash is kept next to
+		// the node pointer, so a probe only follows the pointer of a
+		// likely match. An empty slot ends a probe. A deleted key leaves
+		// a tombstone until the table is rebuilt.
+		struct Slot {
+			std::atomic<uint64_t> hash;
+			std::atomic<Node*> node;
+		};
+
+		struct Table {
+			explicit Table(size_t n):
+				mask(n - 1),
+				slots(new Slot[n]())
+			{
+			}
+			size_t size() const { return mask + 1; }
+			// Slots that are not empty, live or tombstones, are kept to
+			// this so every probe reaches an empty one.
+			size_t limit() const { return size() / 4 * 3; }
+
+			const size_t mask;
+			std::unique_ptr<Slot[]> slots;
+		};
+
+		static Node* tombstone() { return reinterpret_cast<Node*>(alignof(Node)); }
+
+		// The value is only compared with the one in the index, never
+		// followed, as it may have been freed.
+		struct Expiry {
+			int64_t when;
+			uint64_t hash;
+			const EntryInternal *value;
+
+			bool operator>(const Expiry &e) const { return when > e.when; }
+		};
+
+		struct alignas(64) Shard {
+			std::atomic<Table*> table;
+			// Held by writers only.
+			std::mutex mutex;
+			// Live keys.
+			size_t count = 0;
+			// Slots in use, keys and tombstones.
+			size_t used = 0;
+			// The CLOCK hand, a slot index.
+			size_t hand = 0;
+			// A min heap of when keys expire. Entries of values that were
+			// replaced or deleted stay until they come up, or until they
+			// are most of the heap.
+			std::vector<Expiry> expiring;
+			// Live keys with a time to live.
+			size_t expiring_count = 0;
+			RetireList retired;
+		};
+
+		// Content types stored once each, shared by the values of that
+		// type. Types are never removed, so only the first few hundred
+		// are taken. Values of other types keep their own copy. Lookups
+		// and inserts are lock free.
+		class ContentTypes {
+			public:
+			ContentTypes() {}
+			~ContentTypes();
+			ContentTypes(const ContentTypes&) = delete;
+			void operator=(const ContentTypes&) = delete;
+
+			// The stored copy of type, or an empty view if it cannot be
+			// added.
+			std::string_view intern(std::string_view type);
+
+			private:
+			static constexpr size_t capacity = 256;
+			static constexpr size_t max_probes = 16;
+			static constexpr size_t max_size = 256;
+			std::array<std::atomic<const std::string*>, capacity> types{};
+		};
+
+		static constexpr size_t shard_bits = 6;
+		static constexpr size_t initial_slots = 16;
+
+		std::array<Shard, size_t(1) << shard_bits> shards;
+		mutable ContentTypes content_types;
+		std::unique_ptr<SegmentLog> log;
+		std::string snapshot_path;
+		std::atomic<bool> dumping{false};
+		std::thread dump_thread;
+		size_t compress_min_size = 1024;
+		size_t compress_set_size = 1024 * 1024;
+		size_t cache_size = 0;
+		size_t upload_budget = 256 << 20;
+		std::atomic<size_t> upload_bytes{0};
+		mutable std::atomic<int64_t> resident{0};
+		// The shard eviction goes to next, so each gives up its share.
+		std::atomic<size_t> clock_shard{0};
+		// Variants waiting to be made, by a thread started with the
+		// first. Past max_compress_queue they are left for a later GET
+		// to ask for again.
+		struct CompressJob {
+			Value value;
+			Encoding encoding;
+		};
+		mutable std::deque<CompressJob> compress_queue;
+		mutable std::thread compress_thread;
+		mutable std::once_flag compress_started;
+		mutable std::mutex compress_mutex;
+		mutable std::condition_variable compress_wake;
+		bool compress_stopping = false;
+		static constexpr size_t max_compress_queue = 1024;
+		// Started with the first key that has a time to live, but not
+		// while the index is being loaded from the segments.
+		std::thread expiry_thread;
+		std::once_flag expiry_started;
+		std::mutex expiry_mutex;
+		std::condition_variable expiry_wake;
+		bool stopping = false;
+		bool loading = false;
+		static constexpr size_t expire_batch = 1024;
+
+		static uint64_t hash(std::string_view key);
+		static size_t shard_index(uint64_t h);
+		static void delete_table(void *p);
+		static std::string render_head(
+			std::string_view content_type, size_t length,
+			std::string_view encoding,
+			std::string_view etag, std::string_view last_modified,
+			int64_t max_age
+		);
+		// An ETag header value for a tag.
+		static std::string quote_tag(uint64_t tag);
+		static uint64_t entity_tag(std::string_view content_type, std::string_view body);
+		static int64_t wall_clock();
+		// Make a new table for the live keys, twice the size if they
+		// take more than half of it.
+		void rebuild(Shard &s);
+		// A node for key counted as resident.
+		Node* make_node(std::string_view key, Value v);
+		// Put replacement, or a tombstone, in the slot of n in a locked
+		// shard and retire n.
+		void replace(Shard &s, Slot &slot, Node *n, Node *replacement);
+		// Add bytes to the resident memory, or take them off if negative.
+		void account(int64_t bytes) const;
+		// Count a variant a reader made, unless the value was removed.
+		void account_variant(const EntryInternal &v, const EntryInternal::Variant &variant) const;
+		// The memory of a node and its value, variants and all. Only
+		// once the node is out of the index.
+		static size_t removed_memory(const Node &n);
+		// Add the value just put in the index to the expiry heap.
+		void schedule(Shard &s, uint64_t h, const EntryInternal &v);
+		// The slot holding v, if it is still in the index.
+		Slot* find_slot(const Shard &s, uint64_t h, const EntryInternal *v) const;
+		void start_expiry();
+		// Remove what has expired by now, a batch per shard. Returns
+		// true if a batch was not enough.
+		bool expire(int64_t now);
+		// Evict keys until under the cache size, at most one per shard
+		// in turn. A writer keeps the value it stored, which would
+		// otherwise go if it had to evict much for it.
+		// Variants made by get are counted at once but only evicted for
+		// by the next write.
+		void evict(const EntryInternal *keep = nullptr);
+		// Move the CLOCK hand of a locked shard up to one turn, to a key
+		// not read since it last passed, and remove it. Returns false if
+		// there is none.
+		bool evict_one(Shard &s, const EntryInternal *keep);
+		bool compressible(const EntryInternal &v) const;
+		// Queue the variant for e to be made, unless it is made or on
+		// its way.
+		void compress_later(const Value &v, Encoding e) const;
+		void run_compression() const;
+		// Queue the variants of a large value as it is stored.
+		void precompress(const Value &v) const;
+		// These need the shard locked.
+		Value find(const Shard &s, uint64_t h, std::string_view key) const;
+		// Link in v for key, or unlink key if v is empty. Returns the
+		// value it replaced.
+		Value exchange(Shard &s, uint64_t h, std::string_view key, Value v);
+		// Link in the value make returns for key, called with the shard
+		// locked, then compress and evict for it. Returns the value it
+		// replaced.
+		Value insert(std::string_view key, const std::function<Value()> &make);
+		// Count a replaced value as dead in its segment.
+		void discard(const Value &v);
+		// Move a record out of a segment being compacted if it is live.
+		void relocate(const Segment &segment, uint64_t offset, const Record &r);
 	};
 }
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "epoch.h"
+
+namespace zlynx {
+	namespace {
+		// One per thread that has used an EpochGuard. Records are never
+		// freed, a record is reused after its thread exits.
+		struct alignas(64) Record {
+			// The epoch seen on entering the guard, zero when idle.
+			std::atomic<uint64_t> epoch{0};
+			std::atomic<bool> used{true};
+			Record *next = nullptr;
+		};
+
+		std::atomic<uint64_t> global_epoch{1};
+		std::atomic<Record*> records{nullptr};
+
+		Record* acquire_record() {
+			for(Record *r = records.load(std::memory_order_acquire); r; r = r->next) {
+				bool expected = false;
+				if(r->used.compare_exchange_strong(expected, true))
+					return r;
+			}
+			Record *r = new Record;
+			r->next = records.load(std::memory_order_relaxed);
+			while(!records.compare_exchange_weak(r->next, r))
+				/* empty */;
+			return r;
+		}
+
+		struct ThreadRecord {
+			Record *record = acquire_record();
+			unsigned depth = 0;
+
+			~ThreadRecord() {
+				record->epoch.store(0, std::memory_order_release);
+				record->used.store(false, std::memory_order_release);
+			}
+		};
+
+		thread_local ThreadRecord local;
+
+		uint64_t oldest_active() {
+			uint64_t oldest = std::numeric_limits<uint64_t>::max();
+			for(Record *r = records.load(std::memory_order_acquire); r; r = r->next) {
+				uint64_t e = r->epoch.load(std::memory_order_acquire);
+				if(e)
+					oldest = std::min(oldest, e);
+			}
+			return oldest;
+		}
+	}
+
+	EpochGuard::EpochGuard() {
+		if(local.depth++ == 0) {
+			local.record->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			// Publish the epoch before reading any shared pointers.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+	}
+
+	EpochGuard::~EpochGuard() {
+		if(--local.depth == 0)
+			local.record->epoch.store(0, std::memory_order_release);
+	}
+
+	RetireList::~RetireList() {
+		// The owner is being destroyed so there can be no readers left.
+		for(auto &item: items) {
+			item.deleter(item.p);
+		}
+	}
+
+	void RetireList::retire(void *p, void (*deleter)(void*)) {
+		// The unlink must be visible before the epoch moves on. Readers
+		// entering the new epoch cannot reach p.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		items.push_back( Item{ global_epoch.fetch_add(1), p, deleter } );
+	}
+
+	void RetireList::reclaim() {
+		if(items.empty())
+			return;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint64_t oldest = oldest_active();
+		auto keep = std::partition(begin(items), end(items), [oldest](const Item &item) {
+			return item.epoch >= oldest;
+		});
+		for(auto i = keep; i != end(items); ++i) {
+			i->deleter(i->p);
+		}
+		items.erase(keep, end(items));
+	}
+};
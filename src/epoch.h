@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace zlynx {
+	// Epoch based reclamation.
+	// Readers hold an EpochGuard while following shared pointers without
+	// a lock. Writers unlink an object and hand it to a RetireList, which
+	// frees it once no reader that could have seen it is still inside a
+	// guard.
+
+	class EpochGuard {
+		public:
+		EpochGuard();
+		~EpochGuard();
+		EpochGuard(const EpochGuard&) = delete;
+		void operator=(const EpochGuard&) = delete;
+	};
+
+	// Not thread safe. Each RetireList belongs to one writer lock.
+	class RetireList {
+		public:
+		RetireList() {}
+		~RetireList();
+		RetireList(const RetireList&) = delete;
+		void operator=(const RetireList&) = delete;
+
+		template<class T>
+		void retire(T *p) {
+			retire(p, [](void *x) { delete static_cast<T*>(x); });
+		}
+		void retire(void *p, void (*deleter)(void*));
+
+		// Free everything that no reader can still be using.
+		void reclaim();
+
+		private:
+		struct Item {
+			uint64_t epoch;
+			void *p;
+			void (*deleter)(void*);
+		};
+		std::vector<Item> items;
+	};
+};
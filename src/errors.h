@@ -5,8 +5,6 @@
 #include <cerrno>
 
 namespace zlynx {
-	extern std::ostream& logger;
-
 	class
 	posix_error : public std::runtime_error {
 		private:
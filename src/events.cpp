@@ -0,0 +1,140 @@
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "events.h"
+#include "errors.h"
+
+namespace zlynx {
+	EventBackendType parse_event_backend_type(std::string_view name) {
+		if(name == "poll")
+			return EventBackendType::Poll;
+		if(name == "epoll")
+			return EventBackendType::Epoll;
+		if(name == "uring")
+			return EventBackendType::Uring;
+		throw std::invalid_argument("unknown event backend: " + std::string(name));
+	}
+
+	std::unique_ptr<EventBackend> make_event_backend(EventBackendType type) {
+		switch(type) {
+			case EventBackendType::Poll:
+				return std::make_unique<PollBackend>();
+			case EventBackendType::Epoll:
+				return std::make_unique<EpollBackend>();
+			case EventBackendType::Uring:
+				break;
+		}
+		throw std::invalid_argument("unknown event backend");
+	}
+
+	void PollBackend::add(int fd, short events) {
+		unsigned h = fd;
+		if(positions.size() <= h) {
+			positions.resize(h+1);
+		}
+		positions[h] = pollfds.size();
+		pollfds.emplace_back( pollfd{ fd, events, 0 } );
+	}
+
+	void PollBackend::modify(int fd, short events) {
+		pollfds.at(positions.at(fd)).events = events;
+	}
+
+	void PollBackend::remove(int fd) {
+		// Swap the last entry into the hole.
+		unsigned pos = positions.at(fd);
+		pollfds.at(pos) = pollfds.back();
+		positions[pollfds[pos].fd] = pos;
+		pollfds.pop_back();
+	}
+
+	void PollBackend::wait(std::vector<Event> &ready, int timeout_ms) {
+		ready.clear();
+		int poll_result = ::poll(pollfds.data(), pollfds.size(), timeout_ms);
+		if(poll_result < 0) {
+			if(errno == EINTR)
+				return;
+			throw_posix_errno_if(poll_result < 0);
+		}
+		for(auto &p: pollfds) {
+			if(p.revents) {
+				ready.emplace_back( Event{ p.fd, p.revents } );
+				p.revents = 0;
+			}
+		}
+	}
+
+	static
+	uint32_t to_epoll_events(short events) {
+		uint32_t result = 0;
+		if(events & POLLIN)
+			result |= EPOLLIN;
+		if(events & POLLPRI)
+			result |= EPOLLPRI;
+		if(events & POLLOUT)
+			result |= EPOLLOUT;
+		return result;
+	}
+
+	static
+	short from_epoll_events(uint32_t events) {
+		short result = 0;
+		if(events & EPOLLIN)
+			result |= POLLIN;
+		if(events & EPOLLPRI)
+			result |= POLLPRI;
+		if(events & EPOLLOUT)
+			result |= POLLOUT;
+		if(events & EPOLLERR)
+			result |= POLLERR;
+		if(events & EPOLLHUP)
+			result |= POLLHUP;
+		return result;
+	}
+
+	EpollBackend::EpollBackend():
+		handle(::epoll_create1(EPOLL_CLOEXEC))
+	{
+		throw_posix_errno_if(handle < 0);
+	}
+
+	EpollBackend::~EpollBackend() {
+		::close(handle);
+	}
+
+	void EpollBackend::add(int fd, short events) {
+		epoll_event ev{};
+		ev.events = to_epoll_events(events);
+		ev.data.fd = fd;
+		throw_posix_errno_if( ::epoll_ctl(handle, EPOLL_CTL_ADD, fd, &ev) );
+	}
+
+	void EpollBackend::modify(int fd, short events) {
+		epoll_event ev{};
+		ev.events = to_epoll_events(events);
+		ev.data.fd = fd;
+		throw_posix_errno_if( ::epoll_ctl(handle, EPOLL_CTL_MOD, fd, &ev) );
+	}
+
+	void EpollBackend::remove(int fd) {
+		// Harmless if the handle was already closed; the kernel drops
+		// closed handles from the set by itself.
+		::epoll_ctl(handle, EPOLL_CTL_DEL, fd, nullptr);
+	}
+
+	void EpollBackend::wait(std::vector<Event> &ready, int timeout_ms) {
+		ready.clear();
+		std::array<epoll_event, max_events> events;
+		int n = ::epoll_wait(handle, events.data(), events.size(), timeout_ms);
+		if(n < 0) {
+			if(errno == EINTR)
+				return;
+			throw_posix_errno_if(n < 0);
+		}
+		for(int i = 0; i < n; ++i) {
+			ready.emplace_back( Event{ events[i].data.fd, from_epoll_events(events[i].events) } );
+		}
+	}
+};
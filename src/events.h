@@ -0,0 +1,73 @@
+#pragma once
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <poll.h>
+
+namespace zlynx {
+	enum class EventBackendType {
+		Poll,
+		Epoll,
+		// Not an EventBackend. Selects the UringSockets engine.
+		Uring
+	};
+
+	EventBackendType parse_event_backend_type(std::string_view name);
+
+	// EventBackend watches a set of handles for readiness on behalf of a
+	// Sockets container. Event flags are the poll() POLL* values whatever
+	// the underlying mechanism is.
+	class EventBackend {
+		public:
+		struct Event {
+			int fd;
+			short revents;
+		};
+
+		virtual ~EventBackend() {}
+
+		// Registrations persist until remove() is called.
+		virtual void add(int fd, short events) = 0;
+		virtual void modify(int fd, short events) = 0;
+		virtual void remove(int fd) = 0;
+
+		// Wait up to timeout_ms and fill ready with the handles that have
+		// events. ready is cleared first.
+		virtual void wait(std::vector<Event> &ready, int timeout_ms) = 0;
+	};
+
+	// The original poll() loop. Each wait scans every registered handle.
+	class PollBackend : public EventBackend {
+		public:
+		void add(int fd, short events) override;
+		void modify(int fd, short events) override;
+		void remove(int fd) override;
+		void wait(std::vector<Event> &ready, int timeout_ms) override;
+
+		private:
+		std::vector<pollfd> pollfds;
+		// Indexed by handle, the position of that handle in pollfds.
+		std::vector<unsigned> positions;
+	};
+
+	// Level-triggered epoll. The kernel keeps the registrations so each
+	// wait only costs as much as the number of ready handles.
+	class EpollBackend : public EventBackend {
+		public:
+		EpollBackend();
+		~EpollBackend();
+		EpollBackend(const EpollBackend&) = delete;
+		void operator=(const EpollBackend&) = delete;
+
+		void add(int fd, short events) override;
+		void modify(int fd, short events) override;
+		void remove(int fd) override;
+		void wait(std::vector<Event> &ready, int timeout_ms) override;
+
+		private:
+		static constexpr size_t max_events = 256;
+		int handle;
+	};
+
+	std::unique_ptr<EventBackend> make_event_backend(EventBackendType type = EventBackendType::Epoll);
+};
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#include "errors.h"
+#include "files.h"
+#include "headers.h"
+#include "log.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace {
+		struct MimeType {
+			std::string_view extension;
+			std::string_view type;
+		};
+
+		// Sorted by extension for the binary search.
+		constexpr std::array mime_types = {
+			MimeType{"7z", "application/x-7z-compressed"},
+			MimeType{"bz2", "application/x-bzip2"},
+			MimeType{"css", "text/css; charset=utf-8"},
+			MimeType{"csv", "text/csv; charset=utf-8"},
+			MimeType{"deb", "application/vnd.debian.binary-package"},
+			MimeType{"gif", "image/gif"},
+			MimeType{"gz", "application/gzip"},
+			MimeType{"htm", "text/html; charset=utf-8"},
+			MimeType{"html", "text/html; charset=utf-8"},
+			MimeType{"ico", "image/vnd.microsoft.icon"},
+			MimeType{"jar", "application/java-archive"},
+			MimeType{"jpeg", "image/jpeg"},
+			MimeType{"jpg", "image/jpeg"},
+			MimeType{"js", "text/javascript; charset=utf-8"},
+			MimeType{"json", "application/json"},
+			MimeType{"map", "application/json"},
+			MimeType{"md", "text/markdown; charset=utf-8"},
+			MimeType{"mjs", "text/javascript; charset=utf-8"},
+			MimeType{"mp4", "video/mp4"},
+			MimeType{"otf", "font/otf"},
+			MimeType{"pdf", "application/pdf"},
+			MimeType{"png", "image/png"},
+			MimeType{"rpm", "application/x-rpm"},
+			MimeType{"svg", "image/svg+xml"},
+			MimeType{"tar", "application/x-tar"},
+			MimeType{"tgz", "application/gzip"},
+			MimeType{"ttf", "font/ttf"},
+			MimeType{"txt", "text/plain; charset=utf-8"},
+			MimeType{"wasm", "application/wasm"},
+			MimeType{"webm", "video/webm"},
+			MimeType{"webp", "image/webp"},
+			MimeType{"woff", "font/woff"},
+			MimeType{"woff2", "font/woff2"},
+			MimeType{"xml", "application/xml"},
+			MimeType{"xz", "application/x-xz"},
+			MimeType{"zip", "application/zip"},
+			MimeType{"zst", "application/zstd"},
+		};
+
+		constexpr bool sorted() {
+			for(size_t i = 1; i < mime_types.size(); ++i) {
+				if(!(mime_types[i-1].extension < mime_types[i].extension))
+					return false;
+			}
+			return true;
+		}
+		static_assert(sorted());
+
+		// A path made only of plain names, so it stays under the root.
+		bool safe_path(std::string_view path) {
+			if(path.find('\0') != path.npos || path.substr(0, 1) == "/"sv)
+				return false;
+			while(!path.empty()) {
+				size_t slash = path.find('/');
+				std::string_view name = path.substr(0, slash);
+				if(name == "."sv || name == ".."sv)
+					return false;
+				if(slash == path.npos)
+					break;
+				path.remove_prefix(slash + 1);
+			}
+			return true;
+		}
+
+		std::string_view directory_of(std::string_view path) {
+			size_t slash = path.rfind('/');
+			return slash == path.npos ? ""sv : path.substr(0, slash + 1);
+		}
+	}
+
+	std::string_view mime_type(std::string_view path) {
+		std::string_view name = path.substr(path.rfind('/') + 1);
+		size_t dot = name.rfind('.');
+		if(dot != name.npos && name.size() - dot <= 8) {
+			std::array<char, 8> lower;
+			std::string_view ext = name.substr(dot + 1);
+			size_t n = std::min(ext.size(), lower.size());
+			for(size_t i = 0; i < n; ++i) {
+				char c = ext[i];
+				lower[i] = c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+			}
+			ext = std::string_view(lower.data(), n);
+			auto i = std::lower_bound(mime_types.begin(), mime_types.end(), ext, [](const MimeType &m, std::string_view e) {
+				return m.extension < e;
+			});
+			if(i != mime_types.end() && i->extension == ext)
+				return i->type;
+		}
+		return "application/octet-stream"sv;
+	}
+
+	OpenFile::OpenFile(int handle, const struct stat &st, std::string_view content_type):
+		handle(handle),
+		size(st.st_size),
+		modified(st.st_mtim),
+		content_type(content_type),
+		last_modified(format_http_date(st.st_mtim.tv_sec))
+	{
+		std::array<char, 48> buf;
+		char *p = buf.data();
+		*p++ = '"';
+		uint64_t ns = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+		p = std::to_chars(p, buf.end(), ns, 16).ptr;
+		*p++ = '-';
+		p = std::to_chars(p, buf.end(), size, 16).ptr;
+		*p++ = '"';
+		etag.assign(buf.data(), p);
+	}
+
+	OpenFile::~OpenFile() {
+		::close(handle);
+	}
+
+	FileCache::FileCache(const std::string &root_path, size_t capacity):
+		root_path(root_path),
+		capacity(capacity)
+	{
+		root = ::open(root_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if(root < 0)
+			throw posix_error("open " + root_path, errno);
+		notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(notify < 0) {
+			LOG(Warning) << "inotify: " << std::strerror(errno) << ", not caching files";
+			this->capacity = 0;
+		}
+	}
+
+	size_t FileCache::capacity_for(unsigned threads) {
+		rlimit limit;
+		if(::getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+			limit.rlim_cur = 1024;
+		return std::max<size_t>(limit.rlim_cur / 4 / std::max(threads, 1u), 16);
+	}
+
+	FileCache::~FileCache() {
+		if(notify >= 0)
+			::close(notify);
+		::close(root);
+	}
+
+	std::shared_ptr<const OpenFile> FileCache::open(std::string_view path, int64_t now, int &error) {
+		if(notify >= 0 && now != checked) {
+			checked = now;
+			read_events();
+		}
+		std::string name(path);
+		if(name.empty() || name.back() == '/')
+			name += "index.html";
+		if(!safe_path(name)) {
+			error = ENOENT;
+			return nullptr;
+		}
+
+		auto found = index.find(name);
+		if(found != index.end()) {
+			items.splice(items.begin(), items, found->second);
+			return found->second->file;
+		}
+
+		int h = open_beneath(name);
+		if(h < 0) {
+			error = errno;
+			// Leaving the root, by a link or otherwise.
+			if(error == EXDEV || error == ELOOP)
+				error = ENOENT;
+			return nullptr;
+		}
+		struct stat st;
+		error = ::fstat(h, &st) < 0 ? errno : S_ISREG(st.st_mode) ? 0 : ENOENT;
+		if(error) {
+			::close(h);
+			return nullptr;
+		}
+		auto file = std::make_shared<const OpenFile>(h, st, mime_type(name));
+		if(!capacity)
+			return file;
+
+		// Watch before caching so no change can be missed in between.
+		if(!watch(name))
+			return file;
+		if(items.size() >= capacity) {
+			index.erase(items.back().path);
+			items.pop_back();
+		}
+		items.push_front(Item{std::move(name), file});
+		index.emplace(items.front().path, items.begin());
+		return file;
+	}
+
+	int FileCache::open_beneath(const std::string &name) const {
+#ifdef SYS_openat2
+		open_how how{};
+		how.flags = O_RDONLY | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		int handle = ::syscall(SYS_openat2, root, name.c_str(), &how, sizeof how);
+		if(handle >= 0 || errno != ENOSYS)
+			return handle;
+#endif
+		// Without openat2 no link is followed at all.
+		int directory = root;
+		std::string_view rest = name;
+		for(size_t slash; (slash = rest.find('/')) != rest.npos; rest.remove_prefix(slash + 1)) {
+			std::string part(rest.substr(0, slash));
+			int next = ::openat(directory, part.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			int err = errno;
+			if(directory != root)
+				::close(directory);
+			if(next < 0) {
+				errno = err;
+				return -1;
+			}
+			directory = next;
+		}
+		int h = ::openat(directory, std::string(rest).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		int err = errno;
+		if(directory != root)
+			::close(directory);
+		errno = err;
+		return h;
+	}
+
+	bool FileCache::watch(const std::string &path) {
+		std::string directory(directory_of(path));
+		if(watched.count(directory))
+			return true;
+		std::string full = root_path + "/" + directory;
+		int wd = ::inotify_add_watch(
+			notify, full.c_str(),
+			IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+				IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+		);
+		// Out of watches, or the directory went away.
+		if(wd < 0)
+			return false;
+		watches[wd] = directory;
+		watched[directory] = wd;
+		return true;
+	}
+
+	void FileCache::read_events() {
+		alignas(inotify_event) std::array<char, 4096> buffer;
+		for(;;) {
+			ssize_t n = ::read(notify, buffer.data(), buffer.size());
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return;
+			for(const char *p = buffer.data(); p < buffer.data() + n; ) {
+				auto ev = reinterpret_cast<const inotify_event*>(p);
+				p += sizeof(inotify_event) + ev->len;
+				if(ev->mask & IN_Q_OVERFLOW) {
+					clear();
+					continue;
+				}
+				auto w = watches.find(ev->wd);
+				if(w == watches.end())
+					continue;
+				std::string directory = w->second;
+				if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+					erase(directory);
+					if(!(ev->mask & IN_IGNORED))
+						::inotify_rm_watch(notify, ev->wd);
+					watched.erase(directory);
+					watches.erase(w);
+					continue;
+				}
+				if(!ev->len)
+					continue;
+				std::string name = directory + ev->name;
+				if(ev->mask & IN_ISDIR)
+					erase(name + "/");
+				else
+					erase(name);
+			}
+		}
+	}
+
+	void FileCache::erase(std::string_view path) {
+		// A path ending in / takes everything under it.
+		if(!path.empty() && path.back() != '/') {
+			auto found = index.find(path);
+			if(found != index.end()) {
+				auto item = found->second;
+				index.erase(found);
+				items.erase(item);
+			}
+			return;
+		}
+		for(auto i = items.begin(); i != items.end(); ) {
+			if(i->path.compare(0, path.size(), path) == 0) {
+				index.erase(i->path);
+				i = items.erase(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	void FileCache::clear() {
+		index.clear();
+		items.clear();
+	}
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace zlynx {
+	// The Content-Type for a file name by its extension, or
+	// application/octet-stream.
+	std::string_view mime_type(std::string_view path);
+
+	// A regular file opened for reading. The handle is closed when the
+	// last reference goes, which may be after a response using it is
+	// sent and long after it left the cache.
+	struct OpenFile {
+		int handle;
+		uint64_t size;
+		timespec modified;
+		std::string_view content_type;
+		// Validators for conditional requests. The ETag is made of the
+		// modification time in nanoseconds and the size.
+		std::string etag;
+		std::string last_modified;
+
+		OpenFile(int handle, const struct stat &st, std::string_view content_type);
+		~OpenFile();
+		OpenFile(const OpenFile&) = delete;
+		void operator=(const OpenFile&) = delete;
+	};
+
+	// Files under a document root with their stat results, kept open
+	// in LRU order. Not thread safe, each event loop has its own.
+	// An inotify watch on the directory of every cached file drops
+	// entries that are changed, replaced or removed. It is read at most
+	// once a millisecond, when a lookup asks for it.
+	class FileCache {
+		public:
+		FileCache(const std::string &root, size_t capacity);
+		~FileCache();
+		FileCache(const FileCache&) = delete;
+		void operator=(const FileCache&) = delete;
+
+		// Open path, relative to the root. A path ending in / gets its
+		// index.html. Returns null with error set to an errno value if
+		// it cannot be opened. A path that is not a regular file or
+		// tries to leave the root, by .. or a symbolic link, is ENOENT.
+		// now is the loop time in milliseconds.
+		std::shared_ptr<const OpenFile> open(std::string_view path, int64_t now, int &error);
+
+		// A capacity for each of threads caches, a share of the open
+		// file limit that leaves most of it for connections.
+		static size_t capacity_for(unsigned threads);
+
+		private:
+		struct Item {
+			std::string path;
+			std::shared_ptr<const OpenFile> file;
+		};
+
+		std::string root_path;
+		int root = -1;
+		int notify = -1;
+		size_t capacity;
+		int64_t checked = 0;
+		// Most recently used first.
+		std::list<Item> items;
+		std::unordered_map<std::string_view, std::list<Item>::iterator> index;
+		// Watch descriptors to the directory they watch, with a
+		// trailing slash unless it is the root.
+		std::unordered_map<int, std::string> watches;
+		std::unordered_map<std::string, int> watched;
+
+		// openat name under the root without leaving it.
+		int open_beneath(const std::string &name) const;
+		void read_events();
+		// Returns false if the file's directory cannot be watched.
+		bool watch(const std::string &path);
+		void erase(std::string_view path);
+		void clear();
+	};
+};
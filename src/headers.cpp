@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cstdio>
+#include "headers.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace {
+		struct KnownHeader {
+			std::string_view name;
+			HeaderId id;
+		};
+
+		constexpr std::array<KnownHeader, size_t(HeaderId::Count) - 1> known_headers = {{
+			{ "Accept-Encoding"sv, HeaderId::AcceptEncoding },
+			{ "Cache-Control"sv, HeaderId::CacheControl },
+			{ "Connection"sv, HeaderId::Connection },
+			{ "Content-Length"sv, HeaderId::ContentLength },
+			{ "Content-Type"sv, HeaderId::ContentType },
+			{ "Expect"sv, HeaderId::Expect },
+			{ "Expires"sv, HeaderId::Expires },
+			{ "Host"sv, HeaderId::Host },
+			{ "If-Modified-Since"sv, HeaderId::IfModifiedSince },
+			{ "If-None-Match"sv, HeaderId::IfNoneMatch },
+			{ "If-Range"sv, HeaderId::IfRange },
+			{ "Range"sv, HeaderId::Range },
+			{ "Transfer-Encoding"sv, HeaderId::TransferEncoding },
+		}};
+
+		char ascii_lower(char c) {
+			return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+		}
+
+		constexpr std::array<std::string_view, 7> day_names = {
+			"Thu"sv, "Fri"sv, "Sat"sv, "Sun"sv, "Mon"sv, "Tue"sv, "Wed"sv
+		};
+		constexpr std::array<std::string_view, 12> month_names = {
+			"Jan"sv, "Feb"sv, "Mar"sv, "Apr"sv, "May"sv, "Jun"sv,
+			"Jul"sv, "Aug"sv, "Sep"sv, "Oct"sv, "Nov"sv, "Dec"sv
+		};
+
+		// Days between the epoch and a date in the proleptic Gregorian
+		// calendar, and back. From Howard Hinnant's date algorithms.
+		int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+			y -= m <= 2;
+			int64_t era = (y >= 0 ? y : y - 399) / 400;
+			unsigned yoe = unsigned(y - era * 400);
+			unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+			unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + int64_t(doe) - 719468;
+		}
+
+		void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+			z += 719468;
+			int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+			unsigned doe = unsigned(z - era * 146097);
+			unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+			unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+			unsigned mp = (5 * doy + 2) / 153;
+			d = doy - (153 * mp + 2) / 5 + 1;
+			m = mp < 10 ? mp + 3 : mp - 9;
+			y = int64_t(yoe) + era * 400 + (m <= 2);
+		}
+
+		// Parse exactly s.size() digits.
+		bool parse_digits(std::string_view s, unsigned &value) {
+			value = 0;
+			for(char c: s) {
+				if(c < '0' || c > '9')
+					return false;
+				value = value * 10 + (c - '0');
+			}
+			return true;
+		}
+	}
+
+	std::string format_http_date(int64_t seconds) {
+		int64_t days = seconds / 86400;
+		int64_t rest = seconds % 86400;
+		if(rest < 0) {
+			rest += 86400;
+			--days;
+		}
+		int64_t y;
+		unsigned m, d;
+		civil_from_days(days, y, m, d);
+		auto day = day_names[((days % 7) + 7) % 7];
+		auto month = month_names[m - 1];
+		char buf[http_date_size + 1];
+		std::snprintf(
+			buf, sizeof buf, "%.3s, %02u %.3s %04u %02u:%02u:%02u GMT",
+			day.data(), d, month.data(), unsigned(y),
+			unsigned(rest / 3600), unsigned(rest / 60 % 60), unsigned(rest % 60)
+		);
+		return std::string(buf, http_date_size);
+	}
+
+	bool parse_http_date(std::string_view s, int64_t &seconds) {
+		// Sun, 06 Nov 1994 08:49:37 GMT
+		if(
+			s.size() != http_date_size ||
+			s.substr(3, 2) != ", "sv || s[7] != ' ' || s[11] != ' ' ||
+			s[16] != ' ' || s[19] != ':' || s[22] != ':' ||
+			s.substr(25) != " GMT"sv
+		)
+			return false;
+		auto month = std::find(month_names.begin(), month_names.end(), s.substr(8, 3));
+		unsigned d, y, hh, mm, ss;
+		if(
+			month == month_names.end() ||
+			!parse_digits(s.substr(5, 2), d) || !parse_digits(s.substr(12, 4), y) ||
+			!parse_digits(s.substr(17, 2), hh) || !parse_digits(s.substr(20, 2), mm) ||
+			!parse_digits(s.substr(23, 2), ss) ||
+			d < 1 || d > 31 || hh > 23 || mm > 59 || ss > 60
+		)
+			return false;
+		unsigned m = month - month_names.begin() + 1;
+		seconds = days_from_civil(y, m, d) * 86400 + hh * 3600 + mm * 60 + ss;
+		return true;
+	}
+
+	bool equal_ignore_case(std::string_view a, std::string_view b) {
+		if(a.size() != b.size())
+			return false;
+		for(size_t i = 0; i < a.size(); ++i) {
+			if(ascii_lower(a[i]) != ascii_lower(b[i]))
+				return false;
+		}
+		return true;
+	}
+
+	bool parse_max_age(std::string_view cache_control, int64_t &seconds) {
+		seconds = -1;
+		while(!cache_control.empty()) {
+			size_t comma = cache_control.find(',');
+			auto directive = cache_control.substr(0, comma);
+			cache_control = comma == cache_control.npos ? ""sv : cache_control.substr(comma + 1);
+			while(!directive.empty() && (directive.front() == ' ' || directive.front() == '\t'))
+				directive.remove_prefix(1);
+			while(!directive.empty() && (directive.back() == ' ' || directive.back() == '\t'))
+				directive.remove_suffix(1);
+			size_t equals = directive.find('=');
+			if(!equal_ignore_case(directive.substr(0, equals), "max-age"sv))
+				continue;
+			if(equals == directive.npos)
+				return false;
+			auto value = directive.substr(equals + 1);
+			// The quoted form is allowed, though senders should not use it.
+			if(value.size() >= 2 && value.front() == '"' && value.back() == '"')
+				value = value.substr(1, value.size() - 2);
+			if(value.empty())
+				return false;
+			int64_t n = 0;
+			for(char c: value) {
+				if(c < '0' || c > '9')
+					return false;
+				n = std::min(n * 10 + (c - '0'), max_delta_seconds);
+			}
+			seconds = n;
+		}
+		return true;
+	}
+
+	HeaderId find_header_id(std::string_view name) {
+		for(auto &known: known_headers) {
+			if(equal_ignore_case(name, known.name))
+				return known.id;
+		}
+		return HeaderId::Other;
+	}
+
+	bool HeaderTable::add(const IOBuffer &input, std::string_view name, std::string_view value) {
+		if(count == capacity)
+			return false;
+		HeaderId id = find_header_id(name);
+		fields[count] = Field{ id, view(input, name), view(input, value) };
+		++count;
+		if(id != HeaderId::Other && !first[size_t(id)])
+			first[size_t(id)] = count;
+		return true;
+	}
+
+	void HeaderTable::clear() {
+		count = 0;
+		first.fill(0);
+	}
+
+	std::string_view HeaderTable::get(HeaderId id) const {
+		if(id == HeaderId::Other || !first[size_t(id)])
+			return std::string_view();
+		return fields[first[size_t(id)] - 1].value;
+	}
+
+	std::string_view HeaderTable::get(std::string_view name) const {
+		HeaderId id = find_header_id(name);
+		if(id != HeaderId::Other)
+			return get(id);
+		for(size_t i = 0; i < count; ++i) {
+			if(equal_ignore_case(fields[i].name, name))
+				return fields[i].value;
+		}
+		return std::string_view();
+	}
+};
@@ -0,0 +1,82 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "container_index_view.h"
+#include "iobuffer.h"
+
+namespace zlynx {
+	// Headers the server looks at. They are interned when the request is
+	// parsed so looking one up is an array index.
+	enum class HeaderId : uint8_t {
+		Other,
+		AcceptEncoding,
+		CacheControl,
+		Connection,
+		ContentLength,
+		ContentType,
+		Expect,
+		Expires,
+		Host,
+		IfModifiedSince,
+		IfNoneMatch,
+		IfRange,
+		Range,
+		TransferEncoding,
+		Count
+	};
+
+	// ASCII case-insensitive comparison, as used for header names.
+	bool equal_ignore_case(std::string_view a, std::string_view b);
+	// The interned id for a header name, Other if it is not one of them.
+	HeaderId find_header_id(std::string_view name);
+
+	// Dates as in Last-Modified, in the IMF-fixdate form such as
+	// "Sun, 06 Nov 1994 08:49:37 GMT", which is always http_date_size
+	// characters. Times are seconds since the epoch.
+	constexpr size_t http_date_size = 29;
+	std::string format_http_date(int64_t seconds);
+	// Returns false if s is not an IMF-fixdate. The obsolete forms are
+	// not accepted, so such a header is ignored.
+	bool parse_http_date(std::string_view s, int64_t &seconds);
+
+	// The max-age directive of a Cache-Control value in seconds, or -1
+	// if it has none. Returns false if it is malformed. Values too large
+	// are cut to max_delta_seconds.
+	constexpr int64_t max_delta_seconds = int64_t(1) << 31;
+	bool parse_max_age(std::string_view cache_control, int64_t &seconds);
+
+	// The headers of one request.
+	// Names and values are views into the input buffer and the table has
+	// a fixed capacity, so parsing headers makes no allocations.
+	class HeaderTable {
+		public:
+		typedef container_index_view<IOBuffer> view;
+		static constexpr size_t capacity = 64;
+
+		HeaderTable() { clear(); }
+
+		// Returns false if the table is full.
+		bool add(const IOBuffer &input, std::string_view name, std::string_view value);
+		void clear();
+		size_t size() const { return count; }
+
+		// The first value for a header, empty if there is none.
+		std::string_view get(HeaderId id) const;
+		std::string_view get(std::string_view name) const;
+
+		private:
+		struct Field {
+			HeaderId id;
+			view name;
+			view value;
+		};
+
+		std::array<Field, capacity> fields;
+		size_t count = 0;
+		// One more than the index in fields of the first header with each
+		// id. Zero means not present.
+		std::array<uint8_t, size_t(HeaderId::Count)> first;
+	};
+};
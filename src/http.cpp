@@ -1,68 +1,50 @@
-#include <string_view>
 #include <algorithm>
+#include <string_view>
 #include <array>
-#include <vector>
-#include <cstring>
 #include <iostream>
-#include <iterator>
 #include <charconv>
-#include <sstream>
-#include <cctype>
 #include "http.h"
 #include "errors.h"
+#include "log.h"
+#include "metrics.h"
 #include "container_index_view.h"
 
 namespace zlynx {
 	using namespace std::literals;
 
-	constexpr auto header_divider = "\r\n\r\n"sv;
-
-	template<class Iterator>
-	const char* find_string(
-		Iterator hay_begin, Iterator hay_end,
-		const std::string_view &needle
-	) {
-		const char* begin = reinterpret_cast<const char*>(&*hay_begin);
-		const char* end   = reinterpret_cast<const char*>(&*hay_end);
-		while(begin != end) {
-			size_t n = end - begin;
-			const char *p = static_cast<const char*>(std::memchr(begin, needle[0], n));
-			if(!p)
-				return p;
-			if(p + needle.size() > end)
-				return nullptr;
-			if(0 == std::memcmp(p, needle.data(), needle.size()))
-				return p;
-			begin = p + 1;
-		}
-		return nullptr;
-	}
-
-	template<class SrcT, class DstT>
-	size_t split_string_into(const SrcT &src, const char c, DstT &dst) {
-		size_t pos = 0;
-		size_t end;
-		size_t count = 0;
-
-		while( (end = src.find_first_of(c, pos)) != SrcT::npos ) {
-			dst[count++] = src.substr(pos,end-pos);
-			pos = end + 1;
-			if(count == dst.size())
-				return count;
+	Socket::Action HTTPConnection::on_received() {
+		// Pipelined requests wait behind a file, but not without limit.
+		if(sending_file() && input.size() > max_waiting_input) {
+			LOG(Debug) << "too much input waiting on handle " << handle;
+			return REMOVE;
 		}
-		dst[count++] = src.substr(pos, src.size()-pos);
-		return count;
-	}
-
-	Socket::Action HTTPConnection::on_input() {
-		Action act = Connection::on_input();
+		received_at = last_tick = ticks();
 		while(do_request())
 			/* empty */;
-		return act;
+		// Start the header timeout on the first bytes of a request. It
+		// is not pushed back by more bytes arriving. Requests waiting
+		// behind a file are not timed until they are looked at.
+		if(header_timeout && !closing) {
+			if(!input.empty() && !parser.done() && !input_paused) {
+				if(!deadline)
+					set_deadline(header_timeout);
+			} else if(deadline) {
+				set_deadline(0);
+			}
+		}
+		return KEEP;
 	}
 
-	HTTPConnection::HTTPConnection(int h, const sockaddr_in6 &remote, time_t timeout):
-		Connection(h, remote, timeout)
+	HTTPConnection::HTTPConnection(
+		int h, const sockaddr_in6 &remote,
+		int64_t timeout, int64_t header_timeout,
+		HTTPLimits limits
+	):
+		Connection(h, remote, timeout),
+		header_timeout(header_timeout),
+		max_body_size(limits.max_body_size),
+		parser(limits.max_header_size),
+		chunks(limits.max_body_size)
 	{
 		int val = 1;
 		throw_posix_errno_if( ::setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &val, sizeof val) );
@@ -70,171 +52,179 @@ namespace zlynx {
 
 
 	bool HTTPConnection::do_request() {
+		// After an error or a final response nothing more is read.
+		if(closing) {
+			input.clear();
+			return false;
+		}
+		// Responses must go out in order, so the next request waits
+		// for a file being sent.
+		if(sending_file()) {
+			pause_input();
+			return false;
+		}
+
 		// Have we received all of the headers yet?
-		if(headers_view.empty()) {
-			const char *header_end = find_string(
-				input.cbegin()+search_point, input.cend(),
-				header_divider
-			);
-			if(header_end) {
-				const char *line_end = find_string(
-					input.cbegin(), input.cend(),
-					"\r\n"sv
-				);
-				if(!line_end)
-					throw std::logic_error("no line ending should be impossible");
-
-				auto begin = reinterpret_cast<const char*>(input.data());
-				size_t n = line_end - begin;
-				auto first_line = std::string_view(begin, n);
-				n = header_end - begin;
-				headers_view = container_index_view(input, begin, n);
-
-				std::array<std::string_view, 3> first_line_words;
-				if(split_string_into(first_line, ' ', first_line_words) != 3) {
-					// write a HTTP error
-					// and get out of here
-					write_error("400 Bad Request");
-				}
-				method_view = container_index_view(input, first_line_words[0]);
-				path_view   = container_index_view(input, first_line_words[1]);
-				proto_view  = container_index_view(input, first_line_words[2]);
-
-				on_headers();
-			} else {
-				// Looking for four bytes, so always back up in case we
-				// only had part of it last time.
-				if(input.size() > header_divider.size())
-					search_point = input.size() - header_divider.size();
+		if(!parser.done()) {
+			if(!request_start)
+				request_start = received_at;
+			auto result = parser.parse(input, headers);
+			uint64_t now = ticks();
+			parse_ticks += now - last_tick;
+			last_tick = now;
+			switch(result) {
+				case RequestParser::Incomplete:
+					return false;
+				case RequestParser::Error:
+					response_started(request_start);
+					write_error(parser.error());
+					end_request();
+					return false;
+				case RequestParser::Complete:
+					thread_metrics().record(Latency::Parse, parse_ticks);
+					break;
 			}
+			method_view = container_index_view(input, parser.method(input));
+			path_view   = container_index_view(input, parser.path(input));
+			proto_view  = container_index_view(input, parser.proto(input));
+
+			on_headers();
+			if(closing) {
+				response_started(request_start);
+				end_request();
+				return false;
+			}
+			if(!streaming && !chunked)
+				input.reserve(parser.size() + content_length);
 		}
 
-		if(body_view.size() < content_length) {
-			const char *begin =
-				input.data()
-				+ headers_view.size()
-				+ header_divider.size();
-			const char *end =
-				input.data()
-				+ input.size();
-			if(static_cast<size_t>(end-begin) >= content_length)
-				body_view = container_index_view(input, begin, content_length);
+		bool complete;
+		if(chunked) {
+			auto result = chunks.decode(input, parser.size());
+			if(result == RequestParser::Error) {
+				response_started(request_start);
+				write_error(chunks.error());
+				end_request();
+				return false;
+			}
+			if(streaming && !stream_body(chunks.pending()))
+				return false;
+			if(result == RequestParser::Incomplete)
+				return false;
+			content_length = chunks.size();
+			if(!streaming)
+				body_view = container_index_view(input, input.data() + parser.size(), content_length);
+			complete = true;
+		} else if(streaming) {
+			if(!stream_body(std::min(input.size() - parser.size(), content_length - streamed)))
+				return false;
+			complete = streamed == content_length;
+		} else {
+			if(body_view.size() < content_length) {
+				if(input.size() - parser.size() >= content_length)
+					body_view = container_index_view(input, input.data() + parser.size(), content_length);
+			}
+			complete = body_view.size() == content_length;
 		}
 
-		if(!headers_view.empty() && body_view.size() == content_length) {
+		if(complete) {
+			response_started(request_start);
 			// We have headers and body (if any), now call the on_method
 			if(method_view == "GET"sv) {
-				on_get();
+				if(path_view == stats_path)
+					write_stats();
+				else
+					on_get();
 			} else if(method_view == "PUT"sv) {
 				on_put();
 			} else if(method_view == "POST"sv) {
 				on_post();
 			} else if(method_view == "DELETE"sv) {
 				on_delete();
+			} else {
+				write_error("501 Not Implemented");
 			}
+			uint64_t now = ticks();
+			thread_metrics().record(Latency::Handler, now - last_tick);
+			last_tick = now;
+			end_request();
 			reset();
 			return true;
 		}
 		return false;
 	}
 
+	bool HTTPConnection::stream_body(size_t n) {
+		// Take it out of input once passed on. The head stays in front
+		// for the views into it.
+		if(n) {
+			on_body(std::string_view(input.data() + parser.size(), n));
+			input.erase(parser.size(), n);
+			chunks.consumed(n);
+			streamed += n;
+		}
+		// The handler gave up on the body.
+		if(closing) {
+			response_started(request_start);
+			end_request();
+			return false;
+		}
+		return true;
+	}
+
 	void HTTPConnection::reset() {
-		size_t input_end =
-			headers_view.size() +
-			header_divider.size() +
-			body_view.size();
+		// Drop the request from the input buffer.
+		input.consume(parser.size() + body_view.size());
 
 		// Reset the HTTP data.
-		search_point = 0;
+		parser.reset();
+		chunks.reset();
 		content_length = 0;
+		chunked = false;
+		chunking = false;
+		streaming = false;
+		streamed = 0;
 		method_view.reset();
 		path_view.reset();
 		proto_view.reset();
-		headers_view.reset();
 		body_view.reset();
+		headers.clear();
+		status = 0;
+		response_length = 0;
+		request_start = 0;
+		parse_ticks = 0;
+	}
 
-		// Clear the input buffer.
-		input.erase(input.begin(), input.begin() + input_end);
-
-		header_map.clear();
-	}
-
-	static
-	int tolower_bithack(int c) {
-		return ((c & 0x40) >> 1) | c;
-	}
-
-	static
-	std::string to_lower_string(std::string_view s) {
-		std::string result(s.size(), 0);
-		std::transform(
-			begin(s), end(s),
-			begin(result),
-			tolower_bithack
-		);
-		return result;
-	}
-
-	void HTTPConnection::build_header_map() {
-		constexpr auto line_end_sv = "\r\n"sv;
-		constexpr auto key_end_sv = ":"sv;
-		const char *line_end = find_string(
-			headers_view.begin(), headers_view.end(),
-			line_end_sv
-		);
-		if(!line_end)
-			throw std::runtime_error("corrupt headers");
-		while(line_end != headers_view.end()) {
-			// Advance to next line.
-			const char *line_start = line_end + line_end_sv.size();
-			const char *key_end = find_string(
-				line_start, headers_view.end(),
-				key_end_sv
-			);
-			line_end = find_string(
-				line_start, headers_view.end(),
-				line_end_sv
-			);
-			if(!line_end)
-				line_end = headers_view.end();
-			if(!key_end || key_end > line_end)
-				throw std::runtime_error("corrupt header line");
-			const char *value_start = key_end + 2;
-			header_map.emplace(
-				to_lower_string(std::string_view(line_start, key_end-line_start)),
-				container_index_view(input, std::string_view(value_start, line_end - value_start))
-			);
-		}
+	void HTTPConnection::end_request() {
+		thread_metrics().request(method_view, status);
+		if(!access_log_enabled())
+			return;
+		log_access(AccessRecord{
+			remote_addr,
+			method_view, path_view, proto_view,
+			status, response_length
+		});
 	}
 
 	void HTTPConnection::on_headers() {
-		// Convert everything to a hash map with lower-cased keys.
-		build_header_map();
-		// Look for Content-Length
-		static const auto content_length_s = "content-length"s;
-		static const auto expect_s = "expect"s;
-		static const auto connection_s = "connection"s;
-		auto content_length_view = get_header(content_length_s);
-		if(!content_length_view.empty()) {
-			auto result = std::from_chars(
-				content_length_view.begin(), content_length_view.end(),
-				content_length
-			);
-			if(result.ec != std::errc()) {
-				write_error("400 Bad Request");
-			}
-			input.reserve(input.size() + content_length);
+		if(!read_body_headers())
+			return;
+		// Before a 100 Continue, so a body that cannot be taken is not
+		// asked for.
+		if(chunked || content_length >= stream_body_size) {
+			streaming = on_body_start();
+			if(closing)
+				return;
 		}
-		auto expect_view = get_header(expect_s);
+		auto expect_view = get_header(HeaderId::Expect);
 		if(expect_view == "100-continue"sv) {
 			// Immediatly send a 100-continue
-			write(proto_view);
-			writeln(" 100 Continue");
+			write_status("100 Continue");
 			writeln();
 		}
 		if(proto_view == "HTTP/1.0"sv) {
-			auto connection_view = get_header(connection_s);
-			if(connection_view == "Keep-Alive") {
+			auto connection_view = get_header(HeaderId::Connection);
+			if(equal_ignore_case(connection_view, "Keep-Alive"sv)) {
 				keep_alive = true;
 			} else {
 				keep_alive = false;
@@ -242,20 +232,65 @@ namespace zlynx {
 		}
 	}
 
+	bool HTTPConnection::read_body_headers() {
+		auto transfer_encoding_view = get_header(HeaderId::TransferEncoding);
+		auto content_length_view = get_header(HeaderId::ContentLength);
+		if(!transfer_encoding_view.empty()) {
+			// Only chunked on its own is understood. With a
+			// Content-Length as well, or from an HTTP/1.0 client, a proxy
+			// in front may have seen a different end to the body, so the
+			// request is refused rather than guessed at.
+			if(!content_length_view.empty() || proto_view == "HTTP/1.0"sv) {
+				write_error("400 Bad Request");
+				return false;
+			}
+			if(!equal_ignore_case(transfer_encoding_view, "chunked"sv)) {
+				write_error("501 Not Implemented");
+				return false;
+			}
+			chunked = true;
+			return true;
+		}
+		if(!content_length_view.empty()) {
+			auto result = std::from_chars(
+				content_length_view.begin(), content_length_view.end(),
+				content_length
+			);
+			if(result.ec != std::errc() || result.ptr != content_length_view.end()) {
+				write_error("400 Bad Request");
+				return false;
+			}
+			// Refused before any of the body is read, and before a
+			// 100 Continue asks the client to send it.
+			if(content_length > max_body_size) {
+				write_error("413 Content Too Large");
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool HTTPConnection::on_body_start() {
+		return false;
+	}
+
+	void HTTPConnection::on_body(std::string_view) {
+	}
+
 	void HTTPConnection::on_get() {
-		logger << "GET " << path_view << "\n";
+		LOG(Debug) << "GET " << path_view;
 	}
 
 	void HTTPConnection::on_put() {
-		logger << "PUT " << path_view << "\n";
+		LOG(Debug) << "PUT " << path_view;
 	}
 
 	void HTTPConnection::on_post() {
-		logger << "POST " << path_view << '\n' << body_view << '\n';
+		LOG(Debug) << "POST " << path_view << " body size: " << body_view.size();
 	}
 
 	void HTTPConnection::on_delete() {
-		logger << "DELETE " << path_view << "\n";
+		LOG(Debug) << "DELETE " << path_view;
 	}
 
 	void HTTPConnection::write(std::string_view str) {
@@ -267,40 +302,372 @@ namespace zlynx {
 		write("\r\n"sv);
 	}
 
-	void HTTPConnection::write_body(std::string_view body) {
+	void HTTPConnection::write_status(std::string_view status_line) {
+		// The request line may not have been understood.
+		if(proto_view.empty())
+			write("HTTP/1.1"sv);
+		else
+			write(proto_view);
+		write(" ");
+		writeln(status_line);
+		std::from_chars(status_line.data(), status_line.data() + status_line.size(), status);
+	}
+
+	void HTTPConnection::write_body(std::string_view body, OutputQueue::Owner owner) {
+		write_length(body.size());
+		write_ref(body, std::move(owner));
+	}
+
+	void HTTPConnection::write_body_file(int file, uint64_t offset, uint64_t size, OutputQueue::Owner owner) {
+		write_length(size);
+		write_file(file, offset, size, std::move(owner));
+	}
+
+	void HTTPConnection::write_length(uint64_t length) {
+		response_length = length;
 		// Create a Content-Length header
 		std::array<char, 32> buf;
-		auto result = std::to_chars(buf.begin(), buf.end(), body.size());
+		auto result = std::to_chars(buf.begin(), buf.end(), length);
 		if(result.ec != std::errc())
 			throw std::runtime_error("error formatting body.size for content length");
 		write("Content-Length: ");
 		Connection::write(buf.data(), result.ptr);
 		writeln();
+		end_headers();
+	}
+
+	void HTTPConnection::end_headers() {
+		write_connection();
+		if(!keep_alive)
+			close_output();
+		writeln();
+	}
+
+	void HTTPConnection::write_connection() {
 		if(keep_alive) {
 			if(proto_view == "HTTP/1.0"sv) {
 				writeln("Connection: Keep-Alive");
 			}
 		} else {
 			writeln("Connection: close");
-			close_output();
 		}
+	}
+
+	void HTTPConnection::start_chunked_body() {
+		response_length = 0;
+		if(proto_view == "HTTP/1.1"sv) {
+			chunking = true;
+			writeln("Transfer-Encoding: chunked");
+		} else {
+			// The end of the connection is the end of the body.
+			keep_alive = false;
+		}
+		write_connection();
 		writeln();
-		write(body);
+	}
+
+	void HTTPConnection::write_chunk(std::string_view data, OutputQueue::Owner owner) {
+		// An empty chunk would end the body.
+		if(data.empty())
+			return;
+		response_length += data.size();
+		if(chunking) {
+			std::array<char, 20> line;
+			auto result = std::to_chars(line.begin(), line.end() - 2, data.size(), 16);
+			*result.ptr++ = '\r';
+			*result.ptr++ = '\n';
+			Connection::write(line.data(), result.ptr);
+		}
+		if(owner)
+			write_ref(data, std::move(owner));
+		else
+			write(data);
+		if(chunking)
+			write("\r\n"sv);
+	}
+
+	void HTTPConnection::end_chunked_body() {
+		if(chunking) {
+			write("0\r\n\r\n"sv);
+			chunking = false;
+		}
+		// Only now, as the connection is shut down once output is empty.
+		if(!keep_alive) {
+			close_output();
+			update_write_event();
+		}
 	}
 
 	void HTTPConnection::write_error(std::string_view err) {
-		write(proto_view);
-		write(" ");
-		writeln(err);
+		write_status(err);
 		writeln("Connection: close");
 		writeln("");
 		close_output();
 	}
 
-	std::string_view HTTPConnection::get_header(const std::string& header) const {
-		auto i = header_map.find(header);
-		if(i != header_map.end())
-			return i->second;
-		return std::string_view();
+	bool HTTPConnection::not_modified(std::string_view etag, int64_t modified) const {
+		auto none_match = get_header(HeaderId::IfNoneMatch);
+		if(!none_match.empty()) {
+			if(etag.empty())
+				return false;
+			if(none_match == "*"sv)
+				return true;
+			// A list of tags, compared without their W/ prefixes.
+			auto unweak = [](std::string_view tag) {
+				return tag.substr(0, 2) == "W/"sv ? tag.substr(2) : tag;
+			};
+			etag = unweak(etag);
+			while(!none_match.empty()) {
+				size_t comma = none_match.find(',');
+				auto tag = none_match.substr(0, comma);
+				while(!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+					tag.remove_prefix(1);
+				while(!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+					tag.remove_suffix(1);
+				if(unweak(tag) == etag)
+					return true;
+				if(comma == none_match.npos)
+					break;
+				none_match.remove_prefix(comma + 1);
+			}
+			return false;
+		}
+		auto modified_since = get_header(HeaderId::IfModifiedSince);
+		int64_t since;
+		return
+			modified && !modified_since.empty() &&
+			parse_http_date(modified_since, since) && modified <= since;
+	}
+
+	void HTTPConnection::write_not_modified(
+		std::string_view etag, std::string_view last_modified,
+		const Freshness &fresh
+	) {
+		write_status("304 Not Modified");
+		write_validators(etag, last_modified, fresh);
+		response_length = 0;
+		end_headers();
+	}
+
+	void HTTPConnection::write_validators(
+		std::string_view etag, std::string_view last_modified,
+		const Freshness &fresh
+	) {
+		if(!etag.empty()) {
+			write("ETag: "sv);
+			writeln(etag);
+		}
+		if(!last_modified.empty()) {
+			write("Last-Modified: "sv);
+			writeln(last_modified);
+		}
+		if(fresh.max_age >= 0) {
+			write("Cache-Control: max-age="sv);
+			writeln(std::to_string(fresh.max_age));
+			write("Age: "sv);
+			writeln(std::to_string(fresh.age));
+		}
+	}
+
+	namespace {
+		// The value of a Content-Range header, such as bytes 0-99/1000.
+		std::string content_range(uint64_t offset, uint64_t length, uint64_t size) {
+			return
+				"bytes "s + std::to_string(offset) + '-' +
+				std::to_string(offset + length - 1) + '/' + std::to_string(size);
+		}
+	}
+
+	HTTPConnection::Ranges HTTPConnection::find_ranges(
+		uint64_t size, std::string_view etag, int64_t modified, size_t max
+	) {
+		auto range = get_header(HeaderId::Range);
+		if(range.empty() || !range_applies(etag, modified))
+			return Ranges::Full;
+		// Other units are ignored.
+		constexpr auto unit = "bytes="sv;
+		if(range.size() < unit.size() || !equal_ignore_case(range.substr(0, unit.size()), unit))
+			return Ranges::Full;
+		return parse_ranges(range.substr(unit.size()), size, max);
+	}
+
+	HTTPConnection::Ranges HTTPConnection::parse_ranges(std::string_view set, uint64_t size, size_t max) {
+		ranges.clear();
+		size_t count = 0;
+		// Numbers too large for uint64_t saturate, which gives the same
+		// answer as the real value would.
+		auto number = [](std::string_view &s, uint64_t &n) {
+			auto result = std::from_chars(s.data(), s.data() + s.size(), n);
+			if(result.ptr == s.data())
+				return false;
+			if(result.ec == std::errc::result_out_of_range) {
+				n = UINT64_MAX;
+				while(result.ptr != s.data() + s.size() && *result.ptr >= '0' && *result.ptr <= '9')
+					++result.ptr;
+			}
+			s.remove_prefix(result.ptr - s.data());
+			return true;
+		};
+		while(!set.empty()) {
+			size_t comma = set.find(',');
+			auto spec = set.substr(0, comma);
+			set = comma == set.npos ? std::string_view() : set.substr(comma + 1);
+			while(!spec.empty() && (spec.front() == ' ' || spec.front() == '\t'))
+				spec.remove_prefix(1);
+			while(!spec.empty() && (spec.back() == ' ' || spec.back() == '\t'))
+				spec.remove_suffix(1);
+			// Empty list elements are allowed.
+			if(spec.empty())
+				continue;
+			if(++count > max)
+				return Ranges::Full;
+			// Anything malformed means the header is ignored.
+			uint64_t first, last = UINT64_MAX;
+			if(spec.front() == '-') {
+				// The last so many bytes.
+				spec.remove_prefix(1);
+				uint64_t suffix;
+				if(!number(spec, suffix) || !spec.empty())
+					return Ranges::Full;
+				if(!suffix || !size)
+					continue;
+				first = size - std::min(suffix, size);
+			} else {
+				if(!number(spec, first) || spec.empty() || spec.front() != '-')
+					return Ranges::Full;
+				spec.remove_prefix(1);
+				if(!spec.empty() && (!number(spec, last) || !spec.empty() || last < first))
+					return Ranges::Full;
+				if(first >= size)
+					continue;
+			}
+			last = std::min(last, size - 1);
+			ranges.push_back(ByteRange{first, last - first + 1});
+		}
+		if(!count)
+			return Ranges::Full;
+		return ranges.empty() ? Ranges::Unsatisfiable : Ranges::Partial;
+	}
+
+	bool HTTPConnection::range_applies(std::string_view etag, int64_t modified) const {
+		auto if_range = get_header(HeaderId::IfRange);
+		if(if_range.empty())
+			return true;
+		// An entity tag must match strongly, so never a weak one.
+		if(if_range.front() == '"' || if_range.substr(0, 2) == "W/"sv)
+			return !etag.empty() && if_range == etag && etag.substr(0, 2) != "W/"sv;
+		int64_t date;
+		return modified && parse_http_date(if_range, date) && date == modified;
+	}
+
+	void HTTPConnection::write_content_range(const ByteRange &r, uint64_t size) {
+		write("Content-Range: "sv);
+		writeln(content_range(r.offset, r.length, size));
+	}
+
+	void HTTPConnection::write_ranges(
+		std::string_view content_type,
+		std::string_view etag, std::string_view last_modified,
+		std::string_view body, OutputQueue::Owner owner,
+		const Freshness &fresh
+	) {
+		write_status("206 Partial Content");
+		write_validators(etag, last_modified, fresh);
+		if(ranges.size() == 1) {
+			const ByteRange &r = ranges.front();
+			if(!content_type.empty()) {
+				write("Content-Type: "sv);
+				writeln(content_type);
+			}
+			write_content_range(r, body.size());
+			write_body(body.substr(r.offset, r.length), std::move(owner));
+			return;
+		}
+
+		// The part heads go into one string first for the total length.
+		std::array<char, 16> boundary;
+		uint64_t seed = ticks() ^ uint64_t(handle) << 48;
+		for(size_t i = boundary.size(); i--; seed >>= 4) {
+			boundary[i] = "0123456789abcdef"[seed & 15];
+		}
+		std::string_view b(boundary.data(), boundary.size());
+		std::string heads;
+		std::vector<size_t> ends;
+		uint64_t length = 0;
+		for(auto &r: ranges) {
+			heads.append("\r\n--"sv).append(b);
+			if(!content_type.empty())
+				heads.append("\r\nContent-Type: "sv).append(content_type);
+			heads
+				.append("\r\nContent-Range: "sv)
+				.append(content_range(r.offset, r.length, body.size()))
+				.append("\r\n\r\n"sv);
+			ends.push_back(heads.size());
+			length += r.length;
+		}
+		heads.append("\r\n--"sv).append(b).append("--\r\n"sv);
+		length += heads.size();
+
+		write("Content-Type: multipart/byteranges; boundary="sv);
+		writeln(b);
+		write_length(length);
+		size_t start = 0;
+		for(size_t i = 0; i < ranges.size(); ++i) {
+			write(std::string_view(heads).substr(start, ends[i] - start));
+			write_ref(body.substr(ranges[i].offset, ranges[i].length), owner);
+			start = ends[i];
+		}
+		write(std::string_view(heads).substr(start));
+	}
+
+	void HTTPConnection::write_range_file(
+		std::string_view content_type,
+		std::string_view etag, std::string_view last_modified,
+		int file, uint64_t size, OutputQueue::Owner owner
+	) {
+		const ByteRange &r = ranges.front();
+		write_status("206 Partial Content");
+		write_validators(etag, last_modified);
+		write("Content-Type: "sv);
+		writeln(content_type);
+		write_content_range(r, size);
+		write_body_file(file, r.offset, r.length, std::move(owner));
+	}
+
+	void HTTPConnection::write_range_not_satisfiable(uint64_t size) {
+		write_status("416 Range Not Satisfiable");
+		write("Content-Range: bytes */"sv);
+		writeln(std::to_string(size));
+		write_body();
+	}
+
+	void HTTPConnection::write_stats() {
+		write_status("200 OK");
+		writeln("Content-Type: text/plain; version=0.0.4");
+		// Generated per request, so it is not worth a length.
+		start_chunked_body();
+		write_chunk(render_metrics());
+		end_chunked_body();
+	}
+
+	void HTTPConnection::write_response(
+		std::string_view head, std::string_view body, OutputQueue::Owner owner,
+		const Freshness &fresh
+	) {
+		// The code follows "HTTP/1.x ".
+		if(head.size() > 9)
+			std::from_chars(head.data() + 9, head.data() + head.size(), status);
+		response_length = body.size();
+		if(fresh.max_age < 0) {
+			write_ref(head, body, std::move(owner));
+			return;
+		}
+		// Age changes by the second, so it goes in before the blank line
+		// that ends the head.
+		write(head.substr(0, head.size() - 2));
+		write("Age: "sv);
+		writeln(std::to_string(fresh.age));
+		writeln();
+		write_ref(body, std::move(owner));
 	}
 };
@@ -1,23 +1,59 @@
 #pragma once
-#include <unordered_map>
+#include <vector>
 #include "container_index_view.h"
+#include "headers.h"
+#include "parser.h"
 #include "sockets.h"
 
 namespace zlynx {
 	using namespace std::literals;
 
+	// The most a client may send in one request. Larger heads get a
+	// 431 and larger bodies a 413, in both cases before the rest is read.
+	struct HTTPLimits {
+		size_t max_header_size = RequestParser::default_max_size;
+		size_t max_body_size = 64 << 20;
+	};
+
+	// How long a stored response stays fresh and how old it is, both in
+	// seconds. max_age is -1 for a response without a time to live.
+	struct Freshness {
+		int64_t max_age = -1;
+		int64_t age = 0;
+	};
+
 	class HTTPConnection : public Connection {
 		public:
-		HTTPConnection(int h, const sockaddr_in6 &remote, time_t timeout = 0);
+		// header_timeout limits in milliseconds how long a request may
+		// take to send its headers. Zero means no limit.
+		HTTPConnection(
+			int h, const sockaddr_in6 &remote,
+			int64_t timeout = 0, int64_t header_timeout = 0,
+			HTTPLimits limits = HTTPLimits()
+		);
 
 		protected:
-		Action on_input() override;
+		Action on_received() override;
+
+		// GET of this path returns the server metrics instead of
+		// calling on_get.
+		static constexpr std::string_view stats_path = "/_stats"sv;
 
 		// Called when the method, path and headers have been received.
 		virtual void on_headers();
 
-		// Called depending on which method was used.
-		// If a Content-Length was provided, the body_view will be filled in.
+		// Called by on_headers for a chunked body, whose size is not
+		// known yet, and for a Content-Length body of at least
+		// stream_body_size. Return true to be given the body in pieces
+		// with on_body as it arrives. Then input never holds more than a
+		// read's worth of it and body_view stays empty. It may instead
+		// refuse the body with write_error, as on_body may part way.
+		virtual bool on_body_start();
+		virtual void on_body(std::string_view data);
+
+		// Called depending on which method was used, once the whole body
+		// has arrived. Unless the body was streamed, body_view holds it.
+		// content_length is its size, also for a chunked body.
 		virtual void on_get();
 		virtual void on_put();
 		virtual void on_post();
@@ -25,19 +61,107 @@ namespace zlynx {
 
 		void write(std::string_view str);
 		void writeln(std::string_view line = std::string_view());
-		void write_body(std::string_view body = std::string_view());
+		// Start a response with its status line, such as "200 OK".
+		void write_status(std::string_view status);
+		// With an owner the body is queued by reference, see write_ref.
+		void write_body(
+			std::string_view body = std::string_view(),
+			OutputQueue::Owner owner = nullptr
+		);
+		// The same for size bytes of an open file, sent with write_file.
+		void write_body_file(int file, uint64_t offset, uint64_t size, OutputQueue::Owner owner);
+		// Send a body whose size is not known yet. Call start_chunked_body
+		// in place of write_body, then write_chunk as each piece is ready
+		// and end_chunked_body after the last. Large chunks are written
+		// to the socket straight away, so the client gets the start of
+		// the body while the rest is made. HTTP/1.0 clients get the body
+		// as it is, ended by closing the connection.
+		void start_chunked_body();
+		void write_chunk(std::string_view data, OutputQueue::Owner owner = nullptr);
+		void end_chunked_body();
 		void write_error(std::string_view err);
+		// True if the client's copy is current by If-None-Match, or
+		// without that by If-Modified-Since. modified is in seconds since
+		// the epoch, zero if not known.
+		bool not_modified(std::string_view etag, int64_t modified) const;
+		// ETag and Last-Modified headers, each left out if empty, and
+		// Cache-Control and Age for a response with a time to live.
+		void write_validators(
+			std::string_view etag, std::string_view last_modified,
+			const Freshness &fresh = Freshness()
+		);
+		// A 304 with the validators and no body.
+		void write_not_modified(
+			std::string_view etag, std::string_view last_modified,
+			const Freshness &fresh = Freshness()
+		);
+
+		// The outcome of a Range header for a GET.
+		enum class Ranges {
+			// No Range, or one to ignore, such as when If-Range does not
+			// match the validators. Send the whole body.
+			Full,
+			// ranges holds the satisfiable ones in the order asked for.
+			Partial,
+			// None can be satisfied.
+			Unsatisfiable
+		};
+		struct ByteRange {
+			uint64_t offset;
+			uint64_t length;
+		};
+		// Look at Range and If-Range for a body of size bytes. A request
+		// for more than max ranges is served whole.
+		Ranges find_ranges(uint64_t size, std::string_view etag, int64_t modified, size_t max = max_ranges);
+		// A 206 with the ranges of body, written by reference with
+		// owner, as a multipart/byteranges body if there are several.
+		void write_ranges(
+			std::string_view content_type,
+			std::string_view etag, std::string_view last_modified,
+			std::string_view body, OutputQueue::Owner owner,
+			const Freshness &fresh = Freshness()
+		);
+		// A 206 with the one range of a file of size bytes, sent with
+		// write_file.
+		void write_range_file(
+			std::string_view content_type,
+			std::string_view etag, std::string_view last_modified,
+			int file, uint64_t size, OutputQueue::Owner owner
+		);
+		// A 416 for a body of size bytes.
+		void write_range_not_satisfiable(uint64_t size);
+		// A whole response whose head was rendered ahead of time. With a
+		// time to live the head has Cache-Control, and Age is added.
+		void write_response(
+			std::string_view head, std::string_view body, OutputQueue::Owner owner,
+			const Freshness &fresh = Freshness()
+		);
 
-		std::string_view get_header(const std::string& header) const;
+		std::string_view get_header(HeaderId id) const { return headers.get(id); }
+		std::string_view get_header(std::string_view name) const { return headers.get(name); }
 
-		size_t search_point = 0;
+		static constexpr size_t stream_body_size = 64 * 1024;
+		static constexpr size_t max_ranges = 16;
+		// How much input may arrive while a file is being sent.
+		static constexpr size_t max_waiting_input = 1024 * 1024;
+
+		int64_t header_timeout = 0;
+		size_t max_body_size;
 		size_t content_length = 0;
+		// Set when the request body has Transfer-Encoding: chunked.
+		bool chunked = false;
+		// Set while the body is going to on_body, with how much of it
+		// has so far.
+		bool streaming = false;
+		size_t streamed = 0;
 		bool keep_alive = true;
+		// The response status and body length, for the access log.
+		unsigned status = 0;
+		uint64_t response_length = 0;
 
 		container_index_view<decltype(input)> method_view;
 		container_index_view<decltype(input)> path_view;
 		container_index_view<decltype(input)> proto_view;
-		container_index_view<decltype(input)> headers_view;
 		container_index_view<decltype(input)> body_view;
 
 		private:
@@ -45,10 +169,42 @@ namespace zlynx {
 		// Return true if a request was processed.
 		bool do_request();
 		void reset();
-		void build_header_map();
-
-		std::unordered_map<std::string, container_index_view<decltype(input)>> header_map;
+		// Count the finished request and write its access log record.
+		void end_request();
+		void write_stats();
+		// Content-Length and connection headers, and the blank line.
+		void write_length(uint64_t length);
+		void write_connection();
+		// After the headers of a response without a body.
+		void end_headers();
+		// Parse the byte-range-set of a Range header into ranges.
+		Ranges parse_ranges(std::string_view set, uint64_t size, size_t max);
+		// If-Range, true if Range should be used.
+		bool range_applies(std::string_view etag, int64_t modified) const;
+		void write_content_range(const ByteRange &r, uint64_t size);
+		// Pass the n bytes of body after the head to on_body. Returns
+		// false if it refused the rest.
+		bool stream_body(size_t n);
+		// Check Transfer-Encoding and Content-Length. Returns false after
+		// writing an error.
+		bool read_body_headers();
 
+		RequestParser parser;
+		ChunkedDecoder chunks;
+		HeaderTable headers;
+		// Set between start_chunked_body and end_chunked_body for a
+		// client that takes chunks.
+		bool chunking = false;
+		// Filled in by find_ranges. Kept to reuse its storage.
+		std::vector<ByteRange> ranges;
+		// ticks() at the start of this on_received and at the last
+		// point timed since.
+		uint64_t received_at = 0;
+		uint64_t last_tick = 0;
+		// When the current request was read and how long parsing it has
+		// taken so far, in ticks. Zero between requests.
+		uint64_t request_start = 0;
+		uint64_t parse_ticks = 0;
 	};
 
 };
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstring>
+#include "iobuffer.h"
+#include "pool.h"
+
+namespace zlynx {
+	namespace {
+		BlockPool& block_pool() {
+			// Enough for a few hundred connections a thread to come and
+			// go without touching malloc.
+			static thread_local BlockPool pool(IOBuffer::block_size, 512);
+			return pool;
+		}
+	}
+
+	void IOBuffer::reserve(size_t n) {
+		if(n > size())
+			make_room(n - size());
+	}
+
+	char* IOBuffer::prepare(size_t n) {
+		make_room(n);
+		return storage + tail;
+	}
+
+	void IOBuffer::append(const char *begin, const char *end) {
+		size_t n = end - begin;
+		if(!n)
+			return;
+		std::memcpy(prepare(n), begin, n);
+		commit(n);
+	}
+
+	void IOBuffer::erase(size_t offset, size_t n) {
+		char *p = data() + offset;
+		std::memmove(p, p + n, size() - offset - n);
+		tail -= n;
+		if(head == tail)
+			head = tail = 0;
+	}
+
+	void IOBuffer::release() {
+		deallocate(storage, allocated);
+		storage = nullptr;
+		allocated = head = tail = 0;
+	}
+
+	void IOBuffer::consume(size_t n) {
+		head += n;
+		// An empty buffer starts over at the front for free.
+		if(head >= tail)
+			head = tail = 0;
+	}
+
+	void IOBuffer::swap(IOBuffer &other) {
+		std::swap(storage, other.storage);
+		std::swap(allocated, other.allocated);
+		std::swap(head, other.head);
+		std::swap(tail, other.tail);
+	}
+
+	void IOBuffer::make_room(size_t n) {
+		if(allocated - tail >= n)
+			return;
+		size_t live = size();
+		// Sliding the unread bytes down is only worth it when it frees
+		// enough space and costs no more than the bytes already consumed.
+		if(allocated - live >= n && head >= live) {
+			std::memmove(storage, data(), live);
+		} else {
+			size_t want = std::max({allocated * 2, live + n, block_size});
+			char *grown = allocate(want);
+			if(live)
+				std::memcpy(grown, data(), live);
+			deallocate(storage, allocated);
+			storage = grown;
+			allocated = want;
+		}
+		head = 0;
+		tail = live;
+	}
+
+	char* IOBuffer::allocate(size_t n) {
+		if(n == block_size)
+			return static_cast<char*>(block_pool().allocate());
+		return new char[n];
+	}
+
+	void IOBuffer::deallocate(char *p, size_t n) {
+		if(!p)
+			return;
+		if(n == block_size)
+			block_pool().deallocate(p);
+		else
+			delete[] p;
+	}
+
+	void OutputQueue::append(const char *begin, const char *end) {
+		size_t n = end - begin;
+		if(!n)
+			return;
+		std::memcpy(prepare(n), begin, n);
+		commit(n);
+	}
+
+	void OutputQueue::commit(size_t n) {
+		if(!n)
+			return;
+		copied.commit(n);
+		total += n;
+		// Extend the last segment when it is also a copy.
+		if(segments.size() > first && !segments.back().data)
+			segments.back().size += n;
+		else
+			segments.push_back( Segment{ nullptr, n, nullptr } );
+	}
+
+	void OutputQueue::append_ref(std::string_view data, Owner owner) {
+		if(data.empty())
+			return;
+		total += data.size();
+		segments.push_back( Segment{ data.data(), data.size(), std::move(owner) } );
+	}
+
+	size_t OutputQueue::fill(iovec *iov, size_t n) const {
+		size_t count = 0;
+		const char *copy = copied.data();
+		for(size_t i = first; i < segments.size() && count < n; ++i) {
+			const Segment &s = segments[i];
+			const char *p = s.data;
+			if(!p) {
+				p = copy;
+				copy += s.size;
+			}
+			iov[count++] = iovec{ const_cast<char*>(p), s.size };
+		}
+		return count;
+	}
+
+	void OutputQueue::consume(size_t n) {
+		total -= n;
+		while(n) {
+			Segment &s = segments[first];
+			size_t k = std::min(n, s.size);
+			if(s.data)
+				s.data += k;
+			else
+				copied.consume(k);
+			s.size -= k;
+			n -= k;
+			if(!s.size) {
+				s.owner.reset();
+				++first;
+			}
+		}
+		// Reuse the vector from the start once the queue is empty, and
+		// keep it from growing while it never quite empties.
+		if(first == segments.size()) {
+			segments.clear();
+			first = 0;
+		} else if(first > 64 && first * 2 > segments.size()) {
+			segments.erase(segments.begin(), segments.begin() + first);
+			first = 0;
+		}
+	}
+
+	void OutputQueue::clear() {
+		copied.clear();
+		segments.clear();
+		first = 0;
+		total = 0;
+	}
+
+	void OutputQueue::release() {
+		clear();
+		copied.release();
+	}
+
+	void OutputQueue::swap(OutputQueue &other) {
+		copied.swap(other.copied);
+		segments.swap(other.segments);
+		std::swap(first, other.first);
+		std::swap(total, other.total);
+	}
+};
+
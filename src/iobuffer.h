@@ -0,0 +1,160 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+
+namespace zlynx {
+	// Byte buffer for socket I/O. Data is appended at the back and
+	// consumed from the front.
+	// Consuming only moves the read offset, so taking one request or one
+	// partial write off the front is O(1) however much follows it. The
+	// unread bytes stay contiguous so they can be parsed in place and
+	// written with a single iovec. They are moved back to the start of
+	// the storage only when that makes room and fewer bytes are moved
+	// than were consumed, which keeps appends amortized O(1) as well.
+	//
+	// data() is the first unread byte. container_index_view offsets are
+	// relative to it, so they stay valid across appends but not across
+	// consume().
+	//
+	// Storage of up to block_size comes from a per thread BlockPool and
+	// goes back to it on release(), so an idle connection holds no
+	// buffer memory.
+	class IOBuffer {
+		public:
+		typedef char value_type;
+		typedef char* pointer;
+		typedef const char* const_pointer;
+		typedef char* iterator;
+		typedef const char* const_iterator;
+
+		static constexpr size_t block_size = 8 * 1024;
+
+		IOBuffer() {}
+		~IOBuffer() { release(); }
+		IOBuffer(const IOBuffer&) = delete;
+		void operator=(const IOBuffer&) = delete;
+		IOBuffer(IOBuffer &&other) { swap(other); }
+		IOBuffer& operator=(IOBuffer &&other) {
+			IOBuffer moved(std::move(other));
+			swap(moved);
+			return *this;
+		}
+
+		char* data() { return storage + head; }
+		const char* data() const { return storage + head; }
+		size_t size() const { return tail - head; }
+		bool empty() const { return head == tail; }
+		size_t capacity() const { return allocated; }
+
+		iterator begin() { return data(); }
+		iterator end() { return storage + tail; }
+		const_iterator begin() const { return data(); }
+		const_iterator end() const { return storage + tail; }
+		const_iterator cbegin() const { return begin(); }
+		const_iterator cend() const { return end(); }
+
+		// Make sure size() can grow to n without moving the data again.
+		void reserve(size_t n);
+
+		// Return space for at least n more bytes at the back. Follow with
+		// commit() for the bytes actually filled in.
+		char* prepare(size_t n);
+		void commit(size_t n) { tail += n; }
+
+		void append(const char *begin, const char *end);
+
+		// Drop n bytes from the front.
+		void consume(size_t n);
+		// Remove the n bytes at offset from data(). The bytes after them
+		// move down, the ones before stay where they are.
+		void erase(size_t offset, size_t n);
+		void clear() { head = tail = 0; }
+		// Clear and free the storage.
+		void release();
+
+		void swap(IOBuffer &other);
+
+		private:
+		char *storage = nullptr;
+		size_t allocated = 0;
+		// Offsets of the first unread byte and one past the last byte.
+		size_t head = 0;
+		size_t tail = 0;
+
+		// Ensure there are n bytes of space after tail.
+		void make_room(size_t n);
+		static char* allocate(size_t n);
+		static void deallocate(char *p, size_t n);
+	};
+
+	inline void swap(IOBuffer &a, IOBuffer &b) {
+		a.swap(b);
+	}
+
+	// Queue of output for a socket, written out with writev.
+	// Small pieces such as headers are copied into an IOBuffer. Large
+	// bodies are queued by reference, holding a reference count on
+	// whatever owns them, so they go from their storage to the kernel
+	// without a copy. A partial write only moves the front of the queue.
+	class OutputQueue {
+		public:
+		typedef std::shared_ptr<const void> Owner;
+
+		OutputQueue() {}
+		OutputQueue(const OutputQueue&) = delete;
+		void operator=(const OutputQueue&) = delete;
+		OutputQueue(OutputQueue &&other) { swap(other); }
+		OutputQueue& operator=(OutputQueue &&other) {
+			OutputQueue moved(std::move(other));
+			swap(moved);
+			return *this;
+		}
+
+		size_t size() const { return total; }
+		bool empty() const { return total == 0; }
+
+		// Copy the bytes into the queue.
+		void append(const char *begin, const char *end);
+		// Or fill them in place, as with IOBuffer.
+		char* prepare(size_t n) { return copied.prepare(n); }
+		void commit(size_t n);
+		// Queue data without copying it. owner keeps it alive until it
+		// has been written.
+		void append_ref(std::string_view data, Owner owner);
+
+		// Fill in up to n iovecs from the front of the queue and return
+		// how many were used.
+		size_t fill(iovec *iov, size_t n) const;
+		// Drop n written bytes from the front.
+		void consume(size_t n);
+		void clear();
+		// Clear and free the copy buffer.
+		void release();
+
+		void swap(OutputQueue &other);
+
+		private:
+		struct Segment {
+			// Null for bytes held in copied.
+			const char *data;
+			size_t size;
+			Owner owner;
+		};
+
+		// Copied segments in order. Their bytes are consumed along
+		// with the segments so copied.data() is always the first one.
+		IOBuffer copied;
+		std::vector<Segment> segments;
+		// Index of the first segment still queued.
+		size_t first = 0;
+		size_t total = 0;
+	};
+
+	inline void swap(OutputQueue &a, OutputQueue &b) {
+		a.swap(b);
+	}
+};
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "log.h"
+#include "errors.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace log_detail {
+		std::atomic<LogLevel> level{LogLevel::Info};
+		std::atomic<bool> access{false};
+	};
+
+	namespace {
+		enum class Kind : uint8_t {
+			Text,
+			Access
+		};
+
+		struct Header {
+			// Bytes following the header.
+			uint32_t size;
+			Kind kind;
+			LogLevel level;
+			// Microseconds since the Unix epoch.
+			int64_t time;
+		};
+
+		constexpr size_t max_line = 1024;
+		constexpr size_t max_path = 4096;
+
+		int64_t now_us() {
+			timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			return int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+		}
+
+		// Single producer, single consumer ring of variable size records.
+		// The positions only ever grow and are reduced modulo the
+		// capacity when used.
+		class Ring {
+			public:
+			static constexpr size_t capacity = size_t(1) << 20;
+
+			bool push(const Header &h, const char *data) {
+				size_t need = sizeof h + h.size;
+				uint64_t t = tail.load(std::memory_order_relaxed);
+				if(t + need - cached_head > capacity) {
+					cached_head = head.load(std::memory_order_acquire);
+					if(t + need - cached_head > capacity) {
+						dropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+				}
+				copy_in(t, &h, sizeof h);
+				copy_in(t + sizeof h, data, h.size);
+				tail.store(t + need, std::memory_order_release);
+				return true;
+			}
+
+			// Call f for each queued record. Consumer only.
+			template<class F>
+			bool drain(F f) {
+				uint64_t h = head.load(std::memory_order_relaxed);
+				uint64_t t = tail.load(std::memory_order_acquire);
+				if(h == t)
+					return false;
+				while(h != t) {
+					Header header;
+					copy_out(h, &header, sizeof header);
+					payload.resize(header.size);
+					copy_out(h + sizeof header, payload.data(), header.size);
+					h += sizeof header + header.size;
+					head.store(h, std::memory_order_release);
+					f(header, std::string_view(payload));
+				}
+				return true;
+			}
+
+			std::atomic<uint64_t> dropped{0};
+
+			private:
+			std::unique_ptr<char[]> buffer{new char[capacity]};
+			// Written by the consumer.
+			alignas(64) std::atomic<uint64_t> head{0};
+			std::string payload;
+			// Written by the producer.
+			alignas(64) std::atomic<uint64_t> tail{0};
+			uint64_t cached_head = 0;
+
+			void copy_in(uint64_t pos, const void *src, size_t n) {
+				size_t offset = pos & (capacity - 1);
+				size_t first = std::min(n, capacity - offset);
+				std::memcpy(buffer.get() + offset, src, first);
+				std::memcpy(buffer.get(), static_cast<const char*>(src) + first, n - first);
+			}
+
+			void copy_out(uint64_t pos, void *dst, size_t n) const {
+				size_t offset = pos & (capacity - 1);
+				size_t first = std::min(n, capacity - offset);
+				std::memcpy(dst, buffer.get() + offset, first);
+				std::memcpy(static_cast<char*>(dst) + first, buffer.get(), n - first);
+			}
+		};
+
+		// Rings are never freed so the writer can still drain one after
+		// its thread has exited.
+		std::mutex rings_mutex;
+		std::vector<std::unique_ptr<Ring>> rings;
+
+		Ring& local_ring() {
+			thread_local Ring *ring = nullptr;
+			if(!ring) {
+				std::lock_guard lock(rings_mutex);
+				rings.push_back(std::make_unique<Ring>());
+				ring = rings.back().get();
+			}
+			return *ring;
+		}
+
+		// Formats a line into a fixed buffer. Anything past the end of it
+		// is cut off.
+		class LineBuffer : public std::streambuf {
+			public:
+			LineBuffer() { reset(); }
+
+			void reset() { setp(line.data(), line.data() + line.size()); }
+			std::string_view view() const { return std::string_view(pbase(), pptr() - pbase()); }
+
+			protected:
+			int_type overflow(int_type c) override {
+				return traits_type::not_eof(c);
+			}
+
+			private:
+			std::array<char, max_line> line;
+		};
+
+		struct LineStream {
+			LineBuffer buffer;
+			std::ostream os{&buffer};
+			const std::ios_base::fmtflags flags = os.flags();
+
+			std::ostream& start() {
+				buffer.reset();
+				os.clear();
+				os.flags(flags);
+				os.fill(' ');
+				return os;
+			}
+		};
+
+		LineStream& local_line() {
+			thread_local LineStream line;
+			return line;
+		}
+
+		std::string_view level_name(LogLevel level) {
+			switch(level) {
+				case LogLevel::Debug: return "DEBUG"sv;
+				case LogLevel::Info: return "INFO"sv;
+				case LogLevel::Warning: return "WARNING"sv;
+				case LogLevel::Error: return "ERROR"sv;
+				default: return "-"sv;
+			}
+		}
+
+		// Appends an ISO 8601 UTC time with microseconds.
+		void append_time(std::string &out, int64_t us) {
+			time_t seconds = us / 1000000;
+			tm t;
+			gmtime_r(&seconds, &t);
+			std::array<char, 40> buf;
+			size_t n = std::strftime(buf.data(), buf.size(), "%Y-%m-%dT%H:%M:%S", &t);
+			n += std::snprintf(buf.data() + n, buf.size() - n, ".%06dZ", int(us % 1000000));
+			out.append(buf.data(), n);
+		}
+
+		void write_all(int handle, std::string_view data) {
+			while(!data.empty()) {
+				ssize_t n = ::write(handle, data.data(), data.size());
+				if(n < 0) {
+					if(errno == EINTR)
+						continue;
+					// There is nowhere left to report it.
+					return;
+				}
+				data.remove_prefix(n);
+			}
+		}
+
+		int open_log(const std::string &path) {
+			int h = ::open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+			if(h < 0)
+				throw posix_error("open " + path, errno);
+			return h;
+		}
+	}
+
+	LogLevel parse_log_level(std::string_view s) {
+		if(s == "debug")
+			return LogLevel::Debug;
+		if(s == "info")
+			return LogLevel::Info;
+		if(s == "warning")
+			return LogLevel::Warning;
+		if(s == "error")
+			return LogLevel::Error;
+		if(s == "off")
+			return LogLevel::Off;
+		throw std::invalid_argument("unknown log level: " + std::string(s));
+	}
+
+	AccessLogFormat parse_access_log_format(std::string_view s) {
+		if(s == "text")
+			return AccessLogFormat::Text;
+		if(s == "binary")
+			return AccessLogFormat::Binary;
+		throw std::invalid_argument("unknown access log format: " + std::string(s));
+	}
+
+	void set_log_level(LogLevel level) {
+		log_detail::level.store(level, std::memory_order_relaxed);
+	}
+
+	LogRecord::LogRecord(LogLevel level):
+		level(level),
+		os(local_line().start())
+	{
+	}
+
+	LogRecord::~LogRecord() {
+		auto text = local_line().buffer.view();
+		local_ring().push(Header{ uint32_t(text.size()), Kind::Text, level, now_us() }, text.data());
+	}
+
+	void log_access(const AccessRecord &r) {
+		auto method = r.method.substr(0, 255);
+		auto proto = r.proto.substr(0, 255);
+		auto path = r.path.substr(0, max_path);
+
+		std::array<char, sizeof(BinaryAccessRecord) + 255 + 255 + max_path> buf;
+		BinaryAccessRecord b{};
+		b.size = sizeof b + method.size() + path.size() + proto.size();
+		b.status = r.status;
+		b.method_size = method.size();
+		b.proto_size = proto.size();
+		b.time = now_us();
+		b.length = r.length;
+		std::memcpy(b.address, r.remote.sin6_addr.s6_addr, sizeof b.address);
+		b.port = ntohs(r.remote.sin6_port);
+		b.path_size = path.size();
+
+		char *p = buf.data();
+		std::memcpy(p, &b, sizeof b);
+		p += sizeof b;
+		for(auto s: {method, path, proto}) {
+			std::memcpy(p, s.data(), s.size());
+			p += s.size();
+		}
+		local_ring().push(Header{ b.size, Kind::Access, LogLevel::Info, b.time }, buf.data());
+	}
+
+	uint64_t log_dropped() {
+		std::lock_guard lock(rings_mutex);
+		uint64_t total = 0;
+		for(auto &r: rings) {
+			total += r->dropped.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	LogWriter::LogWriter(
+		const std::string &log_path,
+		const std::string &access_path,
+		AccessLogFormat access_format
+	):
+		access_format(access_format)
+	{
+		if(!log_path.empty())
+			log_handle = open_log(log_path);
+		if(!access_path.empty()) {
+			access_handle = open_log(access_path);
+			log_detail::access.store(true);
+		}
+		thread = std::thread([this] { run(); });
+	}
+
+	LogWriter::~LogWriter() {
+		stopping = true;
+		thread.join();
+		log_detail::access.store(false);
+		if(log_handle != 1)
+			::close(log_handle);
+		if(access_handle >= 0)
+			::close(access_handle);
+	}
+
+	void LogWriter::run() {
+		// Back off while there is nothing to write.
+		constexpr auto min_idle = 1ms;
+		constexpr auto max_idle = 50ms;
+		auto idle = min_idle;
+		while(!stopping) {
+			if(collect()) {
+				write_batches();
+				idle = min_idle;
+			} else {
+				std::this_thread::sleep_for(idle);
+				idle = std::min<std::chrono::milliseconds>(idle * 2, max_idle);
+			}
+		}
+		collect();
+		write_batches();
+	}
+
+	bool LogWriter::collect() {
+		bool any = false;
+		std::lock_guard lock(rings_mutex);
+		for(auto &r: rings) {
+			any |= r->drain([this](const Header &h, std::string_view data) {
+				if(h.kind == Kind::Text) {
+					append_time(log_batch, h.time);
+					log_batch += ' ';
+					log_batch += level_name(h.level);
+					log_batch += ' ';
+					log_batch += data;
+					log_batch += '\n';
+				} else if(access_handle >= 0) {
+					if(access_format == AccessLogFormat::Binary) {
+						access_batch += data;
+						return;
+					}
+					BinaryAccessRecord b;
+					std::memcpy(&b, data.data(), sizeof b);
+					data.remove_prefix(sizeof b);
+					std::array<char, INET6_ADDRSTRLEN> address;
+					inet_ntop(AF_INET6, b.address, address.data(), address.size());
+					// Common log format with the status and body length.
+					access_batch += address.data();
+					access_batch += " - - ["sv;
+					append_time(access_batch, b.time);
+					access_batch += "] "sv;
+					if(b.method_size) {
+						access_batch += '"';
+						access_batch += data.substr(0, b.method_size);
+						access_batch += ' ';
+						access_batch += data.substr(b.method_size, b.path_size);
+						access_batch += ' ';
+						access_batch += data.substr(b.method_size + b.path_size, b.proto_size);
+						access_batch += "\" "sv;
+					} else {
+						// The request line was not understood.
+						access_batch += "\"-\" "sv;
+					}
+					access_batch += std::to_string(b.status);
+					access_batch += ' ';
+					access_batch += std::to_string(b.length);
+					access_batch += '\n';
+				}
+			});
+		}
+		uint64_t dropped = 0;
+		for(auto &r: rings) {
+			dropped += r->dropped.load(std::memory_order_relaxed);
+		}
+		if(dropped != dropped_reported) {
+			append_time(log_batch, now_us());
+			log_batch += " WARNING dropped "sv;
+			log_batch += std::to_string(dropped - dropped_reported);
+			log_batch += " log records, buffer full\n"sv;
+			dropped_reported = dropped;
+			any = true;
+		}
+		return any;
+	}
+
+	void LogWriter::write_batches() {
+		write_all(log_handle, log_batch);
+		log_batch.clear();
+		if(access_handle >= 0)
+			write_all(access_handle, access_batch);
+		access_batch.clear();
+	}
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <netinet/in.h>
+
+namespace zlynx {
+	// Logging that stays off the event loop.
+	// LOG(level) formats one line into a thread local buffer and copies
+	// it into that thread's ring buffer. A LogWriter thread collects the
+	// rings, adds timestamps and writes in large batches. If a ring is
+	// full the record is dropped and counted rather than waiting.
+	//
+	//   LOG(Debug) << "timeout on handle " << handle;
+	//
+	// A disabled level costs one relaxed load and the arguments are not
+	// evaluated.
+
+	enum class LogLevel : uint8_t {
+		Debug,
+		Info,
+		Warning,
+		Error,
+		Off
+	};
+	LogLevel parse_log_level(std::string_view s);
+
+	enum class AccessLogFormat : uint8_t {
+		Text,
+		Binary
+	};
+	AccessLogFormat parse_access_log_format(std::string_view s);
+
+	namespace log_detail {
+		extern std::atomic<LogLevel> level;
+		extern std::atomic<bool> access;
+	};
+
+	inline bool log_enabled(LogLevel level) {
+		return level >= log_detail::level.load(std::memory_order_relaxed);
+	}
+	void set_log_level(LogLevel level);
+
+	// One log line, queued when it is destroyed.
+	class LogRecord {
+		public:
+		explicit LogRecord(LogLevel level);
+		~LogRecord();
+		LogRecord(const LogRecord&) = delete;
+		void operator=(const LogRecord&) = delete;
+
+		std::ostream& stream() { return os; }
+
+		private:
+		LogLevel level;
+		std::ostream &os;
+	};
+
+	// One line of the access log.
+	struct AccessRecord {
+		const sockaddr_in6 &remote;
+		std::string_view method;
+		std::string_view path;
+		std::string_view proto;
+		unsigned status;
+		// Bytes in the response body.
+		uint64_t length;
+	};
+
+	inline bool access_log_enabled() {
+		return log_detail::access.load(std::memory_order_relaxed);
+	}
+	void log_access(const AccessRecord &r);
+
+	// The binary access log is a sequence of these, each followed by the
+	// method, path and protocol bytes. Integers are in host order.
+	struct BinaryAccessRecord {
+		// Bytes in the record including the strings.
+		uint32_t size;
+		uint16_t status;
+		uint8_t method_size;
+		uint8_t proto_size;
+		// Microseconds since the Unix epoch.
+		int64_t time;
+		uint64_t length;
+		uint8_t address[16];
+		uint16_t port;
+		uint16_t path_size;
+		uint32_t unused;
+	};
+
+	// Records thrown away because a ring buffer was full.
+	uint64_t log_dropped();
+
+	// The thread that writes out the queued records.
+	// Records queued before it starts are kept until the rings fill.
+	// Destroying it writes out everything still queued.
+	class LogWriter {
+		public:
+		// An empty log_path means standard output. An empty access_path
+		// turns the access log off.
+		LogWriter(
+			const std::string &log_path,
+			const std::string &access_path = std::string(),
+			AccessLogFormat access_format = AccessLogFormat::Text
+		);
+		~LogWriter();
+		LogWriter(const LogWriter&) = delete;
+		void operator=(const LogWriter&) = delete;
+
+		private:
+		int log_handle = 1;
+		int access_handle = -1;
+		AccessLogFormat access_format;
+		std::atomic<bool> stopping{false};
+		uint64_t dropped_reported = 0;
+		std::string log_batch;
+		std::string access_batch;
+		std::thread thread;
+
+		void run();
+		// Move every queued record into the batches. Returns false if
+		// there were none.
+		bool collect();
+		void write_batches();
+	};
+};
+
+#define LOG(level) \
+	if(!::zlynx::log_enabled(::zlynx::LogLevel::level)) {} \
+	else ::zlynx::LogRecord(::zlynx::LogLevel::level).stream()
@@ -1,31 +1,93 @@
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
 
 #include "config.h"
+#include "log.h"
 #include "sockets.h"
 #include "datastore.h"
 #include "app.h"
 
-namespace zlynx {
-	struct null_ostream : public std::ostream {};
-	template<typename T>
-	null_ostream& operator<<(null_ostream& os, const T&) { return os; }
-	null_ostream& operator<<(null_ostream& os, const char*) { return os; }
-	null_ostream null_os;
-
-	std::ostream& logger(std::cout);
-}
-
 using namespace zlynx;
 
 int main(int argc, char *argv[]) {
 	Config config(argc, argv);
 
-	logger << "Starting mersive-http server on port " << config.port << std::endl;
-	auto sockets = std::make_shared<Sockets>();
-	auto listener = std::make_unique<AppListener>(config.port, std::make_unique<Datastore>());
-	listener->start();
-	sockets->add_socket(std::move(listener));
-	sockets->start();
+	// SIGUSR1 asks for a snapshot. It is blocked before any thread
+	// starts and taken by sigwait in its own thread.
+	sigset_t snapshot_signal;
+	sigemptyset(&snapshot_signal);
+	sigaddset(&snapshot_signal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &snapshot_signal, nullptr);
+
+	set_log_level(config.log_level);
+	// Declared first so it is destroyed last and writes out everything.
+	LogWriter log_writer(config.log_file, config.access_log, config.access_log_format);
+
+	LOG(Info)
+		<< "Starting mersive-http server on port " << config.port
+		<< " with " << config.threads << (config.threads > 1 ? " threads" : " thread");
+
+	// One event loop per thread, each with its own Listener on the same
+	// port. They all share the Datastore.
+	auto store = config.data_dir.empty()
+		? std::make_shared<Datastore>()
+		: std::make_shared<Datastore>(config.data_dir);
+	store->set_compression(config.compress_min_size, config.compress_set_size);
+	store->set_cache_size(config.cache_size);
+	store->set_upload_budget(config.upload_budget);
+	if(!config.snapshot.empty()) {
+		store->set_snapshot_path(config.snapshot);
+		// A data directory that already has records wins over the
+		// snapshot, which restore refuses.
+		if(::access(config.snapshot.c_str(), F_OK) == 0) {
+			try {
+				size_t keys = store->restore(config.snapshot);
+				LOG(Info) << "restored " << keys << " keys from " << config.snapshot;
+			} catch(const std::exception &e) {
+				LOG(Error) << "not restoring snapshot: " << e.what();
+			}
+		}
+	}
+	std::atomic<bool> stopping{false};
+	std::thread signal_thread([&] {
+		int sig;
+		while(sigwait(&snapshot_signal, &sig) == 0 && !stopping) {
+			if(!store->start_dump()) {
+				LOG(Warning) << "snapshot not started, none configured or one is running";
+			}
+		}
+	});
+	std::vector<std::shared_ptr<Sockets>> loops;
+	for(unsigned i = 0; i < config.threads; ++i) {
+		auto sockets = make_sockets(config.events);
+		auto documents = config.doc_root.empty()
+			? nullptr
+			: std::make_shared<DocumentRoot>(config.doc_prefix, config.doc_root, FileCache::capacity_for(config.threads));
+		auto listener = std::make_unique<AppListener>(
+			config.port, store,
+			config.idle_timeout, config.header_timeout,
+			HTTPLimits{config.max_header_size, config.max_body_size},
+			std::move(documents)
+		);
+		listener->start(config.threads > 1);
+		sockets->add_socket(std::move(listener));
+		loops.push_back(sockets);
+	}
+	std::vector<std::thread> threads;
+	for(size_t i = 1; i < loops.size(); ++i) {
+		threads.emplace_back([s = loops[i]] { s->start(); });
+	}
+	loops[0]->start();
+	for(auto &t: threads) {
+		t.join();
+	}
+	stopping = true;
+	pthread_kill(signal_thread.native_handle(), SIGUSR1);
+	signal_thread.join();
 	return 0;
 }
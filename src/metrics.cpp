@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "log.h"
+#include "metrics.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace metrics_detail {
+		thread_local ThreadMetrics *local = nullptr;
+	};
+
+	namespace {
+		int64_t monotonic_ns() {
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+		}
+
+		// Ticks are converted to seconds by comparing them with the
+		// monotonic clock over the life of the process.
+		struct ClockPair {
+			uint64_t ticks;
+			int64_t ns;
+		};
+		const ClockPair clock_start{ ticks(), monotonic_ns() };
+
+		double seconds_per_tick() {
+			ClockPair now{ ticks(), monotonic_ns() };
+			if(now.ticks <= clock_start.ticks || now.ns <= clock_start.ns)
+				return 1e-9;
+			return (now.ns - clock_start.ns) * 1e-9 / (now.ticks - clock_start.ticks);
+		}
+
+		// Blocks are never freed so the counts of exited threads stay
+		// in the totals.
+		std::mutex threads_mutex;
+		std::vector<std::unique_ptr<ThreadMetrics>> threads;
+
+		constexpr std::array<std::string_view, ThreadMetrics::method_count> method_names = {
+			"GET"sv, "PUT"sv, "POST"sv, "DELETE"sv, "other"sv
+		};
+
+		struct Snapshot {
+			std::array<uint64_t, size_t(Counter::Count)> counters{};
+			std::array<uint64_t, ThreadMetrics::method_count> requests{};
+			std::array<uint64_t, ThreadMetrics::status_count> statuses{};
+			std::array<Histogram, size_t(Latency::Count)> latencies;
+		};
+
+		void header(std::string &out, std::string_view name, std::string_view type, std::string_view help) {
+			out += "# HELP "sv;
+			out += name;
+			out += ' ';
+			out += help;
+			out += "\n# TYPE "sv;
+			out += name;
+			out += ' ';
+			out += type;
+			out += '\n';
+		}
+
+		void sample(std::string &out, std::string_view name, std::string_view labels, uint64_t value) {
+			out += name;
+			out += labels;
+			out += ' ';
+			out += std::to_string(value);
+			out += '\n';
+		}
+
+		void counter(std::string &out, std::string_view name, std::string_view help, uint64_t value) {
+			header(out, name, "counter"sv, help);
+			sample(out, name, ""sv, value);
+		}
+
+		void summary(std::string &out, std::string_view name, std::string_view help, const Histogram &h, double scale) {
+			header(out, name, "summary"sv, help);
+			std::array<char, 64> buf;
+			for(auto q: {0.5, 0.9, 0.99, 0.999, 1.0}) {
+				uint64_t v = q < 1 ? h.percentile(q) : h.max();
+				int n = std::snprintf(buf.data(), buf.size(), "{quantile=\"%g\"} %.9g\n", q, v * scale);
+				out += name;
+				out.append(buf.data(), n);
+			}
+			int n = std::snprintf(buf.data(), buf.size(), "_sum %.9g\n", h.total_sum() * scale);
+			out += name;
+			out.append(buf.data(), n);
+			sample(out, std::string(name) + "_count", ""sv, h.count());
+		}
+	};
+
+	ThreadMetrics& metrics_detail::create() {
+		std::lock_guard lock(threads_mutex);
+		threads.push_back(std::make_unique<ThreadMetrics>());
+		local = threads.back().get();
+		return *local;
+	}
+
+	void ThreadMetrics::request(std::string_view method, unsigned status) {
+		size_t m = 0;
+		while(m < method_count - 1 && method != method_names[m])
+			++m;
+		++requests[m];
+		++statuses[status >= 100 && status < status_count ? status : 0];
+	}
+
+	std::string render_metrics() {
+		Snapshot s;
+		{
+			std::lock_guard lock(threads_mutex);
+			for(auto &t: threads) {
+				for(size_t i = 0; i < s.counters.size(); ++i) {
+					s.counters[i] += t->counters[i];
+				}
+				for(size_t i = 0; i < s.requests.size(); ++i) {
+					s.requests[i] += t->requests[i];
+				}
+				for(size_t i = 0; i < s.statuses.size(); ++i) {
+					s.statuses[i] += t->statuses[i];
+				}
+				for(size_t i = 0; i < s.latencies.size(); ++i) {
+					s.latencies[i].merge(t->latencies[i]);
+				}
+			}
+		}
+		auto count = [&s](Counter c) { return s.counters[size_t(c)]; };
+		auto latency = [&s](Latency l) -> const Histogram& { return s.latencies[size_t(l)]; };
+
+		std::string out;
+		out.reserve(8192);
+		counter(out, "zlynx_accepts_total"sv, "Connections accepted."sv, count(Counter::Accepts));
+		header(out, "zlynx_connections_active"sv, "gauge"sv, "Connections open now."sv);
+		sample(out, "zlynx_connections_active"sv, ""sv,
+			count(Counter::ConnectionsOpened) - count(Counter::ConnectionsClosed));
+
+		header(out, "zlynx_requests_total"sv, "counter"sv, "Requests by method."sv);
+		for(size_t i = 0; i < s.requests.size(); ++i) {
+			sample(out, "zlynx_requests_total"sv, "{method=\"" + std::string(method_names[i]) + "\"}", s.requests[i]);
+		}
+		header(out, "zlynx_responses_total"sv, "counter"sv, "Responses by status code."sv);
+		for(size_t i = 0; i < s.statuses.size(); ++i) {
+			if(s.statuses[i])
+				sample(out, "zlynx_responses_total"sv, "{status=\"" + (i ? std::to_string(i) : "other"s) + "\"}", s.statuses[i]);
+		}
+
+		counter(out, "zlynx_received_bytes_total"sv, "Bytes read from connections."sv, count(Counter::BytesIn));
+		counter(out, "zlynx_sent_bytes_total"sv, "Bytes written to connections."sv, count(Counter::BytesOut));
+		counter(out, "zlynx_store_hits_total"sv, "Datastore lookups that found the key."sv, count(Counter::StoreHits));
+		counter(out, "zlynx_store_misses_total"sv, "Datastore lookups that did not find the key."sv, count(Counter::StoreMisses));
+		counter(out, "zlynx_store_evictions_total"sv, "Keys evicted to keep the Datastore under its cache size."sv, count(Counter::StoreEvictions));
+		counter(out, "zlynx_store_expired_total"sv, "Keys removed when their time to live ran out."sv, count(Counter::StoreExpirations));
+		header(out, "zlynx_store_resident_bytes"sv, "gauge"sv, "Memory taken by Datastore keys, values and index."sv);
+		sample(out, "zlynx_store_resident_bytes"sv, ""sv,
+			count(Counter::StoreBytesAdded) - count(Counter::StoreBytesRemoved));
+		counter(out, "zlynx_log_dropped_total"sv, "Log records dropped because a buffer was full."sv, log_dropped());
+
+		double scale = seconds_per_tick();
+		summary(out, "zlynx_parse_seconds"sv, "Time parsing request heads."sv, latency(Latency::Parse), scale);
+		summary(out, "zlynx_handler_seconds"sv, "Time in request handlers."sv, latency(Latency::Handler), scale);
+		summary(out, "zlynx_first_byte_seconds"sv, "From reading a request to writing its response."sv, latency(Latency::FirstByte), scale);
+		summary(out, "zlynx_poll_seconds"sv, "Work in one event loop iteration."sv, latency(Latency::Poll), scale);
+		return out;
+	}
+};
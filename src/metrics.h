@@ -0,0 +1,111 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "histogram.h"
+
+namespace zlynx {
+	// Server metrics, cheap enough to leave on.
+	// Every thread updates its own ThreadMetrics without locks or atomic
+	// read-modify-writes. render_metrics() sums all of them for the
+	// /_stats page, in the Prometheus text format.
+
+	// A counter with one writing thread that any thread may read.
+	// Increments are a plain load and store.
+	class RelaxedCounter {
+		public:
+		RelaxedCounter() {}
+		RelaxedCounter(const RelaxedCounter&) = delete;
+		void operator=(const RelaxedCounter&) = delete;
+
+		operator uint64_t() const { return v.load(std::memory_order_relaxed); }
+		RelaxedCounter& operator=(uint64_t x) {
+			v.store(x, std::memory_order_relaxed);
+			return *this;
+		}
+		RelaxedCounter& operator+=(uint64_t x) { return *this = *this + x; }
+		RelaxedCounter& operator++() { return *this += 1; }
+
+		private:
+		std::atomic<uint64_t> v{0};
+	};
+
+	enum class Counter : uint8_t {
+		Accepts,
+		ConnectionsOpened,
+		ConnectionsClosed,
+		BytesIn,
+		BytesOut,
+		// Datastore gets that found a key and that did not.
+		StoreHits,
+		StoreMisses,
+		StoreEvictions,
+		StoreExpirations,
+		// The resident memory of the Datastore is the difference.
+		StoreBytesAdded,
+		StoreBytesRemoved,
+		Count
+	};
+
+	// Each is a histogram of durations in ticks.
+	enum class Latency : uint8_t {
+		// Parsing a request head, over all the reads it took.
+		Parse,
+		// The on_get etc. call.
+		Handler,
+		// From reading a request to writing the first bytes of its
+		// response.
+		FirstByte,
+		// The work in one Sockets::poll, not counting the wait.
+		Poll,
+		Count
+	};
+
+	struct ThreadMetrics {
+		// GET, PUT, POST, DELETE and anything else.
+		static constexpr size_t method_count = 5;
+		// Statuses from 100 to 599 by code. Zero holds the rest.
+		static constexpr size_t status_count = 600;
+
+		std::array<RelaxedCounter, size_t(Counter::Count)> counters;
+		std::array<RelaxedCounter, method_count> requests;
+		std::array<RelaxedCounter, status_count> statuses;
+		std::array<BasicHistogram<RelaxedCounter>, size_t(Latency::Count)> latencies;
+
+		void add(Counter c, uint64_t n = 1) { counters[size_t(c)] += n; }
+		void record(Latency l, uint64_t ticks) { latencies[size_t(l)].record(ticks); }
+		void request(std::string_view method, unsigned status);
+	};
+
+	namespace metrics_detail {
+		extern thread_local ThreadMetrics *local;
+		ThreadMetrics& create();
+	};
+
+	// The calling thread's metrics.
+	inline ThreadMetrics& thread_metrics() {
+		ThreadMetrics *m = metrics_detail::local;
+		return m ? *m : metrics_detail::create();
+	}
+
+	// A fast monotonic clock for measuring durations. The time stamp
+	// counter where there is one, otherwise nanoseconds.
+	inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+#endif
+	}
+
+	// Every thread's metrics in the Prometheus text exposition format.
+	std::string render_metrics();
+};
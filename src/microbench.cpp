@@ -0,0 +1,276 @@
+// Microbenchmarks of the request parser and the Datastore.
+// The parser is compared with the find_string and build_header_map
+// parsing that HTTPConnection used before RequestParser.
+// Usage: microbench [iterations]
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <malloc.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "datastore.h"
+#include "iobuffer.h"
+#include "headers.h"
+#include "parser.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	constexpr auto typical_request =
+		"GET /api/v1/items/12345?fields=name,size HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Connection: keep-alive\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+		"Cache-Control: max-age=0\r\n"
+		"If-None-Match: \"5d41402abc4b2a76b9719d911017c592\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"\r\n"sv;
+
+	// The old parser, kept here as the baseline.
+	namespace legacy {
+		constexpr auto header_divider = "\r\n\r\n"sv;
+
+		const char* find_string(const char *begin, const char *end, std::string_view needle) {
+			while(begin != end) {
+				size_t n = end - begin;
+				const char *p = static_cast<const char*>(std::memchr(begin, needle[0], n));
+				if(!p)
+					return p;
+				if(p + needle.size() > end)
+					return nullptr;
+				if(0 == std::memcmp(p, needle.data(), needle.size()))
+					return p;
+				begin = p + 1;
+			}
+			return nullptr;
+		}
+
+		template<class SrcT, class DstT>
+		size_t split_string_into(const SrcT &src, const char c, DstT &dst) {
+			size_t pos = 0;
+			size_t end;
+			size_t count = 0;
+			while( (end = src.find_first_of(c, pos)) != SrcT::npos ) {
+				dst[count++] = src.substr(pos,end-pos);
+				pos = end + 1;
+				if(count == dst.size())
+					return count;
+			}
+			dst[count++] = src.substr(pos, src.size()-pos);
+			return count;
+		}
+
+		std::string to_lower_string(std::string_view s) {
+			std::string result(s.size(), 0);
+			for(size_t i = 0; i < s.size(); ++i)
+				result[i] = ((s[i] & 0x40) >> 1) | s[i];
+			return result;
+		}
+
+		struct Parser {
+			size_t search_point = 0;
+			std::array<std::string_view, 3> first_line_words;
+			std::unordered_map<std::string, std::string_view> header_map;
+
+			// Returns the size of the head, or zero if it is incomplete.
+			size_t parse(const char *begin, const char *end) {
+				const char *header_end = find_string(begin + search_point, end, header_divider);
+				if(!header_end) {
+					if(size_t(end - begin) > header_divider.size())
+						search_point = end - begin - header_divider.size();
+					return 0;
+				}
+				const char *line_end = find_string(begin, end, "\r\n"sv);
+				split_string_into(std::string_view(begin, line_end - begin), ' ', first_line_words);
+				while(line_end != header_end) {
+					const char *line_start = line_end + 2;
+					const char *key_end = find_string(line_start, header_end, ":"sv);
+					line_end = find_string(line_start, header_end, "\r\n"sv);
+					if(!line_end)
+						line_end = header_end;
+					const char *value_start = key_end + 2;
+					header_map.emplace(
+						to_lower_string(std::string_view(line_start, key_end - line_start)),
+						std::string_view(value_start, line_end - value_start)
+					);
+				}
+				return header_end - begin + header_divider.size();
+			}
+
+			void reset() {
+				search_point = 0;
+				header_map.clear();
+			}
+		};
+	}
+
+	volatile size_t sink;
+
+	// Bytes of heap in use, to see what a stored key costs.
+	size_t heap_used() {
+		return mallinfo2().uordblks;
+	}
+
+	template<class F>
+	void report(const char *name, size_t requests, size_t bytes, F f) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout
+			<< name << ": "
+			<< elapsed.count() * 1e9 / requests << " ns/request, "
+			<< bytes / elapsed.count() / 1e6 << " MB/s\n";
+	}
+
+	// Searching a head for its end, the old way and the new.
+	void run_search(size_t iterations) {
+		auto request = typical_request;
+		size_t bytes = iterations * request.size();
+		std::cout << "search for the end of the head\n";
+
+		report("  find_string", iterations, bytes, [&] {
+			for(size_t i = 0; i < iterations; ++i) {
+				auto p = legacy::find_string(request.data(), request.data() + request.size(), legacy::header_divider);
+				sink = sink + (p - request.data());
+			}
+		});
+
+		// RequestParser stops at every line end, so count those.
+		report("  find_control_char", iterations, bytes, [&] {
+			for(size_t i = 0; i < iterations; ++i) {
+				const char *p = request.data();
+				const char *end = p + request.size();
+				size_t lines = 0;
+				while((p = find_control_char(p, end)) != end) {
+					lines += *p == '\n';
+					++p;
+				}
+				sink = sink + lines;
+			}
+		});
+	}
+
+	// Feed the request in pieces of chunk bytes, the way reads arrive.
+	void run_parse(size_t iterations, size_t chunk) {
+		auto request = typical_request;
+		IOBuffer input;
+		size_t bytes = iterations * request.size();
+		std::cout << "chunk " << chunk << " bytes\n";
+
+		report("  legacy", iterations, bytes, [&] {
+			legacy::Parser parser;
+			for(size_t i = 0; i < iterations; ++i) {
+				size_t head = 0;
+				for(size_t pos = 0; !head; pos += chunk) {
+					size_t n = std::min(chunk, request.size() - pos);
+					input.append(request.data() + pos, request.data() + pos + n);
+					head = parser.parse(input.data(), input.data() + input.size());
+				}
+				sink = sink + parser.header_map.size() + parser.first_line_words[1].size();
+				input.consume(head);
+				parser.reset();
+			}
+		});
+
+		report("  RequestParser", iterations, bytes, [&] {
+			RequestParser parser;
+			HeaderTable headers;
+			for(size_t i = 0; i < iterations; ++i) {
+				RequestParser::Result result = RequestParser::Incomplete;
+				for(size_t pos = 0; result == RequestParser::Incomplete; pos += chunk) {
+					size_t n = std::min(chunk, request.size() - pos);
+					input.append(request.data() + pos, request.data() + pos + n);
+					result = parser.parse(input, headers);
+				}
+				if(result == RequestParser::Error)
+					throw std::logic_error("benchmark request did not parse");
+				sink = sink + headers.size() + parser.path(input).size();
+				input.consume(parser.size());
+				parser.reset();
+				headers.clear();
+			}
+		});
+	}
+
+	void run_datastore(size_t iterations, size_t key_count) {
+		std::vector<std::string> keys;
+		for(size_t i = 0; i < key_count; ++i) {
+			keys.push_back("/items/" + std::to_string(i));
+		}
+		const std::string body(1024, 'x');
+		Entry entry{"text/plain"sv, body};
+		Datastore store;
+		size_t bytes = iterations * body.size();
+		std::cout << "Datastore with " << key_count << " keys\n";
+
+		size_t before = heap_used();
+		for(auto &key: keys) {
+			store.set(key, entry);
+		}
+		std::cout << "  " << (heap_used() - before) / key_count - body.size() << " bytes per key besides the body\n";
+
+		report("  set", iterations, bytes, [&] {
+			for(size_t i = 0; i < iterations; ++i) {
+				store.set(keys[i % key_count], entry);
+			}
+		});
+
+		report("  get hit", iterations, bytes, [&] {
+			for(size_t i = 0; i < iterations; ++i) {
+				sink = sink + store.get(keys[i % key_count]).body.size();
+			}
+		});
+
+		report("  get miss", iterations, bytes, [&] {
+			for(size_t i = 0; i < iterations; ++i) {
+				sink = sink + store.get("/missing"sv).body.size();
+			}
+		});
+
+		// Every thread reads while one also writes, as the server's loops
+		// share one Datastore.
+		unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+		std::cout << "Datastore with " << threads << " threads\n";
+		report("  get, 1 writer", iterations * threads, bytes * threads, [&] {
+			std::vector<std::thread> workers;
+			for(unsigned t = 0; t < threads; ++t) {
+				workers.emplace_back([&, t] {
+					size_t found = 0;
+					for(size_t i = 0; i < iterations; ++i) {
+						size_t k = (i * 7919 + t) % key_count;
+						if(t == 0 && i % 16 == 0)
+							store.set(keys[k], entry);
+						found += store.get(keys[k]).body.size();
+					}
+					sink = sink + found;
+				});
+			}
+			for(auto &w: workers) {
+				w.join();
+			}
+		});
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+	run_search(iterations);
+	run_parse(iterations, typical_request.size());
+	run_parse(iterations, 64);
+	run_datastore(iterations, 100000);
+	// Too many for the caches, so lookups wait on memory.
+	run_datastore(iterations, 1000000);
+	return 0;
+}
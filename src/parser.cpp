@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "parser.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace {
+		constexpr auto bad_request = "400 Bad Request"sv;
+		constexpr auto too_large = "431 Request Header Fields Too Large"sv;
+		constexpr auto bad_version = "505 HTTP Version Not Supported"sv;
+		constexpr auto body_too_large = "413 Content Too Large"sv;
+
+		// The characters allowed in a method or header name.
+		constexpr std::array<bool, 256> make_token_chars() {
+			std::array<bool, 256> t{};
+			for(int c = '0'; c <= '9'; ++c)
+				t[c] = true;
+			for(int c = 'A'; c <= 'Z'; ++c)
+				t[c] = t[c | 0x20] = true;
+			for(char c: "!#$%&'*+-.^_`|~"sv)
+				t[static_cast<unsigned char>(c)] = true;
+			return t;
+		}
+		constexpr auto token_chars = make_token_chars();
+
+		bool is_token_char(char c) {
+			return token_chars[static_cast<unsigned char>(c)];
+		}
+
+		bool is_space(char c) {
+			return c == ' ' || c == '\t';
+		}
+
+		bool is_digit(char c) {
+			return c >= '0' && c <= '9';
+		}
+
+		int hex_value(char c) {
+			if(is_digit(c))
+				return c - '0';
+			c |= 0x20;
+			if(c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			return -1;
+		}
+	}
+
+	const char* find_control_char(const char *p, const char *end) {
+		// A byte is a control character when the unsigned minimum of it
+		// and 0x1f is itself. Tab is taken back out and DEL added.
+#if defined(__AVX2__)
+		const __m256i limit = _mm256_set1_epi8(0x1f);
+		const __m256i tab = _mm256_set1_epi8('\t');
+		const __m256i del = _mm256_set1_epi8(0x7f);
+		while(end - p >= 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			__m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v);
+			ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+			ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+			unsigned mask = _mm256_movemask_epi8(ctl);
+			if(mask)
+				return p + __builtin_ctz(mask);
+			p += 32;
+		}
+#elif defined(__SSE2__)
+		const __m128i limit = _mm_set1_epi8(0x1f);
+		const __m128i tab = _mm_set1_epi8('\t');
+		const __m128i del = _mm_set1_epi8(0x7f);
+		while(end - p >= 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+			ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab), ctl);
+			ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, del));
+			unsigned mask = _mm_movemask_epi8(ctl);
+			if(mask)
+				return p + __builtin_ctz(mask);
+			p += 16;
+		}
+#endif
+		for(; p != end; ++p) {
+			unsigned char c = *p;
+			if((c < 0x20 && c != '\t') || c == 0x7f)
+				return p;
+		}
+		return end;
+	}
+
+	RequestParser::Result RequestParser::parse(const IOBuffer &input, HeaderTable &headers) {
+		const char *base = input.data();
+		const char *end = base + input.size();
+		while(state == State::RequestLine || state == State::Headers) {
+			const char *line = base + line_start;
+			const char *stop = find_control_char(base + scanned, end);
+			if(stop == end) {
+				scanned = end - base;
+				return incomplete(input);
+			}
+			const char *next;
+			if(*stop == '\r') {
+				// Look at the CR again once the LF arrives.
+				if(stop + 1 == end) {
+					scanned = stop - base;
+					return incomplete(input);
+				}
+				if(stop[1] != '\n')
+					return fail(bad_request);
+				next = stop + 2;
+			} else if(*stop == '\n') {
+				next = stop + 1;
+			} else {
+				return fail(bad_request);
+			}
+			if(size_t(next - base) > max_size)
+				return fail(too_large);
+
+			if(state == State::RequestLine) {
+				// Empty lines before a request are allowed and ignored.
+				if(stop != line) {
+					if(!parse_request_line(base, line, stop))
+						return fail(error_status);
+					state = State::Headers;
+				}
+			} else if(stop == line) {
+				head_size = next - base;
+				state = State::Done;
+			} else if(!parse_header_line(input, line, stop, headers)) {
+				return fail(error_status);
+			}
+			line_start = scanned = next - base;
+		}
+		return state == State::Done ? Complete : Error;
+	}
+
+	void RequestParser::reset() {
+		*this = RequestParser(max_size);
+	}
+
+	RequestParser::Result RequestParser::incomplete(const IOBuffer &input) {
+		// Everything in input so far is part of this head.
+		if(input.size() > max_size)
+			return fail(too_large);
+		return Incomplete;
+	}
+
+	RequestParser::Result RequestParser::fail(std::string_view status) {
+		error_status = status;
+		state = State::Failed;
+		return Error;
+	}
+
+	bool RequestParser::parse_request_line(const char *base, const char *line, const char *end) {
+		error_status = bad_request;
+		const char *p = line;
+		while(p != end && is_token_char(*p))
+			++p;
+		if(p == line || p == end || *p != ' ')
+			return false;
+		method_span = Span{ size_t(line - base), size_t(p - line) };
+
+		const char *path = ++p;
+		p = static_cast<const char*>(std::memchr(path, ' ', end - path));
+		if(!p || p == path)
+			return false;
+		path_span = Span{ size_t(path - base), size_t(p - path) };
+
+		// HTTP/x.y and nothing after it.
+		const char *proto = ++p;
+		constexpr auto prefix = "HTTP/"sv;
+		if(
+			end - proto != 8 ||
+			std::memcmp(proto, prefix.data(), prefix.size()) != 0 ||
+			!is_digit(proto[5]) || proto[6] != '.' || !is_digit(proto[7])
+		)
+			return false;
+		proto_span = Span{ size_t(proto - base), 8 };
+		if(proto[5] != '1') {
+			error_status = bad_version;
+			return false;
+		}
+		return true;
+	}
+
+	bool RequestParser::parse_header_line(
+		const IOBuffer &input, const char *line, const char *end,
+		HeaderTable &headers
+	) {
+		error_status = bad_request;
+		// A name runs up to the colon with no space before it. This also
+		// rejects obsolete line folding.
+		const char *p = line;
+		while(p != end && is_token_char(*p))
+			++p;
+		if(p == line || p == end || *p != ':')
+			return false;
+		std::string_view name(line, p - line);
+
+		const char *value = p + 1;
+		while(value != end && is_space(*value))
+			++value;
+		while(end != value && is_space(end[-1]))
+			--end;
+		if(!headers.add(input, name, std::string_view(value, end - value))) {
+			error_status = too_large;
+			return false;
+		}
+		return true;
+	}
+
+	ChunkedDecoder::Result ChunkedDecoder::decode(IOBuffer &input, size_t start) {
+		char *base = input.data() + start;
+		const char *end = input.data() + input.size();
+		// Data is copied from p down to out. Lines are only taken whole,
+		// so p never stops part way through one.
+		char *out = base + pending();
+		char *p = out;
+		while(state != State::Done && state != State::Failed) {
+			if(state == State::Data) {
+				size_t n = std::min<uint64_t>(chunk, end - p);
+				if(!n)
+					break;
+				if(out != p)
+					std::memmove(out, p, n);
+				out += n;
+				p += n;
+				chunk -= n;
+				decoded += n;
+				if(!chunk)
+					state = State::DataEnd;
+				continue;
+			}
+			auto eol = static_cast<char*>(std::memchr(p, '\n', end - p));
+			if(!eol) {
+				if(size_t(end - p) > max_line_size)
+					fail(bad_request);
+				break;
+			}
+			std::string_view line(p, eol - p);
+			if(!line.empty() && line.back() == '\r')
+				line.remove_suffix(1);
+			p = eol + 1;
+			if(state == State::Size) {
+				parse_size(line);
+			} else if(state == State::DataEnd) {
+				if(line.empty())
+					state = State::Size;
+				else
+					fail(bad_request);
+			} else if(line.empty()) {
+				state = State::Done;
+			} else if((trailer_size += p - line.data()) > max_trailer_size) {
+				fail(too_large);
+			}
+		}
+		// Close the gap left by the framing. Only input not decoded yet
+		// follows it, so this moves at most what arrived since the last
+		// call.
+		if(p != out)
+			input.erase(start + pending(), p - out);
+		switch(state) {
+			case State::Done:
+				return RequestParser::Complete;
+			case State::Failed:
+				return RequestParser::Error;
+			default:
+				return RequestParser::Incomplete;
+		}
+	}
+
+	void ChunkedDecoder::reset() {
+		*this = ChunkedDecoder(max_size);
+	}
+
+	bool ChunkedDecoder::fail(std::string_view status) {
+		error_status = status;
+		state = State::Failed;
+		return false;
+	}
+
+	bool ChunkedDecoder::parse_size(std::string_view line) {
+		if(line.size() > max_line_size)
+			return fail(bad_request);
+		uint64_t size = 0;
+		size_t i = 0;
+		for(int v; i < line.size() && (v = hex_value(line[i])) >= 0; ++i) {
+			if(size >> 60)
+				return fail(body_too_large);
+			size = size << 4 | v;
+		}
+		if(i == 0)
+			return fail(bad_request);
+		// Anything after the size must be a chunk extension.
+		while(i < line.size() && is_space(line[i]))
+			++i;
+		if(i < line.size() && line[i] != ';')
+			return fail(bad_request);
+		if(size > max_size - decoded)
+			return fail(body_too_large);
+		chunk = size;
+		state = size ? State::Data : State::Trailer;
+		return true;
+	}
+};
@@ -0,0 +1,149 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "headers.h"
+#include "iobuffer.h"
+
+namespace zlynx {
+	// Returns the first byte in [p, end) that is a control character
+	// other than horizontal tab, or end. Uses AVX2 or SSE2 when the
+	// compiler targets them.
+	const char* find_control_char(const char *p, const char *end);
+
+	// Incremental parser for the head of an HTTP/1.x request.
+	// Call parse() whenever more input arrives. It carries on from where
+	// the last call stopped, so every byte goes through the line scan
+	// once. Lines end at the first control character. That character must
+	// be CR LF or LF, anything else is a malformed request, so the same
+	// scan also does the validation.
+	class RequestParser {
+		public:
+		enum Result {
+			Incomplete,
+			Complete,
+			Error
+		};
+
+		static constexpr size_t default_max_size = 16 * 1024;
+
+		// A head longer than max_size bytes is an Error with a 431,
+		// found as soon as that much has arrived.
+		explicit RequestParser(size_t max_size = default_max_size):
+			max_size(max_size)
+		{
+		}
+
+		// Parse the head at the front of input, adding each header line
+		// to headers as it is found.
+		Result parse(const IOBuffer &input, HeaderTable &headers);
+		// Get ready for the next request. The input must have had size()
+		// bytes consumed, or nothing parsed yet.
+		void reset();
+
+		bool done() const { return state == State::Done; }
+
+		// These are valid after Complete, as views into input.
+		std::string_view method(const IOBuffer &input) const { return view(input, method_span); }
+		std::string_view path(const IOBuffer &input) const { return view(input, path_span); }
+		std::string_view proto(const IOBuffer &input) const { return view(input, proto_span); }
+		// Bytes in the head including the blank line that ends it.
+		size_t size() const { return head_size; }
+
+		// The response status for an Error result.
+		std::string_view error() const { return error_status; }
+
+		private:
+		enum class State {
+			RequestLine,
+			Headers,
+			Done,
+			Failed
+		};
+
+		// Position relative to input.data().
+		struct Span {
+			size_t offset = 0;
+			size_t size = 0;
+		};
+
+		size_t max_size;
+		State state = State::RequestLine;
+		// Start of the line being parsed.
+		size_t line_start = 0;
+		// How far the line scan got.
+		size_t scanned = 0;
+		size_t head_size = 0;
+		Span method_span;
+		Span path_span;
+		Span proto_span;
+		std::string_view error_status;
+
+		static std::string_view view(const IOBuffer &input, Span s) {
+			return std::string_view(input.data() + s.offset, s.size);
+		}
+
+		Result fail(std::string_view status);
+		Result incomplete(const IOBuffer &input);
+		bool parse_request_line(const char *base, const char *line, const char *end);
+		bool parse_header_line(const IOBuffer &input, const char *line, const char *end, HeaderTable &headers);
+	};
+
+	// Incremental decoder for a request body sent with
+	// Transfer-Encoding: chunked. Call decode() whenever more input
+	// arrives. The chunk data is moved down over the framing in place,
+	// so the body so far is always contiguous in input right after the
+	// head, followed by the input not decoded yet. Chunk extensions and
+	// trailer fields are read and ignored.
+	class ChunkedDecoder {
+		public:
+		typedef RequestParser::Result Result;
+
+		// The most bytes in a chunk size line, and in all the trailers.
+		static constexpr size_t max_line_size = 4 * 1024;
+		static constexpr size_t max_trailer_size = RequestParser::default_max_size;
+
+		// A body longer than max_size bytes is an Error with a 413.
+		explicit ChunkedDecoder(size_t max_size = SIZE_MAX):
+			max_size(max_size)
+		{
+		}
+
+		// Decode the body starting at offset start in input.
+		Result decode(IOBuffer &input, size_t start);
+		void reset();
+
+		// Bytes of body decoded so far.
+		size_t size() const { return decoded; }
+		// Of those, the ones still in input at start. A caller passing
+		// the body on as it arrives erases them from input and calls
+		// consumed with how many.
+		size_t pending() const { return decoded - taken; }
+		void consumed(size_t n) { taken += n; }
+
+		// The response status for an Error result.
+		std::string_view error() const { return error_status; }
+
+		private:
+		enum class State {
+			Size,
+			Data,
+			DataEnd,
+			Trailer,
+			Done,
+			Failed
+		};
+
+		size_t max_size;
+		State state = State::Size;
+		size_t decoded = 0;
+		size_t taken = 0;
+		// What is left of the current chunk.
+		uint64_t chunk = 0;
+		size_t trailer_size = 0;
+		std::string_view error_status;
+
+		bool fail(std::string_view status);
+		bool parse_size(std::string_view line);
+	};
+};
@@ -0,0 +1,36 @@
+#include <algorithm>
+#include "pool.h"
+
+namespace zlynx {
+	BlockPool::BlockPool(size_t block_size, size_t max_free):
+		size(std::max(block_size, sizeof(Free))),
+		max_free(max_free)
+	{
+	}
+
+	BlockPool::~BlockPool() {
+		while(free_list) {
+			Free *f = free_list;
+			free_list = f->next;
+			::operator delete(f);
+		}
+	}
+
+	void* BlockPool::allocate() {
+		if(!free_list)
+			return ::operator new(size);
+		Free *f = free_list;
+		free_list = f->next;
+		--free_count;
+		return f;
+	}
+
+	void BlockPool::deallocate(void *p) {
+		if(free_count >= max_free) {
+			::operator delete(p);
+			return;
+		}
+		free_list = new(p) Free{free_list};
+		++free_count;
+	}
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace zlynx {
+	// Free list of fixed size blocks for one thread.
+	// Freed blocks are kept for the next allocate instead of going back
+	// to malloc, so connection churn reuses memory that is already
+	// faulted in. Each block is its own allocation, so a block freed on
+	// another thread, as happens at shutdown, just joins that thread's
+	// list.
+	class BlockPool {
+		public:
+		BlockPool(size_t block_size, size_t max_free);
+		~BlockPool();
+		BlockPool(const BlockPool&) = delete;
+		void operator=(const BlockPool&) = delete;
+
+		size_t block_size() const { return size; }
+
+		void* allocate();
+		void deallocate(void *p);
+
+		private:
+		struct Free {
+			Free *next;
+		};
+
+		size_t size;
+		size_t max_free;
+		size_t free_count = 0;
+		Free *free_list = nullptr;
+	};
+
+	// Allocator for std::allocate_shared that takes single objects from
+	// a BlockPool for each type on each thread. allocate_shared rebinds
+	// it to its control block type, so the object and its count share
+	// one pooled block.
+	template<class T>
+	class PoolAllocator {
+		public:
+		typedef T value_type;
+
+		PoolAllocator() {}
+		template<class U>
+		PoolAllocator(const PoolAllocator<U>&) {}
+
+		T* allocate(size_t n) {
+			if(n != 1)
+				return std::allocator<T>().allocate(n);
+			return static_cast<T*>(pool().allocate());
+		}
+
+		void deallocate(T *p, size_t n) {
+			if(n != 1)
+				std::allocator<T>().deallocate(p, n);
+			else
+				pool().deallocate(p);
+		}
+
+		template<class U>
+		bool operator==(const PoolAllocator<U>&) const { return true; }
+		template<class U>
+		bool operator!=(const PoolAllocator<U>&) const { return false; }
+
+		private:
+		static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+		static constexpr size_t max_free = 256;
+
+		static BlockPool& pool() {
+			static thread_local BlockPool p(sizeof(T), max_free);
+			return p;
+		}
+	};
+};
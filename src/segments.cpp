@@ -0,0 +1,538 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "errors.h"
+#include "log.h"
+#include "segments.h"
+
+namespace zlynx {
+	using namespace std::literals;
+
+	namespace {
+		constexpr uint64_t pad(uint64_t n) {
+			return (n + 7) & ~uint64_t(7);
+		}
+
+		// Bytes in a segment of the record with header h.
+		uint64_t record_size(const RecordHeader &h) {
+			return pad(sizeof h + uint64_t(h.key_size) + h.type_size + h.head_size + h.body_size);
+		}
+
+		// The header bytes covered by the checksum.
+		std::string_view checked_header(const RecordHeader &h) {
+			return std::string_view(
+				reinterpret_cast<const char*>(&h) + sizeof h.checksum,
+				sizeof h - sizeof h.checksum
+			);
+		}
+
+		// Each part is summed on its own, the same when writing as when
+		// reading back.
+		uint64_t record_checksum(const RecordHeader &h, const Record &r) {
+			uint64_t sum = checksum(checked_header(h));
+			for(auto part: {r.key, r.content_type, r.response_head, r.body}) {
+				sum = checksum(part, sum);
+			}
+			return sum;
+		}
+
+		// pwritev the whole of iov, however many calls it takes.
+		void write_all_at(int handle, iovec *iov, int count, off_t offset) {
+			while(count) {
+				ssize_t n = ::pwritev(handle, iov, count, offset);
+				if(n < 0 && errno == EINTR)
+					continue;
+				throw_posix_errno_if(n < 0);
+				offset += n;
+				while(count && size_t(n) >= iov->iov_len) {
+					n -= iov->iov_len;
+					++iov;
+					--count;
+				}
+				if(count) {
+					iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+					iov->iov_len -= n;
+				}
+			}
+		}
+
+		// Copy size bytes from the start of one file to offset in
+		// another.
+		void copy_all(int from, int to, uint64_t size, off_t offset) {
+			off_t in = 0;
+			while(size) {
+				ssize_t n = ::copy_file_range(from, &in, to, &offset, size, 0);
+				if(n < 0 && errno == EINTR)
+					continue;
+				if(n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+					break;
+				throw_posix_errno_if(n < 0);
+				if(n == 0)
+					throw std::runtime_error("upload file ended early");
+				size -= n;
+			}
+			// Where the kernel cannot copy between these files.
+			std::array<char, 64 * 1024> buffer;
+			while(size) {
+				ssize_t n = ::pread(from, buffer.data(), std::min<uint64_t>(size, buffer.size()), in);
+				if(n < 0 && errno == EINTR)
+					continue;
+				throw_posix_errno_if(n < 0);
+				if(n == 0)
+					throw std::runtime_error("upload file ended early");
+				iovec iov{ buffer.data(), size_t(n) };
+				write_all_at(to, &iov, 1, offset);
+				in += n;
+				offset += n;
+				size -= n;
+			}
+		}
+	}
+
+	uint64_t checksum(std::string_view data, uint64_t h) {
+		const char *p = data.data();
+		size_t n = data.size();
+		for(; n >= 8; p += 8, n -= 8) {
+			uint64_t w;
+			std::memcpy(&w, p, sizeof w);
+			h = (h ^ w) * 0x9e3779b97f4a7c15;
+			h ^= h >> 32;
+		}
+		for(; n; ++p, --n) {
+			h = (h ^ uint8_t(*p)) * 0x100000001b3;
+		}
+		return h;
+	}
+
+	Segment::Segment(const std::string &path, uint32_t id, uint64_t capacity, bool create):
+		id(id),
+		path(path),
+		capacity(capacity)
+	{
+		handle = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+		if(handle < 0)
+			throw posix_error("open " + path, errno);
+		try {
+			if(create) {
+				throw_posix_errno_if( ::ftruncate(handle, capacity) );
+			} else {
+				struct stat st;
+				throw_posix_errno_if( ::fstat(handle, &st) );
+				this->capacity = st.st_size;
+			}
+			if(this->capacity) {
+				void *p = ::mmap(nullptr, this->capacity, PROT_READ, MAP_SHARED, handle, 0);
+				throw_posix_errno_if(p == MAP_FAILED);
+				map = static_cast<const char*>(p);
+			}
+		} catch(...) {
+			::close(handle);
+			throw;
+		}
+	}
+
+	Segment::~Segment() {
+		if(map)
+			::munmap(const_cast<char*>(map), capacity);
+		::close(handle);
+	}
+
+	bool Segment::read(uint64_t offset, Record &r, bool verify) const {
+		RecordHeader h;
+		if(offset + sizeof h > capacity)
+			return false;
+		std::memcpy(&h, map + offset, sizeof h);
+		if(!h.key_size || h.flags > (RecordHeader::tombstone | RecordHeader::unfinished))
+			return false;
+		uint64_t payload = uint64_t(h.key_size) + h.type_size + h.head_size + h.body_size;
+		if(h.body_size > capacity || payload > capacity - offset - sizeof h)
+			return false;
+		const char *p = map + offset + sizeof h;
+		r.key = std::string_view(p, h.key_size);
+		p += h.key_size;
+		r.content_type = std::string_view(p, h.type_size);
+		p += h.type_size;
+		r.response_head = std::string_view(p, h.head_size);
+		p += h.head_size;
+		r.body = std::string_view(p, h.body_size);
+		r.unfinished = h.flags & RecordHeader::unfinished;
+		if(verify && !r.unfinished && record_checksum(h, r) != h.checksum)
+			return false;
+		r.tombstone = h.flags & RecordHeader::tombstone;
+		r.size = std::min(pad(sizeof h + payload), capacity - offset);
+		return true;
+	}
+
+	SegmentLog::SegmentLog(const std::string &directory, uint64_t segment_size):
+		directory(directory),
+		segment_size(segment_size)
+	{
+		if(::mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+			throw posix_error("mkdir " + directory, errno);
+		DIR *dir = ::opendir(directory.c_str());
+		if(!dir)
+			throw posix_error("opendir " + directory, errno);
+		std::vector<uint32_t> ids;
+		while(dirent *e = ::readdir(dir)) {
+			unsigned id;
+			char end;
+			if(std::sscanf(e->d_name, "%8u.seg%c", &id, &end) == 1 && segment_path(id) == directory + '/' + e->d_name)
+				ids.push_back(id);
+		}
+		::closedir(dir);
+		std::sort(ids.begin(), ids.end());
+		for(auto id: ids) {
+			auto s = std::make_shared<Segment>(segment_path(id), id, 0, false);
+			s->sealed = true;
+			s->synced = true;
+			segments.push_back(std::move(s));
+			next_id = id + 1;
+		}
+	}
+
+	SegmentLog::~SegmentLog() {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		if(thread.joinable())
+			thread.join();
+		// Leave the active segment the length of its records, the same
+		// as a sealed one.
+		if(!segments.empty() && !segments.back()->sealed) {
+			auto &s = *segments.back();
+			if(::fdatasync(s.handle) < 0 || ::ftruncate(s.handle, s.size) < 0) {
+				LOG(Error) << "closing segment " << s.path << ": " << std::strerror(errno);
+			}
+		}
+	}
+
+	std::string SegmentLog::segment_path(uint32_t id) const {
+		std::array<char, 16> name;
+		std::snprintf(name.data(), name.size(), "%08u.seg", unsigned(id));
+		return directory + '/' + name.data();
+	}
+
+	void SegmentLog::recover(const std::function<void(const std::shared_ptr<Segment>&, uint64_t, const Record&)> &f) {
+		for(auto &s: segments) {
+			// Every record has its sizes written before any space after
+			// it is reserved, so the records can be walked even past one
+			// that was never finished.
+			// A cleanly sealed segment was synced and then cut to end at
+			// its last record. Anything else may have torn records, so
+			// every checksum is checked.
+			uint64_t end = 0;
+			Record r;
+			while(s->read(end, r, false))
+				end += r.size;
+			bool verify = end != s->capacity;
+			for(uint64_t offset = 0; offset < end; offset += r.size) {
+				s->read(offset, r, false);
+				if(r.unfinished || (verify && !s->read(offset, r, true))) {
+					LOG(Warning) << "segment " << s->path << " has an incomplete record at offset " << offset;
+					s->dead += r.size;
+					continue;
+				}
+				f(s, offset, r);
+				if(r.tombstone)
+					s->tombstones += r.size;
+			}
+			s->size = end;
+			if(end != s->capacity) {
+				LOG(Warning)
+					<< "segment " << s->path << " was not closed cleanly, keeping its first "
+					<< end << " bytes";
+				throw_posix_errno_if( ::fdatasync(s->handle) );
+				throw_posix_errno_if( ::ftruncate(s->handle, end) );
+			}
+		}
+		// Drop the empty ones.
+		segments.erase(std::remove_if(segments.begin(), segments.end(), [](auto &s) {
+			if(s->size)
+				return false;
+			::unlink(s->path.c_str());
+			return true;
+		}), segments.end());
+		LOG(Info) << "recovered " << segments.size() << " segments from " << directory;
+	}
+
+	void SegmentLog::start(Relocate relocate) {
+		this->relocate = std::move(relocate);
+		{
+			std::lock_guard lock(mutex);
+			start_segment(0);
+		}
+		thread = std::thread([this] { run(); });
+	}
+
+	void SegmentLog::start_segment(uint64_t min_capacity) {
+		if(!segments.empty() && !segments.back()->sealed) {
+			segments.back()->sealed = true;
+			wake.notify_all();
+		}
+		// One spare byte past the largest record, so a segment can only
+		// end exactly at a record once it has been sealed and cut.
+		uint64_t capacity = std::max(segment_size, min_capacity) + 1;
+		uint32_t id = next_id++;
+		segments.push_back(std::make_shared<Segment>(segment_path(id), id, capacity, true));
+	}
+
+	SegmentLog::Location SegmentLog::append(
+		std::string_view key,
+		std::string_view content_type,
+		std::string_view response_head,
+		std::string_view body,
+		bool tombstone
+	) {
+		RecordHeader h{};
+		h.body_size = body.size();
+		h.key_size = key.size();
+		h.type_size = content_type.size();
+		h.head_size = response_head.size();
+		h.flags = tombstone ? RecordHeader::tombstone : 0;
+		uint64_t payload = key.size() + content_type.size() + response_head.size() + body.size();
+		uint64_t size = record_size(h);
+
+		Record r;
+		r.key = key;
+		r.content_type = content_type;
+		r.response_head = response_head;
+		r.body = body;
+		h.checksum = record_checksum(h, r);
+
+		auto [s, offset] = reserve(h);
+		static const std::array<char, 8> zeros{};
+		std::array<iovec, 6> iov = {{
+			{ &h, sizeof h },
+			{ const_cast<char*>(key.data()), key.size() },
+			{ const_cast<char*>(content_type.data()), content_type.size() },
+			{ const_cast<char*>(response_head.data()), response_head.size() },
+			{ const_cast<char*>(body.data()), body.size() },
+			{ const_cast<char*>(zeros.data()), size - sizeof h - payload }
+		}};
+		try {
+			write_all_at(s->handle, iov.data(), iov.size(), offset);
+		} catch(...) {
+			s->dead += size;
+			--s->writers;
+			throw;
+		}
+		--s->writers;
+		return written(s, offset, tombstone);
+	}
+
+	SegmentLog::Location SegmentLog::append(
+		std::string_view key,
+		std::string_view content_type,
+		std::string_view response_head,
+		int body_file,
+		uint64_t body_size
+	) {
+		RecordHeader h{};
+		h.body_size = body_size;
+		h.key_size = key.size();
+		h.type_size = content_type.size();
+		h.head_size = response_head.size();
+		uint64_t payload = key.size() + content_type.size() + response_head.size() + body_size;
+		uint64_t size = record_size(h);
+
+		auto [s, offset] = reserve(h);
+		try {
+			// The complete header goes last, once the body is in the
+			// segment for its checksum. Until then the record reads as
+			// unfinished.
+			static const std::array<char, 8> zeros{};
+			std::array<iovec, 3> iov = {{
+				{ const_cast<char*>(key.data()), key.size() },
+				{ const_cast<char*>(content_type.data()), content_type.size() },
+				{ const_cast<char*>(response_head.data()), response_head.size() },
+			}};
+			uint64_t body_offset = offset + sizeof h + payload - body_size;
+			write_all_at(s->handle, iov.data(), iov.size(), offset + sizeof h);
+			copy_all(body_file, s->handle, body_size, body_offset);
+			iovec padding{ const_cast<char*>(zeros.data()), size - sizeof h - payload };
+			write_all_at(s->handle, &padding, 1, body_offset + body_size);
+
+			Record r;
+			r.key = key;
+			r.content_type = content_type;
+			r.response_head = response_head;
+			r.body = std::string_view(s->map + body_offset, body_size);
+			h.checksum = record_checksum(h, r);
+			iovec header{ &h, sizeof h };
+			write_all_at(s->handle, &header, 1, offset);
+		} catch(...) {
+			s->dead += size;
+			--s->writers;
+			throw;
+		}
+		--s->writers;
+		return written(s, offset, false);
+	}
+
+	std::pair<std::shared_ptr<Segment>, uint64_t> SegmentLog::reserve(RecordHeader h) {
+		uint64_t size = record_size(h);
+		std::lock_guard lock(mutex);
+		auto s = segments.empty() ? nullptr : segments.back();
+		if(!s || s->sealed || s->size + size >= s->capacity) {
+			start_segment(size);
+			s = segments.back();
+		}
+		uint64_t offset = s->size;
+		// Written before the space after it is handed out, so if the
+		// process dies first, recovery can still step over the record
+		// to those other threads finished.
+		h.checksum = 0;
+		h.flags |= RecordHeader::unfinished;
+		iovec header{ &h, sizeof h };
+		write_all_at(s->handle, &header, 1, offset);
+		s->size += size;
+		++s->writers;
+		return {s, offset};
+	}
+
+	SegmentLog::Location SegmentLog::written(const std::shared_ptr<Segment> &s, uint64_t offset, bool tombstone) {
+		Location l{s, offset, Record()};
+		if(!s->read(offset, l.record, false))
+			throw std::logic_error("segment record did not read back");
+		if(tombstone)
+			s->tombstones += l.record.size;
+		return l;
+	}
+
+	int SegmentLog::temp_file() const {
+		int handle = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		// A file system without O_TMPFILE.
+		if(handle < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+			std::string path = directory + "/upload.XXXXXX";
+			handle = ::mkostemp(path.data(), O_CLOEXEC);
+			if(handle >= 0)
+				::unlink(path.c_str());
+		}
+		if(handle < 0)
+			throw posix_error("create a file in " + directory, errno);
+		return handle;
+	}
+
+	bool SegmentLog::empty() const {
+		std::lock_guard lock(mutex);
+		return std::all_of(segments.begin(), segments.end(), [](auto &s) { return !s->size; });
+	}
+
+	bool SegmentLog::has_older(const Segment &s) const {
+		std::lock_guard lock(mutex);
+		return !segments.empty() && segments.front().get() != &s;
+	}
+
+	void SegmentLog::run() {
+		for(;;) {
+			{
+				std::unique_lock lock(mutex);
+				wake.wait_for(lock, 1s);
+				if(stopping)
+					return;
+			}
+			try {
+				sync_sealed();
+				while(compact_one()) {
+					std::lock_guard lock(mutex);
+					if(stopping)
+						return;
+				}
+			} catch(const std::exception &e) {
+				LOG(Error) << "compacting " << directory << ": " << e.what();
+			}
+		}
+	}
+
+	void SegmentLog::sync_sealed() {
+		std::vector<std::shared_ptr<Segment>> pending;
+		{
+			std::lock_guard lock(mutex);
+			for(auto &s: segments) {
+				if(s->sealed && !s->synced)
+					pending.push_back(s);
+			}
+		}
+		for(auto &s: pending) {
+			while(s->writers.load())
+				std::this_thread::sleep_for(1ms);
+			// Synced before it is cut, so a segment that ends at its last
+			// record never needs checking on recovery.
+			if(::fdatasync(s->handle) < 0 || ::ftruncate(s->handle, s->size) < 0) {
+				LOG(Error) << "sealing segment " << s->path << ": " << std::strerror(errno);
+				continue;
+			}
+			std::lock_guard lock(mutex);
+			s->synced = true;
+		}
+	}
+
+	bool SegmentLog::compact_one() {
+		std::shared_ptr<Segment> victim;
+		{
+			std::lock_guard lock(mutex);
+			uint64_t most = 0;
+			for(auto &s: segments) {
+				if(!s->synced || s->damaged)
+					continue;
+				// Tombstones are waste only in the oldest segment.
+				uint64_t waste = s->dead + (s == segments.front() ? s->tombstones.load() : 0);
+				if(waste * 2 > s->size && waste > most) {
+					most = waste;
+					victim = s;
+				}
+			}
+		}
+		if(!victim)
+			return false;
+
+		uint64_t before = victim->size - victim->dead;
+		Record r;
+		uint64_t offset = 0;
+		for(; offset < victim->size && victim->read(offset, r, false); offset += r.size) {
+			// As in recovery. A tombstone is checked as well, since no
+			// entry in the index vouches for it.
+			if(!r.unfinished && (!r.tombstone || victim->read(offset, r, true)))
+				relocate(victim, offset, r);
+		}
+		// The records after a bad one cannot be found, and some may be
+		// live. The ones moved so far are only duplicates.
+		if(offset < victim->size) {
+			LOG(Error) << "not compacting segment " << victim->path << ", no record at offset " << offset;
+			std::lock_guard lock(mutex);
+			victim->damaged = true;
+			return true;
+		}
+
+		// The moved records must be on disk before the originals go.
+		std::vector<std::shared_ptr<Segment>> unsynced;
+		{
+			std::lock_guard lock(mutex);
+			for(auto &s: segments) {
+				if(!s->synced)
+					unsynced.push_back(s);
+			}
+		}
+		for(auto &s: unsynced) {
+			throw_posix_errno_if( ::fdatasync(s->handle) );
+		}
+		{
+			std::lock_guard lock(mutex);
+			segments.erase(std::find(segments.begin(), segments.end(), victim));
+		}
+		// Readers still holding values keep the mapping, not the file.
+		::unlink(victim->path.c_str());
+		LOG(Info) << "compacted segment " << victim->path << ", moved up to " << before << " bytes";
+		return true;
+	}
+};
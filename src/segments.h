@@ -0,0 +1,181 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace zlynx {
+	// Append-only storage for a persistent Datastore.
+	// Every set and delete is appended as a record to the active segment
+	// file. Segments are mapped into memory, so a stored body is a view
+	// of the page cache and is sent from there without a copy. A full
+	// segment is sealed and synced, and a new one started. A background
+	// thread compacts sealed segments that are mostly dead by asking the
+	// Datastore to move their live records to the active segment, then
+	// deletes the files.
+
+	// Each record starts with this, followed by the key, content type,
+	// response head and body, padded to a multiple of 8 bytes.
+	struct RecordHeader {
+		// Of everything after this field, including the rest of the
+		// header.
+		uint64_t checksum;
+		uint64_t body_size;
+		uint32_t key_size;
+		uint32_t type_size;
+		uint32_t head_size;
+		uint32_t flags;
+
+		static constexpr uint32_t tombstone = 1;
+		// Set in the header written when the space is reserved and
+		// cleared when the record is complete. Such a record is skipped.
+		static constexpr uint32_t unfinished = 2;
+	};
+	static_assert(sizeof(RecordHeader) == 32);
+
+	// A record as views of a mapped segment.
+	struct Record {
+		std::string_view key;
+		std::string_view content_type;
+		std::string_view response_head;
+		std::string_view body;
+		bool tombstone = false;
+		bool unfinished = false;
+		// Bytes in the segment including the header and padding.
+		uint64_t size = 0;
+	};
+
+	// One segment file, mapped read only. Writes go through the file.
+	class Segment {
+		public:
+		Segment(const std::string &path, uint32_t id, uint64_t capacity, bool create);
+		~Segment();
+		Segment(const Segment&) = delete;
+		void operator=(const Segment&) = delete;
+
+		// Fill in the record at offset. Returns false if there is no
+		// valid record there. verify checks the checksum as well.
+		bool read(uint64_t offset, Record &r, bool verify) const;
+
+		const uint32_t id;
+		const std::string path;
+		// Bytes handed out for records.
+		uint64_t size = 0;
+		// Bytes of records that were replaced or deleted.
+		std::atomic<uint64_t> dead{0};
+		// Bytes of tombstones, which can only go once no older segment
+		// is left.
+		std::atomic<uint64_t> tombstones{0};
+
+		private:
+		friend class SegmentLog;
+
+		int handle = -1;
+		const char *map = nullptr;
+		uint64_t capacity;
+		// Appends still writing into the segment.
+		std::atomic<unsigned> writers{0};
+		bool sealed = false;
+		bool synced = false;
+		// A record could not be read back while compacting, so the
+		// segment is kept as it is.
+		bool damaged = false;
+	};
+
+	class SegmentLog {
+		public:
+		// Moves a live record of a segment being compacted. Called with
+		// the segment, the offset of the record and the record.
+		typedef std::function<void(const std::shared_ptr<Segment>&, uint64_t, const Record&)> Relocate;
+
+		// Opens the segments in directory, creating it if needed.
+		explicit SegmentLog(const std::string &directory, uint64_t segment_size = 64 << 20);
+		~SegmentLog();
+		SegmentLog(const SegmentLog&) = delete;
+		void operator=(const SegmentLog&) = delete;
+
+		// Call f for every valid record already on disk, oldest first.
+		// An unfinished or torn record is skipped and counted as dead.
+		// The segment is cut short after the last record begun.
+		void recover(const std::function<void(const std::shared_ptr<Segment>&, uint64_t, const Record&)> &f);
+		// Start compacting in the background.
+		void start(Relocate relocate);
+
+		struct Location {
+			std::shared_ptr<Segment> segment;
+			uint64_t offset;
+			Record record;
+		};
+		// Write a record and return where it went. The caller must
+		// serialize appends for the same key.
+		Location append(
+			std::string_view key,
+			std::string_view content_type,
+			std::string_view response_head,
+			std::string_view body,
+			bool tombstone = false
+		);
+		// The same with a body of body_size bytes copied from the start
+		// of body_file.
+		Location append(
+			std::string_view key,
+			std::string_view content_type,
+			std::string_view response_head,
+			int body_file,
+			uint64_t body_size
+		);
+		// An unlinked file in the directory, to be read from by append.
+		int temp_file() const;
+		// Count size bytes of s as dead once their record is replaced or
+		// deleted.
+		void discard(Segment &s, uint64_t size) { s.dead += size; }
+
+		// True if no record has been written or recovered.
+		bool empty() const;
+
+		// Whether a segment older than s still exists, which a tombstone
+		// in s may be hiding a record in.
+		bool has_older(const Segment &s) const;
+
+		private:
+		std::string directory;
+		uint64_t segment_size;
+		Relocate relocate;
+
+		// Held while picking a place to append and changing segments.
+		mutable std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+		// Oldest first. The last one is active.
+		std::vector<std::shared_ptr<Segment>> segments;
+		uint32_t next_id = 1;
+
+		std::thread thread;
+
+		std::string segment_path(uint32_t id) const;
+		// Call with mutex held.
+		void start_segment(uint64_t min_capacity);
+		// Take the space for a record with the sizes in h at the end of
+		// the active segment, write h there marked unfinished and count
+		// a writer on it.
+		std::pair<std::shared_ptr<Segment>, uint64_t> reserve(RecordHeader h);
+		// Read back the record just written at offset.
+		Location written(const std::shared_ptr<Segment> &s, uint64_t offset, bool tombstone);
+		void run();
+		// Sync sealed segments once their writers finish.
+		void sync_sealed();
+		// Compact the most wasteful sealed segment. Returns false if
+		// none is worth it.
+		bool compact_one();
+	};
+
+	// A fast checksum of data, continuing from h.
+	uint64_t checksum(std::string_view data, uint64_t h = 0);
+};
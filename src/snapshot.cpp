@@ -0,0 +1,236 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "errors.h"
+#include "segments.h"
+#include "snapshot.h"
+
+namespace zlynx {
+	namespace {
+		constexpr size_t buffer_size = 1 << 20;
+
+		constexpr uint64_t pad(uint64_t n) {
+			return (n + 7) & ~uint64_t(7);
+		}
+
+		template<class T>
+		std::string_view bytes(const T &t) {
+			return std::string_view(reinterpret_cast<const char*>(&t), sizeof t);
+		}
+
+		const std::string_view zeros("\0\0\0\0\0\0\0", 8);
+	}
+
+	SnapshotWriter::SnapshotWriter(const std::string &path):
+		path(path),
+		temp_path(path + ".tmp")
+	{
+		handle = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(handle < 0)
+			throw posix_error("open " + temp_path, errno);
+		buffer.reserve(buffer_size);
+		// The header is written again once the counts are known.
+		write(bytes(SnapshotHeader{}));
+	}
+
+	SnapshotWriter::~SnapshotWriter() {
+		if(handle >= 0) {
+			// Not finished.
+			::close(handle);
+			::unlink(temp_path.c_str());
+		}
+	}
+
+	void SnapshotWriter::add(
+		std::string_view key,
+		std::string_view content_type,
+		std::string_view response_head,
+		std::string_view body
+	) {
+		auto type = type_ids.find(std::string(content_type));
+		if(type == type_ids.end()) {
+			type = type_ids.emplace(std::string(content_type), types.size()).first;
+			types.push_back(type->first);
+		}
+
+		SnapshotEntry e{};
+		e.data_offset = offset;
+		e.body_size = body.size();
+		e.head_size = response_head.size();
+		e.key_size = key.size();
+		e.type = type->second;
+		index.append(bytes(e));
+		index.append(key);
+		index.append(zeros.substr(0, pad(key.size()) - key.size()));
+		++entry_count;
+
+		write(response_head);
+		write(body);
+		write(zeros.substr(0, pad(offset) - offset));
+	}
+
+	void SnapshotWriter::finish() {
+		uint64_t types_offset = offset;
+		// Summed from here on, the same as SnapshotFile checks it.
+		std::string tail;
+		for(auto t: types) {
+			uint32_t n = t.size();
+			tail.append(bytes(n));
+			tail.append(t);
+		}
+		tail.append(zeros.substr(0, pad(tail.size()) - tail.size()));
+		tail.append(index);
+		write(tail);
+		write(bytes(SnapshotFooter{ checksum(tail), SnapshotHeader::magic_value }));
+		flush();
+
+		SnapshotHeader h{
+			SnapshotHeader::magic_value,
+			SnapshotHeader::current_version,
+			uint32_t(types.size()),
+			entry_count,
+			types_offset
+		};
+		throw_posix_errno_if( ::pwrite(handle, &h, sizeof h, 0) != sizeof h );
+		throw_posix_errno_if( ::fdatasync(handle) );
+		throw_posix_errno_if( ::close(handle) );
+		handle = -1;
+		if(::rename(temp_path.c_str(), path.c_str()) < 0)
+			throw posix_error("rename " + temp_path, errno);
+	}
+
+	void SnapshotWriter::write(std::string_view data) {
+		offset += data.size();
+		if(buffer.size() + data.size() > buffer_size)
+			flush();
+		// Large bodies skip the buffer.
+		if(data.size() >= buffer_size) {
+			while(!data.empty()) {
+				ssize_t n = ::write(handle, data.data(), data.size());
+				if(n < 0 && errno == EINTR)
+					continue;
+				throw_posix_errno_if(n < 0);
+				data.remove_prefix(n);
+			}
+			return;
+		}
+		buffer.append(data);
+	}
+
+	void SnapshotWriter::flush() {
+		std::string_view data = buffer;
+		while(!data.empty()) {
+			ssize_t n = ::write(handle, data.data(), data.size());
+			if(n < 0 && errno == EINTR)
+				continue;
+			throw_posix_errno_if(n < 0);
+			data.remove_prefix(n);
+		}
+		buffer.clear();
+	}
+
+	SnapshotFile::SnapshotFile(const std::string &path) {
+		int handle = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(handle < 0)
+			throw posix_error("open " + path, errno);
+		struct stat st;
+		if(::fstat(handle, &st) < 0) {
+			int err = errno;
+			::close(handle);
+			throw posix_error("stat " + path, err);
+		}
+		length = st.st_size;
+		if(length < sizeof(SnapshotHeader) + sizeof(SnapshotFooter)) {
+			::close(handle);
+			throw std::runtime_error(path + " is too short for a snapshot");
+		}
+		void *p = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, handle, 0);
+		int err = errno;
+		::close(handle);
+		if(p == MAP_FAILED)
+			throw posix_error("mmap " + path, err);
+		map = static_cast<const char*>(p);
+
+		try {
+			auto bad = [&path](const char *why) {
+				return std::runtime_error(path + " is not a valid snapshot: " + why);
+			};
+			SnapshotHeader h;
+			std::memcpy(&h, map, sizeof h);
+			SnapshotFooter f;
+			std::memcpy(&f, map + length - sizeof f, sizeof f);
+			if(h.magic != SnapshotHeader::magic_value || f.magic != SnapshotHeader::magic_value)
+				throw bad("no magic number");
+			if(h.version != SnapshotHeader::current_version)
+				throw bad("unknown version");
+			if(h.types_offset < sizeof h || h.types_offset > length - sizeof f)
+				throw bad("types out of range");
+			const char *end = map + length - sizeof f;
+			const char *q = map + h.types_offset;
+			if(checksum(std::string_view(q, end - q)) != f.checksum)
+				throw bad("checksum mismatch");
+
+			// The index is checked for size here so for_each cannot run
+			// off the end.
+			for(uint32_t i = 0; i < h.type_count; ++i) {
+				uint32_t n;
+				if(end - q < ptrdiff_t(sizeof n))
+					throw bad("types truncated");
+				std::memcpy(&n, q, sizeof n);
+				q += sizeof n;
+				if(uint64_t(end - q) < n)
+					throw bad("types truncated");
+				types.emplace_back(q, n);
+				q += n;
+			}
+			q = map + pad(q - map);
+			index = q;
+			for(uint64_t i = 0; i < h.entry_count; ++i) {
+				SnapshotEntry e;
+				if(end - q < ptrdiff_t(sizeof e))
+					throw bad("index truncated");
+				std::memcpy(&e, q, sizeof e);
+				q += sizeof e;
+				if(uint64_t(end - q) < e.key_size || e.type >= types.size())
+					throw bad("index entry out of range");
+				if(e.data_offset > h.types_offset || e.body_size > h.types_offset || h.types_offset - e.data_offset < e.head_size + e.body_size)
+					throw bad("data out of range");
+				q += pad(e.key_size);
+			}
+			entry_count = h.entry_count;
+		} catch(...) {
+			::munmap(const_cast<char*>(map), length);
+			throw;
+		}
+	}
+
+	SnapshotFile::~SnapshotFile() {
+		::munmap(const_cast<char*>(map), length);
+	}
+
+	void SnapshotFile::for_each(const std::function<void(
+		std::string_view key,
+		std::string_view content_type,
+		std::string_view response_head,
+		std::string_view body
+	)> &f) const {
+		const char *q = index;
+		for(uint64_t i = 0; i < entry_count; ++i) {
+			SnapshotEntry e;
+			std::memcpy(&e, q, sizeof e);
+			q += sizeof e;
+			const char *data = map + e.data_offset;
+			f(
+				std::string_view(q, e.key_size),
+				types[e.type],
+				std::string_view(data, e.head_size),
+				std::string_view(data + e.head_size, e.body_size)
+			);
+			q += pad(e.key_size);
+		}
+	}
+};
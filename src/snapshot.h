@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace zlynx {
+	// A snapshot file holds every key and value of a Datastore.
+	//
+	//   header
+	//   data:   for each entry its response head and body, 8 byte aligned
+	//   types:  the content types, each a 32 bit length and the bytes
+	//   index:  for each entry a SnapshotEntry and the key
+	//   footer: checksum of the types and index
+	//
+	// The data comes first so a dump can stream bodies out as it goes
+	// and write the small index at the end. Loading checks the index
+	// only, and the bodies are mapped, so they are paged in as they are
+	// first read.
+
+	struct SnapshotHeader {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t type_count;
+		uint64_t entry_count;
+		// Where the types start. The data is before this.
+		uint64_t types_offset;
+
+		static constexpr uint64_t magic_value = 0x31504e5358594c5a; // "ZLYXSNP1"
+		static constexpr uint32_t current_version = 1;
+	};
+	static_assert(sizeof(SnapshotHeader) == 32);
+
+	struct SnapshotEntry {
+		uint64_t data_offset;
+		uint64_t body_size;
+		uint32_t head_size;
+		uint32_t key_size;
+		uint32_t type;
+		uint32_t unused;
+	};
+	static_assert(sizeof(SnapshotEntry) == 32);
+
+	struct SnapshotFooter {
+		uint64_t checksum;
+		uint64_t magic;
+	};
+
+	// Writes a snapshot to path + ".tmp" and renames it over path once it
+	// is complete and synced, so a crash never leaves half a snapshot.
+	class SnapshotWriter {
+		public:
+		explicit SnapshotWriter(const std::string &path);
+		~SnapshotWriter();
+		SnapshotWriter(const SnapshotWriter&) = delete;
+		void operator=(const SnapshotWriter&) = delete;
+
+		void add(
+			std::string_view key,
+			std::string_view content_type,
+			std::string_view response_head,
+			std::string_view body
+		);
+		// Write the index and put the file in place.
+		void finish();
+
+		private:
+		std::string path;
+		std::string temp_path;
+		int handle = -1;
+		uint64_t offset = 0;
+		std::string buffer;
+		// Content types are stored once each.
+		std::unordered_map<std::string, uint32_t> type_ids;
+		std::vector<std::string_view> types;
+		// The index, written at the end.
+		std::string index;
+		uint64_t entry_count = 0;
+
+		void write(std::string_view data);
+		void flush();
+	};
+
+	// A snapshot mapped read only. The views passed to for_each stay
+	// valid while the SnapshotFile does.
+	class SnapshotFile {
+		public:
+		// Throws if the file is not a complete snapshot.
+		explicit SnapshotFile(const std::string &path);
+		~SnapshotFile();
+		SnapshotFile(const SnapshotFile&) = delete;
+		void operator=(const SnapshotFile&) = delete;
+
+		uint64_t size() const { return entry_count; }
+		void for_each(const std::function<void(
+			std::string_view key,
+			std::string_view content_type,
+			std::string_view response_head,
+			std::string_view body
+		)> &f) const;
+
+		private:
+		const char *map = nullptr;
+		uint64_t length = 0;
+		uint64_t entry_count = 0;
+		std::vector<std::string_view> types;
+		const char *index = nullptr;
+	};
+};
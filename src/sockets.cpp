@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iostream>
 #include <iomanip>
@@ -6,8 +7,14 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "sockets.h"
 #include "errors.h"
+#include "log.h"
+#include "metrics.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 namespace zlynx {
 	std::ostream& operator<<(std::ostream &os, const sockaddr_in6 &x) {
@@ -30,7 +37,21 @@ namespace zlynx {
 		zero_addr(remote_addr);
 	}
 
-	Socket::Socket(int h, const sockaddr_in6 &remote, time_t timeout) :
+	static
+	int64_t monotonic_ms() {
+		timespec now;
+		throw_posix_errno_if( clock_gettime(CLOCK_MONOTONIC, &now) );
+		return int64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+	}
+
+	static
+	int64_t realtime_ms() {
+		timespec now;
+		throw_posix_errno_if( clock_gettime(CLOCK_REALTIME, &now) );
+		return int64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+	}
+
+	Socket::Socket(int h, const sockaddr_in6 &remote, int64_t timeout) :
 		handle(h),
 		timeout(timeout),
 		remote_addr(remote)
@@ -39,22 +60,17 @@ namespace zlynx {
 			throw std::range_error("cannot accept a negative handle");
 		}
 		zero_addr(local_addr);
-		set_nonblocking();
-
-		timespec now;
-		throw_posix_errno_if( clock_gettime(CLOCK_MONOTONIC, &now) );
-		timeout_expiration = now.tv_sec + timeout;
 	}
 
 	Socket::~Socket() {
 		try {
-			logger << "closing handle " << handle << std::endl;
+			LOG(Debug) << "closing handle " << handle;
 			::shutdown(handle, SHUT_RDWR);
 			throw_posix_errno_if( ::close(handle) );
 		} catch( const std::exception &e ) {
-			logger << e.what() << std::endl;
+			LOG(Error) << e.what();
 		} catch(...) {
-			logger << "unknown error in socket close\n";
+			LOG(Error) << "unknown error in socket close";
 		}
 	}
 
@@ -63,6 +79,20 @@ namespace zlynx {
 		addr.sin6_family = AF_INET6;
 	}
 
+	int64_t Socket::expiry() const {
+		int64_t e = timeout ? timeout_expiration : 0;
+		if(deadline && (!e || deadline < e))
+			e = deadline;
+		return e;
+	}
+
+	void Socket::set_deadline(int64_t ms) {
+		if(!sockets)
+			return;
+		deadline = ms ? sockets->now() + ms : 0;
+		sockets->update_timer(*this);
+	}
+
 	void Socket::set_nonblocking() {
 		int flags = ::fcntl(handle, F_GETFL, 0);
 		throw_posix_errno_if( ::fcntl(handle, F_SETFL, flags | O_NONBLOCK) );
@@ -84,62 +114,115 @@ namespace zlynx {
 		int err;
 		socklen_t err_size = sizeof err;
 		throw_posix_errno_if( getsockopt(handle, SOL_SOCKET, SO_ERROR, &err, &err_size) );
-		logger << "error on handle " << handle << ": " << err << std::endl;
+		LOG(Warning) << "error on handle " << handle << ": " << err;
 		return REMOVE;
 	}
 
 	Socket::Action Socket::on_hangup() {
-		// logger << "hangup on handle " << handle << std::endl;
+		// LOG(Debug) << "hangup on handle " << handle;
 		// Keep the socket. It may still have readable data.
 		return KEEP;
 	}
 
 	Socket::Action Socket::on_invalid() {
-		logger << "invalid on handle " << handle << std::endl;
+		LOG(Warning) << "invalid on handle " << handle;
 		return REMOVE;
 	}
 
 	Socket::Action Socket::on_timeout() {
-		logger << "timeout on handle " << handle << std::endl;
+		LOG(Debug) << "timeout on handle " << handle;
 		return REMOVE;
 	}
 
-	Sockets::Sockets() {
+	Sockets::Sockets(std::unique_ptr<EventBackend> backend):
+		now_ms(monotonic_ms()),
+		wall_offset_ms(realtime_ms() - now_ms),
+		wall_checked_ms(now_ms),
+		timers(now_ms),
+		backend(std::move(backend))
+	{
 		sockets.reserve(32);
-		for(auto &p: pollfds) {
-			p.reserve(32);
+		ready.reserve(32);
+	}
+
+	std::shared_ptr<Sockets> make_sockets(EventBackendType type) {
+		if(type == EventBackendType::Uring) {
+#ifdef HAVE_IO_URING
+			try {
+				return std::make_shared<UringSockets>();
+			} catch( const std::exception &e ) {
+				LOG(Warning) << "io_uring unavailable, using epoll: " << e.what();
+			}
+#else
+			LOG(Warning) << "built without io_uring, using epoll";
+#endif
+			type = EventBackendType::Epoll;
 		}
+		return std::make_shared<Sockets>(make_event_backend(type));
 	}
 
-	void Sockets::add_socket(ptr p, PollEvents events) {
+	void Sockets::insert_socket(ptr p) {
 		unsigned h = p->get_handle();
 		if(sockets.size() <= h) {
 			sockets.resize(h+1);
 		}
 		sockets.at(h) = p;
-		next_pollfds().emplace_back( pollfd { p->get_handle(), events, 0 } );
+		++socket_count;
 		p->sockets = shared_from_this();
+		p->timer.id = h;
+		if(p->timeout)
+			p->timeout_expiration = now_ms + p->timeout;
+		update_timer(*p);
 	}
 
-	void Sockets::set_write_event() {
-		if(poll_position != curr_pollfds().end())
-			poll_position->events |= POLLOUT;
+	void Sockets::add_socket(ptr p, PollEvents events) {
+		p->events = events;
+		backend->add(p->get_handle(), events);
+		insert_socket(std::move(p));
 	}
 
-	void Sockets::clear_write_event() {
-		if(poll_position != curr_pollfds().end())
-			poll_position->events &= ~POLLOUT;
+	void Sockets::remove_socket(unsigned h) {
+		backend->remove(h);
+		timers.cancel(sockets.at(h)->timer);
+		sockets.at(h).reset();
+		--socket_count;
 	}
 
-	static std::shared_ptr<Sockets> handler_target;
+	void Sockets::set_events(Socket &s, short events) {
+		if(s.events == events)
+			return;
+		s.events = events;
+		backend->modify(s.get_handle(), events);
+	}
+
+	void Sockets::set_write_event(Socket &s) {
+		set_events(s, s.events | POLLOUT);
+	}
+
+	void Sockets::clear_write_event(Socket &s) {
+		set_events(s, s.events & ~POLLOUT);
+	}
+
+	// Every running Sockets loop, so that one SIGINT stops all of them.
+	// Fixed slots of atomics keep the signal handler lock free.
+	static std::array<std::atomic<Sockets*>, 256> handler_targets;
+	// Set by the first SIGINT, for loops that were not in the list yet.
+	static std::atomic<bool> stop_requested{false};
+
 	static
 	void handler(int) {
-		if(handler_target)
-			handler_target->running = false;
+		stop_requested = true;
+		for(auto &target: handler_targets) {
+			Sockets *s = target.load();
+			// Only the first signal handler to see each loop running
+			// wakes its thread, so the forwarded signals stop here.
+			if(s && s->running.exchange(false) && !pthread_equal(s->thread, pthread_self()))
+				pthread_kill(s->thread, SIGINT);
+		}
 	}
 
 	void Sockets::start() {
-		if(next_pollfds().empty())
+		if(socket_count == 0)
 			return;
 
 		sigset_t blockset;
@@ -148,96 +231,149 @@ namespace zlynx {
 		throw_posix_errno_if( ::sigprocmask(SIG_BLOCK, &blockset, nullptr) );
 
 		running = true;
+		thread = pthread_self();
 		struct sigaction sigact;
 		std::memset(&sigact, 0, sizeof sigact);
 		sigact.sa_handler = handler;
 		sigaction(SIGINT, &sigact, nullptr);
-		handler_target = shared_from_this();
-		while(!next_pollfds().empty()) {
+		auto target = std::find_if(begin(handler_targets), end(handler_targets), [this](auto &t) {
+			Sockets *expected = nullptr;
+			return t.compare_exchange_strong(expected, this);
+		});
+		if(target == end(handler_targets))
+			throw std::runtime_error("too many Sockets loops");
+		// The handler sets the flag before it looks at the list, so a
+		// signal it ran for either found this loop or is seen here.
+		if(stop_requested)
+			running = false;
+		while(active()) {
 			poll();
 		}
+		target->store(nullptr);
+	}
+
+	void Sockets::update_clock() {
+		now_ms = monotonic_ms();
+		// So a step in the wall clock is seen without reading it on
+		// every wakeup.
+		if(now_ms - wall_checked_ms >= 1000) {
+			wall_checked_ms = now_ms;
+			wall_offset_ms = realtime_ms() - now_ms;
+		}
+	}
+
+	void Sockets::update_timer(Socket &s) {
+		int64_t due = s.expiry();
+		if(!due)
+			timers.cancel(s.timer);
+		else if(!s.timer.linked() || due < s.timer.when)
+			timers.schedule(s.timer, due);
+		// A later expiry is left alone. The timer finds it when it
+		// fires and moves itself.
+	}
+
+	int Sockets::wait_timeout() const {
+		return std::min<int64_t>(timers.next_timeout(now_ms), INT_MAX);
 	}
 
 	void Sockets::poll() {
-		// Ensure enough reserve that we never reallocate the vectors while
-		// inside the loop.
-		sockets.reserve(sockets.size() + 32);
+		backend->wait(ready, wait_timeout());
+		update_clock();
+		uint64_t start = ticks();
 
-		flip_pollfds();
+		for(auto &ev: ready) {
+			dispatch(ev.fd, ev.revents);
+		}
 
-		int poll_result = ::poll(curr_pollfds().data(), curr_pollfds().size(), 1 * 1000);
-		if(poll_result < 0) {
-			if(errno == EINTR) {
-				// Run the loop anyway.
-				// There are checks for !running
-			} else {
-				throw_posix_errno_if(poll_result < 0);
+		// When shutting down punch all the sockets on_input once to poke
+		// the listeners.
+		if(!running && !shutdown_started) {
+			shutdown_started = true;
+			for(unsigned h = 0; h < sockets.size(); ++h) {
+				if(sockets[h])
+					dispatch(h, 0);
 			}
 		}
 
-		// Empty out the next pollfds
-		next_pollfds().clear();
+		expire_timers();
+		thread_metrics().record(Latency::Poll, ticks() - start);
+	}
 
-		// Run the result loop even if poll_result was 0 in order to handle
-		// the timeouts.
+	void Sockets::dispatch(unsigned h, short revents) {
+		// The socket may have been removed by an earlier event in this
+		// round.
+		if(h >= sockets.size() || !sockets[h])
+			return;
 
-		timespec now;
-		throw_posix_errno_if( clock_gettime(CLOCK_MONOTONIC, &now) );
+		Socket::Action act = Socket::KEEP;
+		try {
+			// Using a shared_ptr here will also ensure the Socket
+			// will not be destroyed until this call ends.
+			std::shared_ptr<Socket> s = sockets[h];
 
-		// Handle the poll results and build the next pollfds
-		for(
-			poll_position = begin(curr_pollfds());
-			poll_position != end(curr_pollfds());
-			++poll_position
-		) {
+			if(s->timeout && revents) {
+				s->timeout_expiration = now_ms + s->timeout;
+			}
+			// if not running punch on_input to poke the listeners.
+			if( (revents & POLLIN) || !running ) {
+				act |= s->on_input();
+			}
+			if(revents & POLLPRI) {
+				s->on_priority();
+			}
+			if(revents & POLLOUT) {
+				act |= s->on_output();
+			}
+			if(revents & POLLERR) {
+				s->on_error();
+			}
+			if(revents & POLLHUP) {
+				s->on_hangup();
+			}
+			if(revents & POLLNVAL) {
+				s->on_invalid();
+			}
+		} catch( const std::exception &e ) {
+			LOG(Warning)
+				<< "exception while processing handle " << h
+				<< ": " << e.what();
+			// Some bad thing happened so shut it off.
+			act = Socket::REMOVE;
+		}
+		if(act != Socket::KEEP) {
+			remove_socket(h);
+		}
+	}
+
+	void Sockets::expire_timers() {
+		timers.advance(now_ms, [this](TimerWheel::Timer &t) {
+			unsigned h = t.id;
+			std::shared_ptr<Socket> s = sockets.at(h);
+			int64_t due = s->expiry();
+			if(!due)
+				return;
+			// Activity pushed the expiry back since the timer was set.
+			if(due > now_ms) {
+				timers.schedule(t, due);
+				return;
+			}
 			Socket::Action act = Socket::KEEP;
 			try {
-				// Using a shared_ptr here will also ensure the Socket
-				// will not be destroyed until this loop iteration ends.
-				std::shared_ptr<Socket> s = sockets.at(poll_position->fd);
-
-				if(s->timeout) {
-					if(poll_position->revents) {
-						s->timeout_expiration = now.tv_sec + s->timeout;
-					} else {
-						if(s->timeout_expiration < now.tv_sec) {
-							act |= s->on_timeout();
-						}
-					}
-				}
-				// if not running punch all the sockets on_input to poke the listeners.
-				if( (poll_position->revents & POLLIN) || !running ) {
-					act |= s->on_input();
-				}
-				if(poll_position->revents & POLLPRI) {
-					s->on_priority();
-				}
-				if(poll_position->revents & POLLOUT) {
-					s->on_output();
-				}
-				if(poll_position->revents & POLLERR) {
-					s->on_error();
-				}
-				if(poll_position->revents & POLLHUP) {
-					s->on_hangup();
-				}
-				if(poll_position->revents & POLLNVAL) {
-					s->on_invalid();
-				}
+				act = s->on_timeout();
 			} catch( const std::exception &e ) {
-				logger
-					<< "exception while processing handle " << poll_position->fd
-					<< ": " << e.what()
-					<< std::endl;
-				// Some bad thing happened so shut it off.
+				LOG(Warning)
+					<< "exception while processing handle " << h
+					<< ": " << e.what();
 				act = Socket::REMOVE;
 			}
-			if(act == Socket::KEEP) {
-				next_pollfds().emplace_back( pollfd{poll_position->fd, poll_position->events, 0} );
+			if(act != Socket::KEEP) {
+				remove_socket(h);
 			} else {
-				sockets.at(poll_position->fd).reset();
+				s->timeout_expiration = now_ms + s->timeout;
+				s->deadline = 0;
+				update_timer(*s);
 			}
-		}
+		});
 	}
 
 	Listener::Listener(uint16_t port):
@@ -249,7 +385,7 @@ namespace zlynx {
 		local_addr.sin6_addr = in6addr_any;
 	}
 
-	void Listener::start() {
+	void Listener::start(bool reuse_port) {
 		// Bind the local address.
 		int sock = socket(AF_INET6, SOCK_STREAM, 0);
 		throw_posix_errno_if(sock<0);
@@ -257,6 +393,10 @@ namespace zlynx {
 		set_nonblocking();
 		int val = 1;
 		throw_posix_errno_if( ::setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, &val, sizeof val) );
+		// Each event loop thread binds its own Listener to the port and
+		// the kernel spreads new connections across them.
+		if(reuse_port)
+			throw_posix_errno_if( ::setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, &val, sizeof val) );
 		throw_posix_errno_if( ::bind(handle, (sockaddr*)&local_addr, sizeof local_addr) );
 		// Start listening.
 		throw_posix_errno_if( ::listen(handle, backlog) );
@@ -267,17 +407,25 @@ namespace zlynx {
 			return REMOVE;
 		auto result = do_accept();
 		if(result.ok) {
-			auto conn = std::make_shared<Connection>(result.handle, result.remote_addr);
-			sockets->add_socket(conn);
+			thread_metrics().add(Counter::Accepts);
+			on_accept(result);
 		}
 		return KEEP;
 	}
 
+	void Listener::on_accept(const AcceptResult &result) {
+		auto conn = std::allocate_shared<Connection>(PoolAllocator<Connection>(), result.handle, result.remote_addr);
+		sockets->add_socket(conn);
+	}
+
 	Listener::AcceptResult  Listener::do_accept() {
 		AcceptResult result;
 		socklen_t remote_addr_len = sizeof result.remote_addr;
 
-		int new_handle = ::accept(handle, (sockaddr*)&result.remote_addr, &remote_addr_len);
+		int new_handle = ::accept4(
+			handle, (sockaddr*)&result.remote_addr, &remote_addr_len,
+			SOCK_NONBLOCK|SOCK_CLOEXEC
+		);
 		if(new_handle < 0 && errno == EAGAIN)
 			return result;
 		throw_posix_errno_if(new_handle < 0);
@@ -286,18 +434,19 @@ namespace zlynx {
 		return result;
 	}
 
-	Connection::Connection(int h, const sockaddr_in6 &remote, time_t timeout):
+	Connection::Connection(int h, const sockaddr_in6 &remote, int64_t timeout):
 		Socket(h, remote, timeout)
 	{
-		logger
+		LOG(Debug)
 			<< "making a new connection, handle: " << h
-			<< " from " << remote;
-		if(timeout) logger
-			<< " with timeout " << timeout;
-		logger << std::endl;
+			<< " from " << remote
+			<< " with timeout " << timeout << "ms";
 
-		input.reserve(io_block_size);
-		output.reserve(io_block_size);
+		thread_metrics().add(Counter::ConnectionsOpened);
+	}
+
+	Connection::~Connection() {
+		thread_metrics().add(Counter::ConnectionsClosed);
 	}
 
 	void Connection::close_output() {
@@ -305,62 +454,208 @@ namespace zlynx {
 	}
 
 	Socket::Action Connection::on_input() {
-		size_t input_point = input.size();
-		input.resize(input_point + io_block_size);
-		ssize_t bytes = ::read(handle, input.data()+input_point, io_block_size);
-		if(bytes < 0 && errno == EAGAIN)
-			return KEEP;
-		if(bytes < 0 && errno == ECONNRESET)
-			return REMOVE;
-		if(bytes < 0 && errno == ETIMEDOUT)
-			return REMOVE;
-		throw_posix_errno_if( bytes < 0 );
-		input.resize(input_point + bytes);
-		if(bytes == 0) {
-			logger << "end of file on handle " << handle << std::endl;
+		// Drain the socket so a large upload is not one wakeup per block.
+		// A read that fills its space makes the next one twice the size,
+		// and one that uses under a quarter halves it. Stop after
+		// io_max_drain_size to let the other sockets have a turn.
+		size_t total = 0;
+		bool eof = false;
+		while(total < io_max_drain_size) {
+			char *p = input.prepare(read_size);
+			ssize_t bytes = ::read(handle, p, read_size);
+			if(bytes < 0) {
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN)
+					break;
+				if(errno == ECONNRESET || errno == ETIMEDOUT)
+					return REMOVE;
+				throw_posix_errno_if( bytes < 0 );
+			}
+			if(bytes == 0) {
+				eof = true;
+				break;
+			}
+			input.commit(bytes);
+			total += bytes;
+			size_t n = bytes;
+			if(n == read_size) {
+				read_size = std::min(read_size * 2, io_max_read_size);
+			} else {
+				if(n < read_size / 4)
+					read_size = std::max(read_size / 2, io_block_size);
+				// A short read means the socket is empty.
+				break;
+			}
+		}
+		Action act = KEEP;
+		if(total) {
+			thread_metrics().add(Counter::BytesIn, total);
+			act = on_received();
+		}
+		if(eof) {
+			LOG(Debug) << "end of file on handle " << handle;
 			return REMOVE;
 		}
+		release_buffers();
+		return act;
+	}
+
+	Socket::Action Connection::on_received() {
 		return KEEP;
 	}
 
 	Socket::Action Connection::on_output() {
-		ssize_t bytes = ::write(handle, output.data(), output.size());
-		if(bytes < 0) {
-			if(errno == EAGAIN)
-				return KEEP;
-			if(errno == EPIPE) {
-				logger << "output closed on handle " << handle << std::endl;
-				return REMOVE;
+		if(!output.empty()) {
+			std::array<iovec, io_max_iovecs> iov;
+			size_t count = output.fill(iov.data(), iov.size());
+			ssize_t bytes = ::writev(handle, iov.data(), count);
+			if(bytes < 0) {
+				if(errno == EAGAIN)
+					return KEEP;
+				if(errno == EPIPE) {
+					LOG(Debug) << "output closed on handle " << handle;
+					return REMOVE;
+				}
+				if(errno == ECONNRESET)
+					return REMOVE;
 			}
-			if(errno == ECONNRESET)
+			throw_posix_errno_if( bytes < 0 );
+			output.consume(bytes);
+			sent(bytes);
+		}
+		if(output.empty() && sending_file()) {
+			if(send_file() == REMOVE)
 				return REMOVE;
 		}
-		throw_posix_errno_if( bytes < 0 );
-		output.erase(output.begin(), output.begin()+bytes);
-		if(sockets) {
-			if(output.empty()) {
-				sockets->clear_write_event();
-				if(closing)
-					::shutdown(handle, SHUT_WR);
-			} else {
-				sockets->set_write_event();
+		update_write_event();
+		return resume_input();
+	}
+
+	Socket::Action Connection::resume_input() {
+		if(!input_paused || sending_file())
+			return KEEP;
+		input_paused = false;
+		return on_received();
+	}
+
+	void Connection::write_file(int f, uint64_t offset, uint64_t size, OutputQueue::Owner owner) {
+		if(!size)
+			return;
+		if(sending_file())
+			throw std::logic_error("write_file while a file is being sent");
+		file = PendingFile{f, offset, size, std::move(owner)};
+		if(sockets && !sockets->writes_directly()) {
+			sockets->set_write_event(*this);
+			return;
+		}
+		// Send the head now with MSG_MORE so it shares a packet with the
+		// start of the file. Errors are left for the write event.
+		if(!output.empty()) {
+			std::array<iovec, io_max_iovecs> iov;
+			msghdr msg{};
+			msg.msg_iov = iov.data();
+			msg.msg_iovlen = output.fill(iov.data(), iov.size());
+			ssize_t bytes = ::sendmsg(handle, &msg, MSG_MORE | MSG_NOSIGNAL);
+			if(bytes > 0) {
+				output.consume(bytes);
+				sent(bytes);
 			}
 		}
+		if(output.empty())
+			send_file();
+		update_write_event();
+	}
+
+	Socket::Action Connection::send_file() {
+		size_t total = 0;
+		while(file.size && total < io_max_file_size) {
+			off_t offset = file.offset;
+			ssize_t bytes = ::sendfile(handle, file.handle, &offset, std::min<uint64_t>(file.size, io_max_file_size));
+			if(bytes < 0) {
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN)
+					break;
+				if(errno == EPIPE || errno == ECONNRESET)
+					return REMOVE;
+				throw_posix_errno_if( bytes < 0 );
+			}
+			// The file got shorter than the Content-Length sent for it.
+			if(bytes == 0) {
+				LOG(Warning) << "file ended early on handle " << handle;
+				return REMOVE;
+			}
+			file.offset += bytes;
+			file.size -= bytes;
+			total += bytes;
+		}
+		sent(total);
+		if(!file.size)
+			file = PendingFile();
 		return KEEP;
 	}
 
+	void Connection::read_file() {
+		size_t want = std::min<uint64_t>(file.size, io_max_file_size);
+		char *p = output.prepare(want);
+		ssize_t bytes;
+		do {
+			bytes = ::pread(file.handle, p, want, file.offset);
+		} while(bytes < 0 && errno == EINTR);
+		throw_posix_errno_if( bytes < 0 );
+		if(bytes == 0)
+			throw std::runtime_error("file ended early");
+		output.commit(bytes);
+		file.offset += bytes;
+		file.size -= bytes;
+		if(!file.size)
+			file = PendingFile();
+	}
+
+	void Connection::write_ref(std::string_view data, OutputQueue::Owner owner) {
+		queue_ref(data, std::move(owner));
+		output_queued();
+	}
+
+	void Connection::write_ref(std::string_view head, std::string_view body, OutputQueue::Owner owner) {
+		queue_ref(head, owner);
+		queue_ref(body, std::move(owner));
+		output_queued();
+	}
+
+	void Connection::queue_ref(std::string_view data, OutputQueue::Owner owner) {
+		if(data.size() < io_reference_size || !owner)
+			output.append(data.data(), data.data() + data.size());
+		else
+			output.append_ref(data, std::move(owner));
+	}
+
+	void Connection::output_queued() {
+		if(
+			output.size() >= io_direct_write_size &&
+			(!sockets || sockets->writes_directly())
+		) {
+			write_directly(nullptr, nullptr);
+		} else if(sockets && !output.empty()) {
+			sockets->set_write_event(*this);
+		}
+	}
+
 	void Connection::write_directly(const char* begin, const char* end) {
-		constexpr size_t iov_count = 2;
-		std::array<iovec, iov_count> iov = {
-			iovec{ const_cast<char*>(output.data()), output.size() },
-			iovec{ const_cast<char*>(begin), static_cast<size_t>(end-begin) },
-		};
-		ssize_t bytes_target = 0;
-		for(auto &x: iov) {
-			bytes_target += x.iov_len;
-		};
-
-		ssize_t bytes_written = ::writev(handle, iov.data(), iov.size());
+		std::array<iovec, io_max_iovecs> iov;
+		size_t count = output.fill(iov.data(), iov.size() - 1);
+		size_t queued = 0;
+		for(size_t i = 0; i < count; ++i) {
+			queued += iov[i].iov_len;
+		}
+		// The new bytes can only go in this writev if all of the queue
+		// fitted ahead of them.
+		bool all_queued = queued == output.size();
+		if(all_queued && begin != end)
+			iov[count++] = iovec{ const_cast<char*>(begin), static_cast<size_t>(end-begin) };
+
+		ssize_t bytes_written = ::writev(handle, iov.data(), count);
 		if(bytes_written < 0) {
 			switch(errno) {
 				case EAGAIN:
@@ -375,22 +670,57 @@ namespace zlynx {
 					throw_posix_errno_if(bytes_written<0);
 			}
 		}
-		if(static_cast<size_t>(bytes_written) >= iov[0].iov_len) {
-			output.clear();
-			begin += bytes_written - iov[0].iov_len;
-		} else {
-			// Trim off the written part of output buffer.
-			output.erase(output.begin(), output.begin()+bytes_written);
-		}
+		size_t from_queue = std::min(static_cast<size_t>(bytes_written), queued);
+		output.consume(from_queue);
+		sent(bytes_written);
+		if(all_queued)
+			begin += bytes_written - from_queue;
 		// Save any remaining bytes in output buffer.
-		output.insert(output.end(), begin, end);
+		output.append(begin, end);
+		update_write_event();
+	}
+
+	void Connection::sent(size_t bytes) {
+		if(!bytes)
+			return;
+		ThreadMetrics &m = thread_metrics();
+		m.add(Counter::BytesOut, bytes);
+		bytes_sent += bytes;
+		uint64_t now = 0;
+		while(first_byte_count && first_bytes[first_byte_front].position < bytes_sent) {
+			if(!now)
+				now = ticks();
+			m.record(Latency::FirstByte, now - first_bytes[first_byte_front].start);
+			first_byte_front = (first_byte_front + 1) % first_bytes.size();
+			--first_byte_count;
+		}
+	}
+
+	void Connection::response_started(uint64_t start) {
+		if(!start || first_byte_count == first_bytes.size())
+			return;
+		// A file being sent holds up the next request, so only the
+		// output queues are ahead of this response.
+		uint64_t position = bytes_sent + output.size() + (sockets ? sockets->in_flight(*this) : 0);
+		first_bytes[(first_byte_front + first_byte_count++) % first_bytes.size()] = FirstByte{start, position};
+	}
+
+	void Connection::release_buffers() {
+		if(input.empty())
+			input.release();
+		if(output.empty())
+			output.release();
+	}
+
+	void Connection::update_write_event() {
 		if(sockets) {
-			if(output.empty()) {
-				sockets->clear_write_event();
+			if(output.empty() && !sending_file()) {
+				output.release();
+				sockets->clear_write_event(*this);
 				if(closing)
 					::shutdown(handle, SHUT_WR);
 			} else {
-				sockets->set_write_event();
+				sockets->set_write_event(*this);
 			}
 		}
 	}
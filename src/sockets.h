@@ -1,26 +1,38 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <string_view>
+#include <array>
 #include <vector>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
 #include <poll.h>
+#include <pthread.h>
+#include "events.h"
+#include "iobuffer.h"
+#include "pool.h"
+#include "timers.h"
 
 namespace zlynx {
 	class Sockets;
+	class Connection;
 
 	// Socket is the base for all sockets to be held in a Sockets container.
 	class Socket : public std::enable_shared_from_this<Socket> {
 		public:
 		Socket(int h);
-		Socket(int h, const sockaddr_in6 &remote, time_t timeout = 0);
+		Socket(int h, const sockaddr_in6 &remote, int64_t timeout = 0);
 		virtual ~Socket();
 		Socket(const Socket&) = delete;
 		void operator=(const Socket&) = delete;
 
 		int get_handle() const { return handle; }
 		void set_nonblocking();
+		// Close the socket this many milliseconds from now whatever
+		// events happen before then. Zero clears it.
+		void set_deadline(int64_t ms);
 
 		protected:
 		// Return from the on_* calls. This is whether Sockets should keep or
@@ -43,15 +55,26 @@ namespace zlynx {
 		unsigned handle;
 		// timeout is added to expiration on every event
 		// timeout of zero means disabled
-		time_t timeout = 0;
+		// All times are milliseconds on the monotonic clock.
+		int64_t timeout = 0;
 		// The absolute time to expire this socket. It will be closed.
-		time_t timeout_expiration = 0;
+		int64_t timeout_expiration = 0;
+		// Like timeout_expiration but not pushed back by events.
+		// Zero means none.
+		int64_t deadline = 0;
+		TimerWheel::Timer timer;
+
+		// The earlier of timeout_expiration and deadline, or zero.
+		int64_t expiry() const;
+		// The events currently registered with the event backend.
+		short events = 0;
 		// Local and remote addresses
 		sockaddr_in6 local_addr;
 		sockaddr_in6 remote_addr;
 
 		// Most sockets need a pointer back to their container.
 		friend class Sockets;
+		friend class UringSockets;
 		std::shared_ptr<Sockets> sockets;
 
 		void zero_addr(sockaddr_in6 &addr);
@@ -59,38 +82,82 @@ namespace zlynx {
 
 	// Sockets contains individual Socket objects.
 	// It manages their event loop.
+	// The engine methods are virtual so that a completion based engine
+	// such as UringSockets can replace the readiness loop.
 	class Sockets : public std::enable_shared_from_this<Sockets> {
-		private:
+		protected:
 		typedef std::shared_ptr<Socket> ptr;
 
 		public:
-		Sockets();
+		Sockets(std::unique_ptr<EventBackend> backend = make_event_backend());
+		virtual ~Sockets() {}
 
 		enum PollEvents : short {
 			Read = POLLIN|POLLPRI,
 			Write = Read|POLLOUT
 		};
-		void add_socket(ptr p, PollEvents events = Read);
-		void set_write_event();
-		void clear_write_event();
+		virtual void add_socket(ptr p, PollEvents events = Read);
+		// Turn POLLOUT on or off for a socket. The backend is only touched
+		// when the flag actually changes.
+		virtual void set_write_event(Socket &s);
+		virtual void clear_write_event(Socket &s);
 		void start();
 
-		sig_atomic_t running = false;
+		// False when Connections must queue all output and leave the
+		// writing to the engine.
+		bool writes_directly() const { return direct_writes; }
+		// Output the engine has taken from a Connection but not yet
+		// written.
+		virtual size_t in_flight(const Connection&) const { return 0; }
 
-		private:
+		// Milliseconds on the monotonic clock, read once per wakeup.
+		int64_t now() const { return now_ms; }
+		// The same instant as now() in milliseconds since the epoch. The
+		// offset between the clocks is read again once a second.
+		int64_t wall_time() const { return now_ms + wall_offset_ms; }
+		// Move the socket's timer after its expiry has changed.
+		void update_timer(Socket &s);
+
+		std::atomic<bool> running{false};
+		// The thread running start().
+		pthread_t thread;
+
+		protected:
+		int64_t now_ms;
+		int64_t wall_offset_ms;
+		int64_t wall_checked_ms;
+		// Declared before sockets, which unlink from it when destroyed.
+		TimerWheel timers;
+		// Indexed by socket handle.
 		std::vector<ptr> sockets;
-		std::array<std::vector<pollfd>, 2> pollfds;
-		unsigned pollfds_current_index = 0;
-		std::vector<pollfd>::iterator poll_position = pollfds[0].end();
+		size_t socket_count = 0;
+		bool direct_writes = true;
+		bool shutdown_started = false;
+
+		void insert_socket(ptr p);
+		virtual void remove_socket(unsigned h);
+		void update_clock();
+		// How long to wait for events before the next timer is due.
+		int wait_timeout() const;
+		// Call on_timeout for the sockets whose timers are due.
+		void expire_timers();
+		// True while the engine still has work to finish.
+		virtual bool active() const { return socket_count > 0; }
 
-		std::vector<pollfd>& curr_pollfds() { return pollfds[pollfds_current_index]; }
-		std::vector<pollfd>& next_pollfds() { return pollfds[pollfds_current_index ^ 1]; }
-		void flip_pollfds() {  pollfds_current_index ^= 1; }
+		virtual void poll();
 
-		void poll();
+		private:
+		std::unique_ptr<EventBackend> backend;
+		std::vector<EventBackend::Event> ready;
 
+		void set_events(Socket &s, short events);
+		void dispatch(unsigned h, short revents);
 	};
 
+	// Create the Sockets engine for an event backend type. Falls back to
+	// epoll when io_uring is requested but not usable.
+	std::shared_ptr<Sockets> make_sockets(EventBackendType type);
+
 	// A Socket that listens on a port and creates new Connections.
 	// Create it, call start(), and add it to a Sockets collection.
 	class Listener : public Socket {
@@ -103,43 +170,42 @@ namespace zlynx {
 
 		Listener(uint16_t port);
 
-		void start();
+		void start(bool reuse_port = false);
 
 		Action on_input() override;
 
 		protected:
+		friend class UringSockets;
+
 		int backlog = 256;
 
 		AcceptResult do_accept();
-	};
-
-	template<typename T>
-	struct no_construct_alloc : public std::allocator<T> {
-		using std::allocator<T>::construct;
-		void construct(T*) {
-		}
-		template<typename U>
-		struct rebind {
-			using other = no_construct_alloc<U>;
-		};
+		// Called for every new handle. Creates the Connection for it and
+		// adds it to sockets. Connections come and go all the time, so
+		// they are made with allocate_shared and a PoolAllocator.
+		virtual void on_accept(const AcceptResult &result);
 	};
 
 	// Connection reads and writes data from a Socket.
 	// It has input and output buffers.
 	class Connection : public Socket {
 		public:
-		Connection(int h, const sockaddr_in6 &remote, time_t timeout = 0);
+		Connection(int h, const sockaddr_in6 &remote, int64_t timeout = 0);
+		~Connection() override;
 
 		// Add to the output buffer and set the poll flags.
 		template<class Iterator>
 		void write(Iterator begin, Iterator end) {
-			if(static_cast<size_t>(end - begin) >= io_direct_write_size) {
+			if(
+				static_cast<size_t>(end - begin) >= io_direct_write_size &&
+				(!sockets || sockets->writes_directly())
+			) {
 				this->write_directly(begin, end);
 			} else {
-				this->output.insert(this->output.end(), begin, end);
+				this->output.append(begin, end);
 			}
 			if(sockets && !this->output.empty())
-				sockets->set_write_event();
+				sockets->set_write_event(*this);
 		}
 
 		template<class Container>
@@ -147,19 +213,97 @@ namespace zlynx {
 			this->write(cbegin(c), cend(c));
 		}
 
+		// Add data to the output without copying it. owner must keep the
+		// data alive and is held until the data has been written. Small
+		// pieces are copied anyway.
+		void write_ref(std::string_view data, OutputQueue::Owner owner);
+		// The same for two pieces with one owner, such as a stored
+		// response head and body.
+		void write_ref(std::string_view head, std::string_view body, OutputQueue::Owner owner);
+
+		// Send size bytes of the open file at offset after the queued
+		// output, with sendfile so they never pass through user space.
+		// owner keeps the file open until then. Nothing more may be
+		// written until it has all gone, see pause_input. An engine that
+		// does its own writing reads the file into output a piece at a
+		// time instead.
+		void write_file(int file, uint64_t offset, uint64_t size, OutputQueue::Owner owner);
+		bool sending_file() const { return file.size > 0; }
+
 		void close_output();
 
 		protected:
+		friend class UringSockets;
+
 		Action on_input() override;
 		Action on_output() override;
+		// Called after new data has been added to input.
+		virtual Action on_received();
+		// on_received is called again once a file being sent has gone,
+		// for input that was left waiting behind it.
+		void pause_input() { input_paused = true; }
+		Action resume_input();
 
+		// Write the queued output followed by [begin, end) now, and queue
+		// whatever the socket did not take.
 		void write_directly(const char* begin, const char* end);
+		// Match the write event to the output. A closing connection is
+		// shut down once its output is all written.
+		void update_write_event();
+		void queue_ref(std::string_view data, OutputQueue::Owner owner);
+		// Called after adding to output. Large output is written straight
+		// away, the rest waits for the write event.
+		void output_queued();
+		// Count bytes written to the socket.
+		void sent(size_t bytes);
+		// A response is about to be queued for a request read at start,
+		// in ticks(). Its time to first byte is recorded when sent reaches
+		// it.
+		void response_started(uint64_t start);
+		// Give empty buffers back to the pool while the connection waits.
+		void release_buffers();
+		// sendfile as much of the pending file as the socket takes.
+		Action send_file();
+		// Read the next piece of the pending file into output.
+		void read_file();
 
-		static constexpr size_t io_block_size = 8 * 1024;
+		static constexpr size_t io_block_size = IOBuffer::block_size;
+		// The most one read asks for, and the most on_input reads before
+		// returning to the event loop.
+		static constexpr size_t io_max_read_size = 64 * 1024;
+		static constexpr size_t io_max_drain_size = 256 * 1024;
+		// The most send_file sends, or read_file reads, at a time.
+		static constexpr size_t io_max_file_size = 1024 * 1024;
 		static constexpr size_t io_direct_write_size = 4 * 1024;
-		std::vector<char, no_construct_alloc<char>> input;
-		std::vector<char, no_construct_alloc<char>> output;
+		// Below this write_ref copies. It is cheaper than another iovec.
+		static constexpr size_t io_reference_size = 1024;
+		// The most output segments passed to one writev.
+		static constexpr size_t io_max_iovecs = 64;
+		IOBuffer input;
+		OutputQueue output;
+		// What write_file has left to send.
+		struct PendingFile {
+			int handle = -1;
+			uint64_t offset = 0;
+			uint64_t size = 0;
+			OutputQueue::Owner owner;
+		} file;
+		bool input_paused = false;
+		// How much the next read asks for. It adapts between
+		// io_block_size and io_max_read_size.
+		size_t read_size = io_block_size;
 		// Set to true during a graceful close.
 		bool closing = false;
+		// Responses with nothing written yet, oldest first, with when
+		// their requests were read and how many bytes go out ahead of
+		// them. Past the first few in a pipeline they are not timed.
+		struct FirstByte {
+			uint64_t start;
+			uint64_t position;
+		};
+		std::array<FirstByte, 8> first_bytes;
+		size_t first_byte_front = 0;
+		size_t first_byte_count = 0;
+		uint64_t bytes_sent = 0;
 	};
 };
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <limits>
+#include "timers.h"
+
+namespace zlynx {
+	void TimerWheel::Timer::unlink() {
+		if(!linked())
+			return;
+		prev->next = next;
+		next->prev = prev;
+		prev = next = nullptr;
+	}
+
+	TimerWheel::TimerWheel(int64_t now):
+		current(now)
+	{
+		for(auto &level: wheel) {
+			for(auto &slot: level.slots) {
+				slot.prev = slot.next = &slot;
+			}
+		}
+	}
+
+	void TimerWheel::schedule(Timer &t, int64_t when) {
+		t.unlink();
+		t.when = when;
+		insert(t);
+	}
+
+	void TimerWheel::insert(Timer &t) {
+		// Anything already due fires on the next tick.
+		int64_t when = std::max(t.when, current + 1);
+		int64_t delta = when - current;
+		unsigned level = 0;
+		while(level + 1 < levels && delta >= (int64_t(1) << (slot_bits * (level + 1))))
+			++level;
+		// Past the top of the wheel, park it in the furthest slot. It
+		// is re-inserted from there when the wheel gets to it.
+		int64_t limit = int64_t(1) << (slot_bits * levels);
+		if(delta >= limit)
+			when = current + limit - 1;
+		unsigned slot = (when >> (slot_bits * level)) & slot_mask;
+
+		Timer &head = wheel[level].slots[slot];
+		t.prev = head.prev;
+		t.next = &head;
+		head.prev->next = &t;
+		head.prev = &t;
+		wheel[level].occupied |= uint64_t(1) << slot;
+	}
+
+	void TimerWheel::take_slot(unsigned level, unsigned slot, Timer &out) {
+		Timer &head = wheel[level].slots[slot];
+		wheel[level].occupied &= ~(uint64_t(1) << slot);
+		if(head.next == &head) {
+			out.prev = out.next = &out;
+			return;
+		}
+		out.next = head.next;
+		out.prev = head.prev;
+		out.next->prev = &out;
+		out.prev->next = &out;
+		head.prev = head.next = &head;
+	}
+
+	void TimerWheel::cascade() {
+		// Higher levels first because they may refill lower ones.
+		unsigned top = 0;
+		while(top + 1 < levels && (current & ((int64_t(1) << (slot_bits * (top + 1))) - 1)) == 0)
+			++top;
+		for(unsigned level = top; level > 0; --level) {
+			Timer moving;
+			take_slot(level, (current >> (slot_bits * level)) & slot_mask, moving);
+			while(moving.next != &moving) {
+				Timer *t = moving.next;
+				t->unlink();
+				insert(*t);
+			}
+		}
+	}
+
+	int64_t TimerWheel::next_tick() const {
+		int64_t best = std::numeric_limits<int64_t>::max();
+		for(unsigned level = 0; level < levels; ++level) {
+			const Level &l = wheel[level];
+			uint64_t bits = l.occupied;
+			unsigned shift = slot_bits * level;
+			int64_t position = current >> shift;
+			// Look at the slots after the current one, wrapping round to
+			// include it last.
+			for(unsigned k = 1; bits && k <= slot_count; ++k) {
+				unsigned slot = (position + k) & slot_mask;
+				uint64_t bit = uint64_t(1) << slot;
+				if(!(bits & bit))
+					continue;
+				bits &= ~bit;
+				const Timer &head = l.slots[slot];
+				if(head.next == &head)
+					continue;
+				best = std::min(best, (position + k) << shift);
+				break;
+			}
+		}
+		return best;
+	}
+
+	int64_t TimerWheel::next_timeout(int64_t now) const {
+		int64_t tick = next_tick();
+		if(tick == std::numeric_limits<int64_t>::max())
+			return -1;
+		return std::max<int64_t>(tick - now, 0);
+	}
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+namespace zlynx {
+	// Hierarchical timer wheel with millisecond ticks.
+	// Level 0 has one slot per millisecond for the next 64 ms. Each level
+	// above has slots 64 times as wide. A timer sits in the level that
+	// matches how far away it is and moves down a level each time the
+	// wheel reaches its slot, so schedule and cancel are O(1).
+	class TimerWheel {
+		public:
+		// Embedded in whatever needs a timer. The lists are circular with
+		// a sentinel so a Timer can unlink itself without knowing its
+		// slot.
+		struct Timer {
+			Timer *prev = nullptr;
+			Timer *next = nullptr;
+			// Absolute expiry in milliseconds.
+			int64_t when = 0;
+			// Identifies the owner to the expiry callback.
+			unsigned id = 0;
+
+			Timer() {}
+			explicit Timer(unsigned id): id(id) {}
+			~Timer() { unlink(); }
+			Timer(const Timer&) = delete;
+			void operator=(const Timer&) = delete;
+
+			bool linked() const { return next != nullptr; }
+			void unlink();
+		};
+
+		explicit TimerWheel(int64_t now);
+
+		void schedule(Timer &t, int64_t when);
+		void cancel(Timer &t) { t.unlink(); }
+
+		// Milliseconds from now until the wheel next has work to do, or
+		// -1 if it is empty.
+		int64_t next_timeout(int64_t now) const;
+
+		// Move the wheel up to now, calling f for every Timer that is
+		// due. The Timer is unlinked first and f may schedule it again.
+		template<class F>
+		void advance(int64_t now, F f) {
+			while(current < now) {
+				int64_t tick = next_tick();
+				if(tick > now) {
+					current = now;
+					break;
+				}
+				current = tick;
+				cascade();
+				Timer due;
+				take_slot(0, current & slot_mask, due);
+				while(due.next != &due) {
+					Timer *t = due.next;
+					t->unlink();
+					f(*t);
+				}
+			}
+		}
+
+		private:
+		static constexpr unsigned slot_bits = 6;
+		static constexpr unsigned slot_count = 1u << slot_bits;
+		static constexpr unsigned slot_mask = slot_count - 1;
+		static constexpr unsigned levels = 4;
+
+		struct Level {
+			std::array<Timer, slot_count> slots;
+			// Slots that may hold timers. Bits are cleared lazily when a
+			// slot is found to be empty.
+			uint64_t occupied = 0;
+		};
+
+		// The last tick processed.
+		int64_t current;
+		std::array<Level, levels> wheel;
+
+		void insert(Timer &t);
+		// Move the timers in a slot into the list headed by out.
+		void take_slot(unsigned level, unsigned slot, Timer &out);
+		// Re-insert the timers of every higher level slot that starts at
+		// the current tick.
+		void cascade();
+		// The next tick with a level 0 slot to fire or a higher slot to
+		// cascade.
+		int64_t next_tick() const;
+	};
+};
@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "errors.h"
+#include "log.h"
+#include "metrics.h"
+
+namespace zlynx {
+	Uring::Uring(unsigned entries) {
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+		handle = ::syscall(__NR_io_uring_setup, entries, &params);
+		throw_posix_errno_if(handle < 0);
+
+		try {
+			constexpr unsigned required =
+				IORING_FEAT_SINGLE_MMAP |
+				IORING_FEAT_NODROP |
+				IORING_FEAT_EXT_ARG;
+			if((params.features & required) != required)
+				throw std::runtime_error("io_uring kernel features missing");
+
+			sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			// With IORING_FEAT_SINGLE_MMAP both rings share one mapping.
+			sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+			sq_ring = ::mmap(
+				nullptr, sq_ring_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, handle, IORING_OFF_SQ_RING
+			);
+			throw_posix_errno_if(sq_ring == MAP_FAILED);
+			cq_ring = sq_ring;
+
+			sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			void *p = ::mmap(
+				nullptr, sqes_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, handle, IORING_OFF_SQES
+			);
+			throw_posix_errno_if(p == MAP_FAILED);
+			sqes = static_cast<io_uring_sqe*>(p);
+		} catch(...) {
+			if(sq_ring && sq_ring != MAP_FAILED)
+				::munmap(sq_ring, sq_ring_size);
+			::close(handle);
+			throw;
+		}
+
+		char *sq = static_cast<char*>(sq_ring);
+		sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_entries = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+		// Submission slots always map straight to the same SQE.
+		unsigned *array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		for(unsigned i = 0; i < sq_entries; ++i) {
+			array[i] = i;
+		}
+		sqe_tail = *sq_tail;
+
+		char *cq = static_cast<char*>(cq_ring);
+		cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		// Find out which operations this kernel has.
+		constexpr unsigned probe_ops = 256;
+		std::vector<char> probe_buf(sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op));
+		auto probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+		if(::syscall(__NR_io_uring_register, handle, IORING_REGISTER_PROBE, probe, probe_ops) == 0) {
+			supported_ops.resize(probe->ops_len);
+			for(unsigned i = 0; i < probe->ops_len; ++i) {
+				supported_ops[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+			}
+		}
+	}
+
+	Uring::~Uring() {
+		::munmap(sqes, sqes_size);
+		::munmap(sq_ring, sq_ring_size);
+		::close(handle);
+	}
+
+	bool Uring::supports(unsigned op) const {
+		return op < supported_ops.size() && supported_ops[op];
+	}
+
+	int Uring::enter(unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_size) {
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		int r = ::syscall(__NR_io_uring_enter, handle, submit, wait, flags, arg, arg_size);
+		// The kernel moves the head past everything it consumed, even
+		// when the wait part fails.
+		to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		return r;
+	}
+
+	void Uring::submit() {
+		int r = enter(to_submit, 0, 0, nullptr, 0);
+		if(r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			throw_posix_errno_if(r < 0);
+	}
+
+	io_uring_sqe* Uring::get_sqe() {
+		if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+			submit();
+			if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+				throw std::runtime_error("io_uring submission queue full");
+		}
+		io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+		std::memset(sqe, 0, sizeof *sqe);
+		++sqe_tail;
+		++to_submit;
+		return sqe;
+	}
+
+	bool Uring::submit_and_wait(int timeout_ms) {
+		__kernel_timespec ts{ timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL };
+		io_uring_getevents_arg arg{};
+		if(timeout_ms >= 0)
+			arg.ts = reinterpret_cast<uint64_t>(&ts);
+		int r = enter(
+			to_submit, 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof arg
+		);
+		if(r < 0) {
+			switch(errno) {
+				case EINTR:
+				case ETIME:
+				case EAGAIN:
+				case EBUSY:
+					return false;
+				default:
+					throw_posix_errno_if(r < 0);
+			}
+		}
+		return true;
+	}
+
+	BufferRing::BufferRing(Uring &ring, uint16_t group, unsigned entries, unsigned size):
+		group(group),
+		ring(ring),
+		entries(entries),
+		buffer_size(size)
+	{
+		if(entries & (entries - 1))
+			throw std::invalid_argument("buffer ring entries must be a power of 2");
+
+		br_size = entries * sizeof(io_uring_buf);
+		void *p = ::mmap(
+			nullptr, br_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0
+		);
+		throw_posix_errno_if(p == MAP_FAILED);
+		br = static_cast<io_uring_buf_ring*>(p);
+		std::memset(br, 0, br_size);
+
+		io_uring_buf_reg reg{};
+		reg.ring_addr = reinterpret_cast<uint64_t>(br);
+		reg.ring_entries = entries;
+		reg.bgid = group;
+		if(::syscall(__NR_io_uring_register, ring.get_handle(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			int err = errno;
+			::munmap(br, br_size);
+			throw posix_error("IORING_REGISTER_PBUF_RING", err);
+		}
+
+		buffers = new char[size_t(entries) * buffer_size];
+		for(unsigned i = 0; i < entries; ++i) {
+			recycle(i);
+		}
+	}
+
+	BufferRing::~BufferRing() {
+		io_uring_buf_reg reg{};
+		reg.bgid = group;
+		::syscall(__NR_io_uring_register, ring.get_handle(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		::munmap(br, br_size);
+		delete[] buffers;
+	}
+
+	void BufferRing::recycle(unsigned id) {
+		// Set each field on its own. The tail shares memory with the
+		// reserved field of the first entry. Index the memory directly:
+		// the bufs flexible array member is at the wrong offset in C++
+		// where its empty struct wrapper takes a byte.
+		io_uring_buf &b = reinterpret_cast<io_uring_buf*>(br)[tail & (entries - 1)];
+		b.addr = reinterpret_cast<uint64_t>(data(id));
+		b.len = buffer_size;
+		b.bid = id;
+		++tail;
+		__atomic_store_n(&br->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	UringSockets::UringSockets():
+		Sockets(nullptr),
+		ring(ring_entries),
+		recv_ring(ring, recv_group, recv_buffers, Connection::io_block_size)
+	{
+		// Multishot receive came with the same kernel as zero copy send,
+		// which the probe can see.
+		for(unsigned op: {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC}) {
+			if(!ring.supports(op))
+				throw std::runtime_error("io_uring kernel lacks multishot receive");
+		}
+		direct_writes = false;
+	}
+
+	UringSockets::State& UringSockets::state(unsigned h) {
+		if(states.size() <= h)
+			states.resize(h+1);
+		return states[h];
+	}
+
+	size_t UringSockets::in_flight(const Connection &c) const {
+		unsigned h = c.get_handle();
+		return h < states.size() ? states[h].sending.size() : 0;
+	}
+
+	Socket* UringSockets::find(unsigned h) {
+		if(h < sockets.size())
+			return sockets[h].get();
+		return nullptr;
+	}
+
+	void UringSockets::add_socket(ptr p, PollEvents events) {
+		unsigned h = p->get_handle();
+		bool listener = dynamic_cast<Listener*>(p.get());
+		if(!listener && !dynamic_cast<Connection*>(p.get()))
+			throw std::logic_error("UringSockets only handles Listeners and Connections");
+		p->events = events;
+		insert_socket(std::move(p));
+		state(h) = State();
+		if(listener)
+			arm_accept(h);
+		else
+			arm_recv(h);
+	}
+
+	void UringSockets::set_write_event(Socket &s) {
+		State &st = state(s.get_handle());
+		if(!st.flush_queued) {
+			st.flush_queued = true;
+			flush_list.push_back(s.get_handle());
+		}
+	}
+
+	void UringSockets::clear_write_event(Socket&) {
+		// Sends are only submitted when there is output.
+	}
+
+	void UringSockets::remove_socket(unsigned h) {
+		State &st = state(h);
+		--socket_count;
+		timers.cancel(sockets.at(h)->timer);
+		if(st.pending == 0) {
+			sockets.at(h).reset();
+			st = State();
+			return;
+		}
+		// Keep the Socket and its handle open until the kernel is done
+		// with them.
+		st.removed = std::move(sockets.at(h));
+		++removed_count;
+		io_uring_sqe *sqe = ring.get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = h;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = user_data(Cancel, h);
+	}
+
+	void UringSockets::release(unsigned h) {
+		State &st = state(h);
+		if(st.removed && st.pending == 0) {
+			ptr p = std::move(st.removed);
+			st = State();
+			--removed_count;
+		}
+	}
+
+	bool UringSockets::active() const {
+		return socket_count > 0 || removed_count > 0;
+	}
+
+	void UringSockets::arm_accept(unsigned h) {
+		io_uring_sqe *sqe = ring.get_sqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = h;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = user_data(Accept, h);
+		++state(h).pending;
+	}
+
+	void UringSockets::arm_recv(unsigned h) {
+		io_uring_sqe *sqe = ring.get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = h;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = recv_ring.group;
+		sqe->user_data = user_data(Recv, h);
+		++state(h).pending;
+	}
+
+	void UringSockets::send_output(unsigned h, Connection &c) {
+		State &st = state(h);
+		if(st.sending.empty()) {
+			// Files are read into output as it empties.
+			if(c.output.empty() && c.sending_file())
+				c.read_file();
+			if(c.output.empty()) {
+				st.sending.release();
+				if(c.closing)
+					::shutdown(h, SHUT_WR);
+				return;
+			}
+			// Take the collected output and give Connection the old
+			// buffer to fill.
+			swap(st.sending, c.output);
+		}
+		st.msg = msghdr();
+		st.msg.msg_iov = st.iov.data();
+		st.msg.msg_iovlen = st.sending.fill(st.iov.data(), st.iov.size());
+		io_uring_sqe *sqe = ring.get_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = h;
+		sqe->addr = reinterpret_cast<uint64_t>(&st.msg);
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = user_data(Send, h);
+		st.send_active = true;
+		++st.pending;
+	}
+
+	void UringSockets::flush() {
+		for(unsigned h: flush_list) {
+			State &st = state(h);
+			st.flush_queued = false;
+			Socket *s = find(h);
+			if(s && !st.send_active)
+				send_output(h, static_cast<Connection&>(*s));
+		}
+		flush_list.clear();
+	}
+
+	void UringSockets::poll() {
+		// Everything written during the last round goes to the kernel
+		// in the same call as the wait.
+		flush();
+		ring.submit_and_wait(wait_timeout());
+		update_clock();
+		uint64_t start = ticks();
+
+		ring.for_each_cqe([&](const io_uring_cqe &cqe) {
+			complete(cqe);
+		});
+
+		// When shutting down stop accepting.
+		if(!running && !shutdown_started) {
+			shutdown_started = true;
+			for(unsigned h = 0; h < sockets.size(); ++h) {
+				if(dynamic_cast<Listener*>(sockets[h].get()))
+					remove_socket(h);
+			}
+		}
+
+		expire_timers();
+		thread_metrics().record(Latency::Poll, ticks() - start);
+	}
+
+	void UringSockets::complete(const io_uring_cqe &cqe) {
+		unsigned h = static_cast<uint32_t>(cqe.user_data);
+		try {
+			switch(static_cast<Op>(cqe.user_data >> 32)) {
+				case Accept:
+					on_accept_done(h, cqe);
+					break;
+				case Recv:
+					on_recv_done(h, cqe);
+					break;
+				case Send:
+					on_send_done(h, cqe);
+					break;
+				case Cancel:
+					break;
+			}
+		} catch( const std::exception &e ) {
+			LOG(Warning)
+				<< "exception while processing handle " << h
+				<< ": " << e.what();
+			// Some bad thing happened so shut it off.
+			if(find(h))
+				remove_socket(h);
+		}
+		release(h);
+	}
+
+	void UringSockets::on_accept_done(unsigned h, const io_uring_cqe &cqe) {
+		bool more = cqe.flags & IORING_CQE_F_MORE;
+		if(!more)
+			--state(h).pending;
+		auto listener = static_cast<Listener*>(find(h));
+		if(cqe.res >= 0) {
+			if(!listener) {
+				::close(cqe.res);
+				return;
+			}
+			// Multishot accept has no per connection address, so ask
+			// the socket for it.
+			Listener::AcceptResult result;
+			result.ok = true;
+			result.handle = cqe.res;
+			socklen_t remote_addr_len = sizeof result.remote_addr;
+			if(::getpeername(cqe.res, reinterpret_cast<sockaddr*>(&result.remote_addr), &remote_addr_len) < 0)
+				listener->zero_addr(result.remote_addr);
+			thread_metrics().add(Counter::Accepts);
+			listener->on_accept(result);
+		} else if(cqe.res != -ECANCELED) {
+			LOG(Warning) << "accept error on handle " << h << ": " << -cqe.res;
+		}
+		if(!more && listener && running)
+			arm_accept(h);
+	}
+
+	void UringSockets::on_recv_done(unsigned h, const io_uring_cqe &cqe) {
+		bool more = cqe.flags & IORING_CQE_F_MORE;
+		if(!more)
+			--state(h).pending;
+		auto c = static_cast<Connection*>(find(h));
+		if(cqe.flags & IORING_CQE_F_BUFFER) {
+			unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+			if(c && cqe.res > 0) {
+				const char *p = recv_ring.data(id);
+				c->input.append(p, p + cqe.res);
+			}
+			recv_ring.recycle(id);
+		}
+		if(!c)
+			return;
+
+		Socket::Action act = Socket::KEEP;
+		if(cqe.res > 0) {
+			if(c->timeout)
+				c->timeout_expiration = now_ms + c->timeout;
+			thread_metrics().add(Counter::BytesIn, cqe.res);
+			act = c->on_received();
+			c->release_buffers();
+		} else if(cqe.res == 0) {
+			LOG(Debug) << "end of file on handle " << h;
+			act = Socket::REMOVE;
+		} else {
+			switch(-cqe.res) {
+				case ENOBUFS:
+					// Every receive buffer was in use. Arm it again.
+				case ECANCELED:
+					break;
+				case ECONNRESET:
+				case ETIMEDOUT:
+					act = Socket::REMOVE;
+					break;
+				default:
+					throw posix_error("recv on handle " + std::to_string(h), -cqe.res);
+			}
+		}
+		if(act != Socket::KEEP)
+			remove_socket(h);
+		else if(!more)
+			arm_recv(h);
+	}
+
+	void UringSockets::on_send_done(unsigned h, const io_uring_cqe &cqe) {
+		State &st = state(h);
+		--st.pending;
+		st.send_active = false;
+		auto c = static_cast<Connection*>(find(h));
+		if(!c)
+			return;
+		if(cqe.res < 0) {
+			if(cqe.res == -EPIPE || cqe.res == -ECONNRESET) {
+				LOG(Debug) << "output closed on handle " << h;
+				remove_socket(h);
+				return;
+			}
+			throw posix_error("send on handle " + std::to_string(h), -cqe.res);
+		}
+		st.sending.consume(cqe.res);
+		c->sent(cqe.res);
+		if(c->timeout)
+			c->timeout_expiration = now_ms + c->timeout;
+		send_output(h, *c);
+		if(c->resume_input() != Socket::KEEP)
+			remove_socket(h);
+	}
+};
@@ -0,0 +1,172 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <vector>
+#include <linux/io_uring.h>
+#include "sockets.h"
+
+namespace zlynx {
+	// A minimal io_uring instance using the raw system calls.
+	class Uring {
+		public:
+		explicit Uring(unsigned entries);
+		~Uring();
+		Uring(const Uring&) = delete;
+		void operator=(const Uring&) = delete;
+
+		// Get a zeroed submission entry. Submits the queue first if it
+		// is full.
+		io_uring_sqe* get_sqe();
+
+		// Submit everything queued and wait up to timeout_ms for at
+		// least one completion. A negative timeout waits for ever.
+		// Returns false if interrupted or timed out.
+		bool submit_and_wait(int timeout_ms);
+
+		// Call f for each available completion and mark them seen.
+		template<class F>
+		void for_each_cqe(F f) {
+			unsigned head = *cq_head;
+			unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			while(head != tail) {
+				f(cqes[head & cq_mask]);
+				++head;
+				// The handler may have filled the submission queue
+				// which also reaps completions, so publish progress
+				// as we go.
+				__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+				tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			}
+		}
+
+		bool supports(unsigned op) const;
+		int get_handle() const { return handle; }
+
+		private:
+		int handle = -1;
+		io_uring_params params{};
+
+		void *sq_ring = nullptr;
+		size_t sq_ring_size = 0;
+		void *cq_ring = nullptr;
+		size_t cq_ring_size = 0;
+		io_uring_sqe *sqes = nullptr;
+		size_t sqes_size = 0;
+
+		unsigned *sq_head;
+		unsigned *sq_tail;
+		unsigned sq_mask;
+		unsigned sq_entries;
+		unsigned *cq_head;
+		unsigned *cq_tail;
+		unsigned cq_mask;
+		io_uring_cqe *cqes;
+
+		// Local tail and the count not yet passed to io_uring_enter.
+		unsigned sqe_tail = 0;
+		unsigned to_submit = 0;
+		std::vector<uint8_t> supported_ops;
+
+		int enter(unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_size);
+		void submit();
+	};
+
+	// A ring of fixed size receive buffers registered with the kernel.
+	// Multishot receives pick a buffer from it for each completion.
+	class BufferRing {
+		public:
+		BufferRing(Uring &ring, uint16_t group, unsigned entries, unsigned size);
+		~BufferRing();
+		BufferRing(const BufferRing&) = delete;
+		void operator=(const BufferRing&) = delete;
+
+		const char* data(unsigned id) const { return buffers + size_t(id) * buffer_size; }
+		// Give a buffer back to the kernel after its data is used.
+		void recycle(unsigned id);
+
+		uint16_t group;
+
+		private:
+		Uring &ring;
+		unsigned entries;
+		unsigned buffer_size;
+		io_uring_buf_ring *br = nullptr;
+		size_t br_size = 0;
+		char *buffers = nullptr;
+		uint16_t tail = 0;
+	};
+
+	// Sockets engine built on io_uring.
+	// Listeners use multishot accept, Connections use multishot receive
+	// into a BufferRing, and output is sent with one submission per
+	// Connection per loop which all go to the kernel in a single
+	// io_uring_enter along with the wait.
+	class UringSockets : public Sockets {
+		public:
+		UringSockets();
+
+		void add_socket(ptr p, PollEvents events = Read) override;
+		void set_write_event(Socket &s) override;
+		void clear_write_event(Socket &s) override;
+		size_t in_flight(const Connection &c) const override;
+
+		protected:
+		void remove_socket(unsigned h) override;
+		bool active() const override;
+		void poll() override;
+
+		private:
+		enum Op : uint8_t {
+			Accept,
+			Recv,
+			Send,
+			Cancel
+		};
+
+		// Engine state for each handle, indexed like sockets.
+		struct State {
+			// Operations the kernel still holds for the handle.
+			unsigned pending = 0;
+			bool send_active = false;
+			bool flush_queued = false;
+			// Output handed to the kernel. Connection::output keeps
+			// collecting new writes while this is in flight.
+			OutputQueue sending;
+			// The sendmsg arguments for sending. States never move so
+			// the kernel can read them until the send completes.
+			msghdr msg;
+			std::array<iovec, Connection::io_max_iovecs> iov;
+			// Removed sockets stay here until pending is zero because
+			// the kernel may still use their memory.
+			ptr removed;
+		};
+
+		static constexpr unsigned ring_entries = 1024;
+		static constexpr unsigned recv_buffers = 256;
+		static constexpr uint16_t recv_group = 0;
+
+		Uring ring;
+		BufferRing recv_ring;
+		std::deque<State> states;
+		std::vector<unsigned> flush_list;
+		size_t removed_count = 0;
+
+		static uint64_t user_data(Op op, unsigned h) { return (uint64_t(op) << 32) | h; }
+
+		State& state(unsigned h);
+		Socket* find(unsigned h);
+
+		void arm_accept(unsigned h);
+		void arm_recv(unsigned h);
+		void send_output(unsigned h, Connection &c);
+		void flush();
+
+		void complete(const io_uring_cqe &cqe);
+		void on_accept_done(unsigned h, const io_uring_cqe &cqe);
+		void on_recv_done(unsigned h, const io_uring_cqe &cqe);
+		void on_send_done(unsigned h, const io_uring_cqe &cqe);
+		void release(unsigned h);
+	};
+};
@@ -0,0 +1,71 @@
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <gtest/gtest.h>
+#include "app.h"
+#include "loopback.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	struct App {
+		Datastore store;
+		std::shared_ptr<DocumentRoot> documents = std::make_shared<DocumentRoot>(
+			"/static/", std::filesystem::temp_directory_path().string(), 16
+		);
+		test::Loopback loopback;
+		std::shared_ptr<test::Driven<AppConnection>> c = std::make_shared<test::Driven<AppConnection>>(
+			loopback, 0, 0, HTTPLimits(), &store, documents
+		);
+	};
+
+	// The head of a PUT or POST with a body too large to be buffered.
+	std::string large(std::string_view request, std::string_view headers = ""sv) {
+		return std::string(request) + " HTTP/1.1\r\n" + std::string(headers) +
+			"Content-Length: 1000000\r\nExpect: 100-continue\r\n\r\n";
+	}
+}
+
+TEST(AppConnection, StreamsALargeBodyIntoTheStore) {
+	App app;
+	app.c->feed(large("PUT /k"));
+	EXPECT_EQ(app.c->response(), "HTTP/1.1 100 Continue\r\n\r\n");
+	std::string body(1000000, 'x');
+	for(size_t i = 0; i < body.size(); i += 100000)
+		app.c->feed(std::string_view(body).substr(i, 100000));
+	EXPECT_EQ(app.c->response().substr(0, 22), "HTTP/1.1 201 Created\r\n");
+	EXPECT_EQ(app.store.get("/k").body, body);
+	EXPECT_FALSE(app.c->closing);
+}
+
+TEST(AppConnection, AnswersFromTheHeadWithoutReadingTheBody) {
+	for(auto [request, status]: {
+		std::pair{large("PUT /static/x"), "HTTP/1.1 405 Method Not Allowed\r\n"sv},
+		std::pair{large("POST /static/x"), "HTTP/1.1 405 Method Not Allowed\r\n"sv},
+		std::pair{large("PUT /k", "Cache-Control: max-age=x\r\n"), "HTTP/1.1 400 Bad Request\r\n"sv},
+		std::pair{large("POST /_snapshot"), "HTTP/1.1 404 Not Found\r\n"sv},
+		std::pair{
+			"PUT /k HTTP/1.1\r\nCache-Control: max-age=-1\r\nTransfer-Encoding: chunked\r\n\r\n"s,
+			"HTTP/1.1 400 Bad Request\r\n"sv
+		},
+	}) {
+		App app;
+		app.c->feed(request);
+		std::string out = app.c->response();
+		// No 100 Continue asks for the body.
+		EXPECT_EQ(out.substr(0, status.size()), status) << request;
+		EXPECT_NE(out.find("Connection: close\r\n"), out.npos) << request;
+		EXPECT_TRUE(app.c->closing) << request;
+		EXPECT_TRUE(app.store.get("/k").body.empty());
+	}
+}
+
+TEST(AppConnection, RefusesAnUploadOverTheBudget) {
+	App app;
+	app.store.set_upload_budget(100000);
+	app.c->feed(large("PUT /k"));
+	EXPECT_EQ(app.c->response().substr(0, 34), "HTTP/1.1 503 Service Unavailable\r\n");
+	EXPECT_TRUE(app.c->closing);
+}
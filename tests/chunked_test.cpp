@@ -0,0 +1,230 @@
+#include <memory>
+#include <string>
+#include <string_view>
+#include <gtest/gtest.h>
+#include "http.h"
+#include "loopback.h"
+#include "parser.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	// A head and a chunked body as they would sit in input.
+	struct Decoding {
+		IOBuffer input;
+		ChunkedDecoder decoder;
+		static constexpr auto head = "PUT / HTTP/1.1\r\n\r\n"sv;
+
+		explicit Decoding(size_t max_size = SIZE_MAX):
+			decoder(max_size)
+		{
+			add(head);
+		}
+
+		void add(std::string_view data) {
+			input.append(data.data(), data.data() + data.size());
+		}
+
+		ChunkedDecoder::Result decode() {
+			return decoder.decode(input, head.size());
+		}
+
+		std::string_view body() const {
+			return std::string_view(input.data() + head.size(), decoder.size());
+		}
+	};
+
+	constexpr auto encoded =
+		"5\r\nhello\r\n"
+		"1;name=value\r\n \r\n"
+		"A \r\n0123456789\r\n"
+		"0\r\n"
+		"Trailer: yes\r\n"
+		"\r\n"sv;
+
+	// Records each request body it is given.
+	class BodyConnection : public HTTPConnection {
+		public:
+		using HTTPConnection::HTTPConnection;
+		std::string body;
+
+		protected:
+		void on_put() override {
+			body = std::string(body_view);
+			write_status("204 No Content");
+			write_body();
+		}
+	};
+
+	// Takes the body in pieces, up to limit bytes.
+	class StreamConnection : public HTTPConnection {
+		public:
+		using HTTPConnection::HTTPConnection;
+		using HTTPConnection::input;
+		std::string body;
+		size_t pieces = 0;
+		size_t length = 0;
+		size_t limit = SIZE_MAX;
+
+		protected:
+		bool on_body_start() override { return true; }
+		void on_body(std::string_view data) override {
+			body.append(data);
+			++pieces;
+			if(body.size() > limit)
+				write_error("503 Service Unavailable");
+		}
+		void on_put() override {
+			length = content_length;
+			write_status("204 No Content");
+			write_body();
+		}
+	};
+}
+
+TEST(ChunkedDecoder, DecodesInPlace) {
+	Decoding d;
+	d.add(encoded);
+	d.add("GET /next"sv);
+	ASSERT_EQ(d.decode(), RequestParser::Complete);
+	EXPECT_EQ(d.body(), "hello 0123456789"sv);
+	// The framing is gone and what follows the body is kept after it.
+	EXPECT_EQ(std::string_view(d.input.data(), d.input.size()).substr(Decoding::head.size()), "hello 0123456789GET /next"sv);
+}
+
+TEST(ChunkedDecoder, DecodesOneByteAtATime) {
+	Decoding d;
+	ChunkedDecoder::Result r = RequestParser::Incomplete;
+	for(char c: encoded) {
+		d.add(std::string_view(&c, 1));
+		r = d.decode();
+		if(r != RequestParser::Incomplete)
+			break;
+	}
+	ASSERT_EQ(r, RequestParser::Complete);
+	EXPECT_EQ(d.body(), "hello 0123456789"sv);
+	EXPECT_EQ(d.input.size(), Decoding::head.size() + d.body().size());
+}
+
+TEST(ChunkedDecoder, AcceptsAnEmptyBody) {
+	Decoding d;
+	d.add("0\r\n\r\n"sv);
+	ASSERT_EQ(d.decode(), RequestParser::Complete);
+	EXPECT_EQ(d.decoder.size(), 0u);
+}
+
+TEST(ChunkedDecoder, RejectsBadFraming) {
+	for(auto body: {
+		"x\r\n"sv,
+		"\r\n"sv,
+		"5 x\r\nhello\r\n0\r\n\r\n"sv,
+		"5\r\nhelloX\r\n0\r\n\r\n"sv,
+	}) {
+		Decoding d;
+		d.add(body);
+		EXPECT_EQ(d.decode(), RequestParser::Error) << body;
+		EXPECT_EQ(d.decoder.error(), "400 Bad Request"sv) << body;
+	}
+}
+
+TEST(ChunkedDecoder, RejectsALongSizeLine) {
+	Decoding d;
+	d.add("1;" + std::string(ChunkedDecoder::max_line_size, 'x'));
+	EXPECT_EQ(d.decode(), RequestParser::Error);
+}
+
+TEST(ChunkedDecoder, RejectsMoreThanTheLimit) {
+	Decoding d(8);
+	d.add("5\r\nhello\r\n5\r\nworld\r\n"sv);
+	ASSERT_EQ(d.decode(), RequestParser::Error);
+	EXPECT_EQ(d.decoder.error(), "413 Content Too Large"sv);
+}
+
+TEST(ChunkedDecoder, RejectsAnOverflowingSize) {
+	Decoding d;
+	d.add("10000000000000000\r\n"sv);
+	ASSERT_EQ(d.decode(), RequestParser::Error);
+	EXPECT_EQ(d.decoder.error(), "413 Content Too Large"sv);
+}
+
+TEST(HTTPConnection, ReadsAChunkedRequestBody) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<BodyConnection>>(l);
+	c->feed("PUT /k HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel"sv);
+	EXPECT_EQ(c->body, "");
+	c->feed("lo\r\n0\r\n\r\n"sv);
+	EXPECT_EQ(c->body, "hello");
+	EXPECT_EQ(c->response(), "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n");
+}
+
+TEST(HTTPConnection, RefusesChunkedWithContentLength) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<BodyConnection>>(l);
+	c->feed("PUT /k HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n"sv);
+	EXPECT_EQ(c->response().substr(0, 24), "HTTP/1.1 400 Bad Request");
+	EXPECT_TRUE(c->closing);
+}
+
+TEST(HTTPConnection, SendsAChunkedResponse) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<HTTPConnection>>(l);
+	c->feed("GET /_stats HTTP/1.1\r\n\r\n"sv);
+	std::string out = c->response();
+	size_t end = out.find("\r\n\r\n");
+	ASSERT_NE(end, out.npos);
+	std::string_view head = std::string_view(out).substr(0, end);
+	EXPECT_NE(head.find("Transfer-Encoding: chunked"), head.npos);
+	EXPECT_EQ(head.find("Content-Length"), head.npos);
+
+	// The body decodes to the metrics and ends with the last chunk.
+	Decoding d;
+	d.add(std::string_view(out).substr(end + 4));
+	ASSERT_EQ(d.decode(), RequestParser::Complete);
+	EXPECT_EQ(d.body().substr(0, 7), "# HELP "sv);
+	EXPECT_EQ(out.substr(out.size() - 5), "0\r\n\r\n");
+	EXPECT_FALSE(c->closing);
+}
+
+TEST(HTTPConnection, SendsHTTP10TheBodyUntilClose) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<HTTPConnection>>(l);
+	c->feed("GET /_stats HTTP/1.0\r\n\r\n"sv);
+	std::string out = c->response();
+	EXPECT_EQ(out.find("Transfer-Encoding"), out.npos);
+	EXPECT_NE(out.find("Connection: close\r\n\r\n# HELP "), out.npos);
+	EXPECT_TRUE(c->closing);
+}
+
+TEST(HTTPConnection, StreamsAChunkedRequestBody) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<StreamConnection>>(l);
+	c->feed("PUT /k HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"sv);
+	std::string sent;
+	for(int i = 0; i < 100; ++i) {
+		std::string chunk(1000, char('a' + i % 26));
+		sent += chunk;
+		c->feed("3e8\r\n" + chunk + "\r\n");
+		// Nothing of the body is kept in input.
+		EXPECT_EQ(c->input.size(), "PUT /k HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"sv.size());
+	}
+	c->feed("0\r\n\r\nGET"sv);
+	EXPECT_EQ(c->body, sent);
+	EXPECT_EQ(c->pieces, 100u);
+	EXPECT_EQ(c->length, sent.size());
+	EXPECT_EQ(c->response(), "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n");
+	EXPECT_EQ(std::string_view(c->input.data(), c->input.size()), "GET"sv);
+}
+
+TEST(HTTPConnection, StopsAStreamedBodyTheHandlerRefuses) {
+	test::Loopback l;
+	auto c = std::make_shared<test::Driven<StreamConnection>>(l);
+	c->limit = 1500;
+	c->feed("PUT /k HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"sv);
+	for(int i = 0; i < 4; ++i)
+		c->feed("3e8\r\n" + std::string(1000, 'x') + "\r\n");
+	EXPECT_EQ(c->body.size(), 2000u);
+	EXPECT_EQ(c->length, 0u);
+	EXPECT_TRUE(c->closing);
+	EXPECT_EQ(c->response().substr(0, 34), "HTTP/1.1 503 Service Unavailable\r\n");
+}
@@ -0,0 +1,301 @@
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+#include "datastore.h"
+#include "headers.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	std::string key(int i) { return "key" + std::to_string(i); }
+
+	// As the store reads it. time() may lag it by up to a second.
+	int64_t wall_clock() {
+		timespec ts;
+		::clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec;
+	}
+
+	Entry text(std::string_view body) {
+		Entry e;
+		e.content_type = "text/plain"sv;
+		e.body = body;
+		return e;
+	}
+}
+
+TEST(Datastore, SetGetDel) {
+	Datastore store;
+	EXPECT_FALSE(store.set("a", text("one")));
+	EXPECT_TRUE(store.set("a", text("two")));
+	Entry e = store.get("a");
+	EXPECT_EQ(e.body, "two"sv);
+	EXPECT_EQ(e.content_type, "text/plain"sv);
+	EXPECT_EQ(e.response_head.substr(0, 17), "HTTP/1.1 200 OK\r\n"sv);
+	store.del("a");
+	EXPECT_TRUE(store.get("a").body.empty());
+}
+
+TEST(Datastore, CacheSizeBoundsResidentBytes) {
+	Datastore store;
+	constexpr size_t cache = 256 * 1024;
+	store.set_cache_size(cache);
+	std::string body(1000, 'x');
+	for(int i = 0; i < 2000; ++i) {
+		store.set(key(i), text(body));
+		ASSERT_LE(store.resident_bytes(), cache) << i;
+	}
+	int found = 0;
+	for(int i = 0; i < 2000; ++i)
+		found += !store.get(key(i)).body.empty();
+	EXPECT_GT(found, 0);
+	EXPECT_LT(found, 2000);
+	// The newest key has not been passed by the hand yet.
+	EXPECT_EQ(store.get(key(1999)).body, body);
+}
+
+TEST(Datastore, EvictionSparesKeysBeingRead) {
+	Datastore store;
+	store.set_cache_size(128 * 1024);
+	std::string body(1000, 'x');
+	store.set("hot", text(body));
+	for(int i = 0; i < 2000; ++i) {
+		store.set(key(i), text(body));
+		ASSERT_EQ(store.get("hot").body, body) << i;
+	}
+}
+
+TEST(Datastore, ShrinkingTheCacheEvictsAtOnce) {
+	Datastore store;
+	std::string body(1000, 'x');
+	for(int i = 0; i < 500; ++i)
+		store.set(key(i), text(body));
+	size_t before = store.resident_bytes();
+	EXPECT_GT(before, 500 * body.size());
+	store.set_cache_size(before / 4);
+	EXPECT_LE(store.resident_bytes(), before / 4);
+	// No limit again.
+	store.set_cache_size(0);
+	for(int i = 0; i < 500; ++i)
+		store.set(key(i), text(body));
+	EXPECT_GE(store.resident_bytes(), before);
+}
+
+TEST(Datastore, EvictedValuesOutliveTheirReaders) {
+	Datastore store;
+	store.set_cache_size(64 * 1024);
+	std::string body(1000, 'y');
+	store.set("first", text(body));
+	Entry e = store.get("first");
+	for(int i = 0; i < 1000; ++i)
+		store.set(key(i), text(std::string(1000, 'x')));
+	ASSERT_TRUE(store.get("first").body.empty());
+	// The view is still held by owner.
+	EXPECT_EQ(e.body, body);
+}
+
+TEST(Datastore, ModifiedDefaultsToTheClock) {
+	Datastore store;
+	int64_t before = wall_clock();
+	store.set("a", text("x"));
+	int64_t after = wall_clock();
+	Entry e = store.get("a");
+	EXPECT_GE(e.modified, before);
+	EXPECT_LE(e.modified, after);
+	EXPECT_EQ(e.last_modified, format_http_date(e.modified));
+}
+
+TEST(Datastore, ExpiredValuesAreNotFound) {
+	Datastore store;
+	// Not yet expired, so the expiry thread leaves it.
+	int64_t now = wall_clock();
+	Entry e = text("x");
+	e.modified = now;
+	e.max_age = 10;
+	store.set("a", e);
+	EXPECT_TRUE(store.get("a", Encoding::Identity, now + 100).body.empty());
+	EXPECT_TRUE(store.get("a", Encoding::Identity, now + 10).body.empty());
+	EXPECT_EQ(store.get("a", Encoding::Identity, now + 9).body, "x"sv);
+	// Zero is no time at all.
+	Entry found = store.get("a");
+	EXPECT_EQ(found.body, "x"sv);
+	EXPECT_EQ(found.max_age, 10);
+	EXPECT_NE(found.response_head.find("Cache-Control: max-age=10\r\n"), found.response_head.npos);
+}
+
+TEST(Datastore, ReplacingAnExpiredValueIsNotAReplace) {
+	Datastore store;
+	Entry e = text("x");
+	e.modified = wall_clock() - 100;
+	e.max_age = 10;
+	store.set("a", e);
+	EXPECT_FALSE(store.set("a", text("y")));
+	EXPECT_TRUE(store.set("a", text("z")));
+}
+
+TEST(Datastore, ExpiredValuesAreRemoved) {
+	Datastore store;
+	size_t empty = store.resident_bytes();
+	// Expiring at least a second after it is stored, so it is there
+	// to be seen first.
+	std::string body(10000, 'x');
+	Entry e = text(body);
+	e.modified = wall_clock();
+	e.max_age = 2;
+	store.set("a", e);
+	EXPECT_GT(store.resident_bytes(), empty + 10000);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(store.resident_bytes() > empty && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_EQ(store.resident_bytes(), empty);
+}
+
+TEST(Datastore, UploadsOfUnknownSize) {
+	Datastore store;
+	auto upload = store.start_upload("text/plain", Datastore::unknown_size, 60);
+	ASSERT_TRUE(upload);
+	std::string body;
+	for(int i = 0; i < 1000; ++i) {
+		std::string part(100, char('a' + i % 26));
+		body += part;
+		ASSERT_TRUE(upload.append(part));
+	}
+	EXPECT_FALSE(store.set("a", std::move(upload)));
+	Entry e = store.get("a");
+	EXPECT_EQ(e.body, body);
+	EXPECT_EQ(e.max_age, 60);
+	EXPECT_NE(e.response_head.find("Content-Length: 100000\r\n"), e.response_head.npos);
+}
+
+TEST(Datastore, UploadsOfUnknownSizeAreHeldToTheBudget) {
+	Datastore store;
+	store.set_upload_budget(64 * 1024);
+	auto first = store.start_upload("text/plain", 32 * 1024);
+	auto second = store.start_upload("text/plain", Datastore::unknown_size);
+	ASSERT_TRUE(first);
+	ASSERT_TRUE(second);
+	std::string part(1000, 'x');
+	int appended = 0;
+	while(appended < 100 && second.append(part))
+		++appended;
+	EXPECT_GT(appended, 10);
+	EXPECT_LT(appended, 33);
+	// Given back when the upload goes.
+	second = Datastore::Upload();
+	EXPECT_TRUE(store.start_upload("text/plain", 32 * 1024));
+}
+
+namespace {
+	// A body that says which key and version it is, and can be checked
+	// whole: "key|n|" then a length and letter that follow from n.
+	std::string versioned(const std::string &key, unsigned n) {
+		return key + '|' + std::to_string(n) + '|' + std::string(100 + n % 900, char('a' + n % 26));
+	}
+
+	bool intact(const std::string &key, const Entry &e) {
+		if(!e.content_encoding.empty())
+			return !e.body.empty();
+		std::string_view body = e.body;
+		if(body.substr(0, key.size() + 1) != key + '|')
+			return false;
+		body.remove_prefix(key.size() + 1);
+		size_t bar = body.find('|');
+		if(bar == body.npos)
+			return false;
+		unsigned n = std::stoul(std::string(body.substr(0, bar)));
+		return
+			e.body == versioned(key, n) &&
+			e.response_head.find("Content-Length: " + std::to_string(e.body.size()) + "\r\n") != e.response_head.npos;
+	}
+}
+
+TEST(Datastore, ConcurrentReadersSeeWholeValues) {
+	// Without and with eviction.
+	for(size_t cache: {size_t(0), size_t(2) << 20}) {
+		Datastore store;
+		store.set_cache_size(cache);
+		store.set_compression(1024, 0);
+		constexpr unsigned keys = 2000;
+		constexpr unsigned writes = 20000;
+		std::atomic<bool> done{false};
+		std::atomic<unsigned> torn{0};
+		std::atomic<unsigned> found{0};
+		std::vector<std::thread> threads;
+
+		// Writers set and delete overlapping keys. One also adds keys
+		// only to delete them, which fills shards with tombstones and
+		// has them rebuilt.
+		for(unsigned w = 0; w < 3; ++w) {
+			threads.emplace_back([&, w] {
+				for(unsigned i = 0; i < writes; ++i) {
+					std::string k = key((i * 7 + w * 13) % keys);
+					if(i % 5 == w)
+						store.del(k);
+					else
+						store.set(k, text(versioned(k, i)));
+				}
+			});
+		}
+		threads.emplace_back([&] {
+			for(unsigned i = 0; i < writes; ++i) {
+				std::string k = "churn" + std::to_string(i);
+				store.set(k, text(versioned(k, i)));
+				store.del(k);
+			}
+		});
+		size_t writers = threads.size();
+
+		// Readers check each value, and a few they keep after the store
+		// has moved on.
+		for(unsigned r = 0; r < 4; ++r) {
+			threads.emplace_back([&, r] {
+				std::vector<std::pair<std::string, Entry>> kept;
+				auto encoding = r % 2 ? Encoding::Gzip : Encoding::Identity;
+				for(unsigned i = r; !done.load(); i += 3) {
+					std::string k = key(i % keys);
+					Entry e = store.get(k, encoding);
+					if(e.body.empty())
+						continue;
+					++found;
+					if(!intact(k, e))
+						++torn;
+					if(i % 64 == 0) {
+						kept.emplace_back(k, e);
+						if(kept.size() > 16)
+							kept.erase(kept.begin());
+					}
+				}
+				for(auto &[k, e]: kept) {
+					if(!intact(k, e))
+						++torn;
+				}
+			});
+		}
+
+		for(size_t i = 0; i < writers; ++i)
+			threads[i].join();
+		done = true;
+		for(size_t i = writers; i < threads.size(); ++i)
+			threads[i].join();
+
+		EXPECT_EQ(torn.load(), 0u) << cache;
+		EXPECT_GT(found.load(), 0u) << cache;
+		// What is left reads back whole.
+		for(unsigned i = 0; i < keys; ++i) {
+			Entry e = store.get(key(i));
+			if(!e.body.empty())
+				EXPECT_TRUE(intact(key(i), e)) << key(i);
+		}
+		for(unsigned i = 0; i < writes; ++i)
+			ASSERT_TRUE(store.get("churn" + std::to_string(i)).body.empty());
+		if(cache)
+			EXPECT_LE(store.resident_bytes(), cache);
+	}
+}
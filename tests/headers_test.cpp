@@ -0,0 +1,67 @@
+#include <string_view>
+#include <gtest/gtest.h>
+#include "headers.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+TEST(HTTPDate, Formats) {
+	EXPECT_EQ(format_http_date(0), "Thu, 01 Jan 1970 00:00:00 GMT");
+	EXPECT_EQ(format_http_date(784111777), "Sun, 06 Nov 1994 08:49:37 GMT");
+	EXPECT_EQ(format_http_date(951782400), "Tue, 29 Feb 2000 00:00:00 GMT");
+	EXPECT_EQ(format_http_date(-1), "Wed, 31 Dec 1969 23:59:59 GMT");
+}
+
+TEST(HTTPDate, ParsesWhatItFormats) {
+	for(int64_t t: {int64_t(0), int64_t(784111777), int64_t(951782400), int64_t(4102444799)}) {
+		int64_t parsed = -1;
+		ASSERT_TRUE(parse_http_date(format_http_date(t), parsed)) << t;
+		EXPECT_EQ(parsed, t);
+	}
+}
+
+TEST(HTTPDate, RejectsOtherForms) {
+	int64_t t;
+	for(auto s: {
+		""sv,
+		"Sunday, 06-Nov-94 08:49:37 GMT"sv,
+		"Sun Nov  6 08:49:37 1994"sv,
+		"Sun, 06 Nov 1994 08:49:37 UTC"sv,
+		"Sun, 06 Now 1994 08:49:37 GMT"sv,
+		"Sun, 00 Nov 1994 08:49:37 GMT"sv,
+		"Sun, 06 Nov 1994 24:49:37 GMT"sv,
+		"Sun, 06 Nov 1994 08:4x:37 GMT"sv,
+		"Sun, 06 Nov 1994 08:49:37 GMT "sv,
+	})
+		EXPECT_FALSE(parse_http_date(s, t)) << s;
+}
+
+TEST(MaxAge, FindsTheDirective) {
+	int64_t s = 0;
+	ASSERT_TRUE(parse_max_age("max-age=60"sv, s));
+	EXPECT_EQ(s, 60);
+	ASSERT_TRUE(parse_max_age("public, Max-Age=\"30\" ,no-transform"sv, s));
+	EXPECT_EQ(s, 30);
+	ASSERT_TRUE(parse_max_age("max-age=0"sv, s));
+	EXPECT_EQ(s, 0);
+}
+
+TEST(MaxAge, NoneIsMinusOne) {
+	int64_t s = 0;
+	ASSERT_TRUE(parse_max_age(""sv, s));
+	EXPECT_EQ(s, -1);
+	ASSERT_TRUE(parse_max_age("no-store, s-maxage=5"sv, s));
+	EXPECT_EQ(s, -1);
+}
+
+TEST(MaxAge, LargeValuesAreCut) {
+	int64_t s = 0;
+	ASSERT_TRUE(parse_max_age("max-age=99999999999999999999999"sv, s));
+	EXPECT_EQ(s, max_delta_seconds);
+}
+
+TEST(MaxAge, RejectsMalformed) {
+	int64_t s;
+	for(auto v: {"max-age"sv, "max-age="sv, "max-age=-1"sv, "max-age=1s"sv, "max-age=\"\""sv})
+		EXPECT_FALSE(parse_max_age(v, s)) << v;
+}
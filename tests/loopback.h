@@ -0,0 +1,95 @@
+#pragma once
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace zlynx::test {
+	// A connected TCP pair on the loopback interface. The server end is
+	// given to a Connection, which closes it. The test reads what the
+	// Connection wrote from the client end.
+	struct Loopback {
+		int server = -1;
+		int client = -1;
+
+		Loopback() {
+			int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			sockaddr_in addr{};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t len = sizeof addr;
+			if(
+				listener < 0 ||
+				::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0 ||
+				::listen(listener, 1) < 0 ||
+				::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) < 0
+			)
+				throw std::runtime_error("loopback listener");
+			client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if(client < 0 || ::connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0)
+				throw std::runtime_error("loopback connect");
+			server = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			::close(listener);
+			if(server < 0)
+				throw std::runtime_error("loopback accept");
+			::fcntl(client, F_SETFL, O_NONBLOCK);
+		}
+		~Loopback() { ::close(client); }
+		Loopback(const Loopback&) = delete;
+		void operator=(const Loopback&) = delete;
+
+		// What has arrived at the client end so far.
+		std::string read_client() {
+			std::string out;
+			std::array<char, 64 * 1024> buf;
+			for(ssize_t n; (n = ::read(client, buf.data(), buf.size())) > 0; )
+				out.append(buf.data(), n);
+			return out;
+		}
+	};
+
+	// A Connection run without a Sockets loop. Input is fed to it
+	// directly, and its response is what it wrote to the socket
+	// followed by what it still has queued.
+	template<class Base>
+	class Driven : public Base {
+		public:
+		template<class... Args>
+		explicit Driven(Loopback &loopback, Args&&... args):
+			Base(loopback.server, sockaddr_in6{}, std::forward<Args>(args)...),
+			loopback(loopback)
+		{
+		}
+
+		void feed(std::string_view data) {
+			this->input.append(data.data(), data.data() + data.size());
+			this->on_received();
+		}
+
+		std::string response() {
+			std::string out = loopback.read_client();
+			std::array<iovec, 64> iov;
+			while(!this->output.empty()) {
+				size_t count = this->output.fill(iov.data(), iov.size());
+				size_t bytes = 0;
+				for(size_t i = 0; i < count; ++i) {
+					out.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+					bytes += iov[i].iov_len;
+				}
+				this->output.consume(bytes);
+			}
+			return out;
+		}
+
+		using Base::closing;
+
+		private:
+		Loopback &loopback;
+	};
+}
@@ -0,0 +1,162 @@
+#include <string>
+#include <string_view>
+#include <gtest/gtest.h>
+#include "parser.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	struct Parsed {
+		IOBuffer input;
+		HeaderTable headers;
+		RequestParser parser;
+
+		// Parse all of text at once.
+		RequestParser::Result parse(std::string_view text) {
+			input.append(text.data(), text.data() + text.size());
+			return parser.parse(input, headers);
+		}
+
+		// Feed text one byte at a time, as if each came in its own read.
+		RequestParser::Result parse_bytes(std::string_view text) {
+			RequestParser::Result r = RequestParser::Incomplete;
+			for(char c: text) {
+				input.append(&c, &c + 1);
+				r = parser.parse(input, headers);
+				if(r != RequestParser::Incomplete)
+					break;
+			}
+			return r;
+		}
+	};
+
+	constexpr auto simple =
+		"GET /a/b?c=d HTTP/1.1\r\n"
+		"Host: example.com\r\n"
+		"Content-Type:  text/plain \r\n"
+		"X-Other: one\r\n"
+		"\r\n"sv;
+}
+
+TEST(RequestParser, ParsesRequestLineAndHeaders) {
+	Parsed p;
+	ASSERT_EQ(p.parse(simple), RequestParser::Complete);
+	EXPECT_EQ(p.parser.method(p.input), "GET"sv);
+	EXPECT_EQ(p.parser.path(p.input), "/a/b?c=d"sv);
+	EXPECT_EQ(p.parser.proto(p.input), "HTTP/1.1"sv);
+	EXPECT_EQ(p.parser.size(), simple.size());
+	EXPECT_EQ(p.headers.get(HeaderId::Host), "example.com"sv);
+	// Surrounding spaces are not part of the value.
+	EXPECT_EQ(p.headers.get(HeaderId::ContentType), "text/plain"sv);
+	EXPECT_EQ(p.headers.get("x-other"sv), "one"sv);
+}
+
+TEST(RequestParser, SameResultOneByteAtATime) {
+	Parsed p;
+	ASSERT_EQ(p.parse_bytes(simple), RequestParser::Complete);
+	EXPECT_EQ(p.parser.path(p.input), "/a/b?c=d"sv);
+	EXPECT_EQ(p.parser.size(), simple.size());
+	EXPECT_EQ(p.headers.get(HeaderId::ContentType), "text/plain"sv);
+}
+
+TEST(RequestParser, LeavesTheBodyAndNextRequest) {
+	Parsed p;
+	ASSERT_EQ(p.parse("GET / HTTP/1.1\r\n\r\nGET /next HTTP/1.1\r\n"sv), RequestParser::Complete);
+	EXPECT_EQ(p.parser.size(), 18u);
+}
+
+TEST(RequestParser, AcceptsBareLineFeeds) {
+	Parsed p;
+	ASSERT_EQ(p.parse("GET / HTTP/1.0\nHost: x\n\n"sv), RequestParser::Complete);
+	EXPECT_EQ(p.parser.proto(p.input), "HTTP/1.0"sv);
+	EXPECT_EQ(p.headers.get(HeaderId::Host), "x"sv);
+}
+
+TEST(RequestParser, IgnoresEmptyLinesBeforeTheRequest) {
+	Parsed p;
+	ASSERT_EQ(p.parse("\r\n\r\nGET / HTTP/1.1\r\n\r\n"sv), RequestParser::Complete);
+	EXPECT_EQ(p.parser.method(p.input), "GET"sv);
+}
+
+TEST(RequestParser, WaitsForTheLineFeedAfterACarriageReturn) {
+	Parsed p;
+	EXPECT_EQ(p.parse("GET / HTTP/1.1\r"sv), RequestParser::Incomplete);
+	EXPECT_EQ(p.parse("\n\r\n"sv), RequestParser::Complete);
+}
+
+TEST(RequestParser, RejectsMalformedHeads) {
+	for(auto text: {
+		"GET / HTTP/1.1\rHost: x\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\nHost: a\x01z\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\nHost: a\x7fz\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\nHost : x\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\nHost: x\r\n folded\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\nNo colon\r\n\r\n"sv,
+		"GET / HTTP/1.1\r\n: empty name\r\n\r\n"sv,
+		"G(T / HTTP/1.1\r\n\r\n"sv,
+		"GET  HTTP/1.1\r\n\r\n"sv,
+		"GET /\r\n\r\n"sv,
+		"GET / HTTP/1.1 \r\n\r\n"sv,
+		"GET / HTTX/1.1\r\n\r\n"sv,
+		"GET / HTTP/1,1\r\n\r\n"sv,
+	}) {
+		Parsed p;
+		EXPECT_EQ(p.parse(text), RequestParser::Error) << text;
+		EXPECT_EQ(p.parser.error(), "400 Bad Request"sv) << text;
+	}
+}
+
+TEST(RequestParser, RejectsOtherMajorVersions) {
+	Parsed p;
+	ASSERT_EQ(p.parse("GET / HTTP/2.0\r\n\r\n"sv), RequestParser::Error);
+	EXPECT_EQ(p.parser.error(), "505 HTTP Version Not Supported"sv);
+}
+
+TEST(RequestParser, RejectsALargeHeadBeforeItEnds) {
+	Parsed p;
+	p.parser = RequestParser(64);
+	std::string head = "GET / HTTP/1.1\r\nX-Long: " + std::string(100, 'a');
+	ASSERT_EQ(p.parse(head), RequestParser::Error);
+	EXPECT_EQ(p.parser.error(), "431 Request Header Fields Too Large"sv);
+}
+
+TEST(RequestParser, RejectsTooManyHeaders) {
+	std::string head = "GET / HTTP/1.1\r\n";
+	for(size_t i = 0; i <= HeaderTable::capacity; ++i) {
+		head += "X-" + std::to_string(i) + ": v\r\n";
+	}
+	head += "\r\n";
+	Parsed p;
+	ASSERT_EQ(p.parse(head), RequestParser::Error);
+	EXPECT_EQ(p.parser.error(), "431 Request Header Fields Too Large"sv);
+}
+
+TEST(RequestParser, ResetsForTheNextRequest) {
+	Parsed p;
+	ASSERT_EQ(p.parse("GET /one HTTP/1.1\r\n\r\nPUT /two HTTP/1.1\r\nHost: y\r\n\r\n"sv), RequestParser::Complete);
+	p.input.consume(p.parser.size());
+	p.parser.reset();
+	p.headers.clear();
+	ASSERT_EQ(p.parser.parse(p.input, p.headers), RequestParser::Complete);
+	EXPECT_EQ(p.parser.method(p.input), "PUT"sv);
+	EXPECT_EQ(p.parser.path(p.input), "/two"sv);
+	EXPECT_EQ(p.headers.get(HeaderId::Host), "y"sv);
+}
+
+TEST(FindControlChar, FindsEveryPositionPastTheVectorWidth) {
+	std::string text(100, 'a');
+	for(size_t i = 0; i < text.size(); ++i) {
+		for(char c: {'\0', '\r', '\n', '\x1f', '\x7f'}) {
+			std::string s = text;
+			s[i] = c;
+			EXPECT_EQ(find_control_char(s.data(), s.data() + s.size()), s.data() + i) << i << ' ' << int(c);
+		}
+	}
+}
+
+TEST(FindControlChar, SkipsTabsAndHighBytes) {
+	std::string s(70, '\t');
+	s += "\x80\xff caf\xc3\xa9";
+	EXPECT_EQ(find_control_char(s.data(), s.data() + s.size()), s.data() + s.size());
+}
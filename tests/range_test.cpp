@@ -0,0 +1,164 @@
+#include <memory>
+#include <string>
+#include <string_view>
+#include <gtest/gtest.h>
+#include "headers.h"
+#include "http.h"
+#include "loopback.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	constexpr auto body = "0123456789abcdef"sv;
+	constexpr auto etag = "\"v1\""sv;
+	constexpr int64_t modified = 1700000000;
+
+	// Serves body with Range support, as Application does.
+	class RangeConnection : public HTTPConnection {
+		public:
+		using HTTPConnection::HTTPConnection;
+		using HTTPConnection::Ranges;
+		using HTTPConnection::max_ranges;
+		Ranges outcome = Ranges::Full;
+		std::vector<ByteRange> found;
+		size_t max = max_ranges;
+
+		protected:
+		void on_get() override {
+			auto last_modified = format_http_date(modified);
+			outcome = find_ranges(body.size(), etag, modified, max);
+			switch(outcome) {
+				case Ranges::Full:
+					write_status("200 OK");
+					write_body(body, nullptr);
+					return;
+				case Ranges::Partial:
+					write_ranges("text/plain", etag, last_modified, body, nullptr);
+					return;
+				case Ranges::Unsatisfiable:
+					write_range_not_satisfiable(body.size());
+					return;
+			}
+		}
+	};
+
+	struct Request {
+		test::Loopback loopback;
+		std::shared_ptr<test::Driven<RangeConnection>> c =
+			std::make_shared<test::Driven<RangeConnection>>(loopback);
+		std::string response;
+
+		explicit Request(std::string_view headers, size_t max = RangeConnection::max_ranges) {
+			c->max = max;
+			c->feed("GET / HTTP/1.1\r\n"s.append(headers).append("\r\n"));
+			response = c->response();
+		}
+
+		RangeConnection::Ranges outcome() const { return c->outcome; }
+		std::string_view content() const {
+			size_t end = response.find("\r\n\r\n");
+			return end == response.npos ? ""sv : std::string_view(response).substr(end + 4);
+		}
+	};
+
+	using Ranges = RangeConnection::Ranges;
+}
+
+TEST(Range, AbsentServesTheWholeBody) {
+	Request r("");
+	EXPECT_EQ(r.outcome(), Ranges::Full);
+	EXPECT_EQ(r.content(), body);
+}
+
+TEST(Range, OneRange) {
+	Request r("Range: bytes=2-5\r\n");
+	ASSERT_EQ(r.outcome(), Ranges::Partial);
+	EXPECT_EQ(r.response.substr(0, 29), "HTTP/1.1 206 Partial Content\r");
+	EXPECT_NE(r.response.find("Content-Range: bytes 2-5/16\r\n"), r.response.npos);
+	EXPECT_NE(r.response.find("Content-Length: 4\r\n"), r.response.npos);
+	EXPECT_EQ(r.content(), "2345");
+}
+
+TEST(Range, OpenAndSuffixRanges) {
+	{
+		Request r("Range: bytes=14-\r\n");
+		EXPECT_EQ(r.content(), "ef");
+	}
+	{
+		Request r("Range: bytes=-3\r\n");
+		EXPECT_EQ(r.content(), "def");
+	}
+	{
+		// More than the body is all of it.
+		Request r("Range: bytes=-100\r\n");
+		EXPECT_EQ(r.content(), body);
+		EXPECT_NE(r.response.find("Content-Range: bytes 0-15/16\r\n"), r.response.npos);
+	}
+	{
+		Request r("Range: bytes=10-99999999999999999999999\r\n");
+		EXPECT_EQ(r.content(), "abcdef");
+	}
+}
+
+TEST(Range, UnitIsCaseInsensitiveAndListsMayHaveGaps) {
+	Request r("Range: Bytes= , 1-1 ,\r\n");
+	ASSERT_EQ(r.outcome(), Ranges::Partial);
+	EXPECT_EQ(r.content(), "1");
+}
+
+TEST(Range, SeveralRangesAreMultipart) {
+	Request r("Range: bytes=0-1, 14-\r\n");
+	ASSERT_EQ(r.outcome(), Ranges::Partial);
+	auto type = "Content-Type: multipart/byteranges; boundary="sv;
+	size_t at = r.response.find(type);
+	ASSERT_NE(at, r.response.npos);
+	std::string boundary = r.response.substr(at + type.size(), 16);
+	std::string expected =
+		"\r\n--" + boundary +
+		"\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/16\r\n\r\n01"
+		"\r\n--" + boundary +
+		"\r\nContent-Type: text/plain\r\nContent-Range: bytes 14-15/16\r\n\r\nef"
+		"\r\n--" + boundary + "--\r\n";
+	EXPECT_EQ(r.content(), expected);
+	EXPECT_NE(r.response.find("Content-Length: " + std::to_string(expected.size()) + "\r\n"), r.response.npos);
+}
+
+TEST(Range, UnsatisfiableRangesGive416) {
+	for(auto header: {"Range: bytes=16-\r\n"sv, "Range: bytes=20-30, -0\r\n"sv}) {
+		Request r(header);
+		EXPECT_EQ(r.outcome(), Ranges::Unsatisfiable) << header;
+		EXPECT_EQ(r.response.substr(0, 35), "HTTP/1.1 416 Range Not Satisfiable\r") << header;
+		EXPECT_NE(r.response.find("Content-Range: bytes */16\r\n"), r.response.npos) << header;
+	}
+}
+
+TEST(Range, MalformedOrForeignIsIgnored) {
+	for(auto header: {
+		"Range: bytes=5-2\r\n"sv,
+		"Range: bytes=x-\r\n"sv,
+		"Range: bytes=1-2-3\r\n"sv,
+		"Range: bytes=,\r\n"sv,
+		"Range: items=1-2\r\n"sv,
+	}) {
+		Request r(header);
+		EXPECT_EQ(r.outcome(), Ranges::Full) << header;
+		EXPECT_EQ(r.content(), body) << header;
+	}
+}
+
+TEST(Range, TooManyRangesServeTheWholeBody) {
+	EXPECT_EQ(Request("Range: bytes=0-0,2-2\r\n", 1).outcome(), Ranges::Full);
+	EXPECT_EQ(Request("Range: bytes=0-0,2-2\r\n", 2).outcome(), Ranges::Partial);
+}
+
+TEST(Range, IfRangeMustMatch) {
+	EXPECT_EQ(Request("Range: bytes=0-0\r\nIf-Range: \"v1\"\r\n").outcome(), Ranges::Partial);
+	EXPECT_EQ(Request("Range: bytes=0-0\r\nIf-Range: \"v2\"\r\n").outcome(), Ranges::Full);
+	// Weak tags never match.
+	EXPECT_EQ(Request("Range: bytes=0-0\r\nIf-Range: W/\"v1\"\r\n").outcome(), Ranges::Full);
+	auto date = format_http_date(modified);
+	EXPECT_EQ(Request("Range: bytes=0-0\r\nIf-Range: " + date + "\r\n").outcome(), Ranges::Partial);
+	date = format_http_date(modified + 1);
+	EXPECT_EQ(Request("Range: bytes=0-0\r\nIf-Range: " + date + "\r\n").outcome(), Ranges::Full);
+}
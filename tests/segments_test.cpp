@@ -0,0 +1,237 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include "segments.h"
+
+using namespace zlynx;
+using namespace std::literals;
+
+namespace {
+	struct TempDir {
+		std::string path;
+
+		TempDir() {
+			std::string t = (std::filesystem::temp_directory_path() / "segments_test.XXXXXX").string();
+			path = ::mkdtemp(t.data());
+		}
+		~TempDir() { std::filesystem::remove_all(path); }
+
+		std::string segment(uint32_t id) const {
+			char name[16];
+			std::snprintf(name, sizeof name, "%08u.seg", unsigned(id));
+			return path + '/' + name;
+		}
+	};
+
+	struct Found {
+		std::string key;
+		std::string body;
+		bool tombstone;
+	};
+
+	std::vector<Found> recover(const std::string &directory) {
+		SegmentLog log(directory);
+		std::vector<Found> found;
+		log.recover([&](const std::shared_ptr<Segment>&, uint64_t, const Record &r) {
+			found.push_back(Found{std::string(r.key), std::string(r.body), r.tombstone});
+		});
+		return found;
+	}
+
+	void write_at(const std::string &path, off_t offset, std::string_view data) {
+		int h = ::open(path.c_str(), O_WRONLY);
+		ASSERT_GE(h, 0);
+		ASSERT_EQ(::pwrite(h, data.data(), data.size(), offset), ssize_t(data.size()));
+		::close(h);
+	}
+
+	// The index a Datastore keeps, enough to relocate records.
+	struct Index {
+		struct Place {
+			std::shared_ptr<Segment> segment;
+			uint64_t offset;
+			uint64_t size;
+		};
+		SegmentLog &log;
+		std::map<std::string, Place> places;
+
+		void set(const std::string &key, std::string_view body) {
+			auto l = log.append(key, "text/plain"sv, ""sv, body);
+			auto old = places.find(key);
+			if(old != places.end())
+				log.discard(*old->second.segment, old->second.size);
+			places[key] = Place{l.segment, l.offset, l.record.size};
+		}
+	};
+
+	// Wait for the background thread, which looks once a second.
+	template<typename F>
+	bool eventually(F done) {
+		for(int i = 0; i < 50; ++i) {
+			if(done())
+				return true;
+			std::this_thread::sleep_for(100ms);
+		}
+		return false;
+	}
+}
+
+TEST(SegmentLog, RecoversRecordsInOrder) {
+	TempDir dir;
+	{
+		SegmentLog log(dir.path);
+		log.recover([](auto&, auto, auto&) {});
+		log.start([](auto&, auto, auto&) {});
+		EXPECT_TRUE(log.empty());
+		log.append("a"sv, "text/plain"sv, "head"sv, "one"sv);
+		log.append("b"sv, "text/plain"sv, "head"sv, "two"sv);
+		log.append("a"sv, ""sv, ""sv, ""sv, true);
+		EXPECT_FALSE(log.empty());
+	}
+	auto found = recover(dir.path);
+	ASSERT_EQ(found.size(), 3u);
+	EXPECT_EQ(found[0].key, "a");
+	EXPECT_EQ(found[0].body, "one");
+	EXPECT_EQ(found[1].key, "b");
+	EXPECT_EQ(found[1].body, "two");
+	EXPECT_EQ(found[2].key, "a");
+	EXPECT_TRUE(found[2].tombstone);
+}
+
+TEST(SegmentLog, CutsATornTail) {
+	TempDir dir;
+	{
+		SegmentLog log(dir.path);
+		log.recover([](auto&, auto, auto&) {});
+		log.start([](auto&, auto, auto&) {});
+		log.append("a"sv, "text/plain"sv, ""sv, "one"sv);
+		log.append("b"sv, "text/plain"sv, ""sv, "two"sv);
+	}
+	auto path = dir.segment(1);
+	auto size = std::filesystem::file_size(path);
+	// Half a header, as if the process died while writing it.
+	write_at(path, size, std::string(16, '\xff'));
+	auto found = recover(dir.path);
+	ASSERT_EQ(found.size(), 2u);
+	EXPECT_EQ(found[1].body, "two");
+	EXPECT_EQ(std::filesystem::file_size(path), size);
+}
+
+TEST(SegmentLog, SkipsARecordWithABadChecksum) {
+	TempDir dir;
+	uint64_t second;
+	{
+		SegmentLog log(dir.path);
+		log.recover([](auto&, auto, auto&) {});
+		log.start([](auto&, auto, auto&) {});
+		log.append("a"sv, "text/plain"sv, ""sv, "one"sv);
+		second = log.append("b"sv, "text/plain"sv, ""sv, "two"sv).offset;
+		log.append("c"sv, "text/plain"sv, ""sv, "three"sv);
+	}
+	auto path = dir.segment(1);
+	// Change a byte of the second body and leave the file not cleanly
+	// closed, so every checksum is checked.
+	write_at(path, second + sizeof(RecordHeader) + 1 + 10, "X"sv);
+	write_at(path, std::filesystem::file_size(path), std::string(8, '\0'));
+	auto found = recover(dir.path);
+	ASSERT_EQ(found.size(), 2u);
+	EXPECT_EQ(found[0].key, "a");
+	EXPECT_EQ(found[1].key, "c");
+}
+
+TEST(SegmentLog, KeepsRecordsAfterAnUnfinishedOne) {
+	TempDir dir;
+	{
+		SegmentLog log(dir.path);
+		log.recover([](auto&, auto, auto&) {});
+		log.start([](auto&, auto, auto&) {});
+		log.append("a"sv, "text/plain"sv, ""sv, "one"sv);
+		// An upload whose body never all arrives, like one still being
+		// copied when the process dies.
+		int body = log.temp_file();
+		ASSERT_EQ(::write(body, "partial", 7), 7);
+		EXPECT_THROW(log.append("big"sv, "text/plain"sv, ""sv, body, 100000), std::exception);
+		::close(body);
+		// Finished later at higher offsets.
+		log.append("b"sv, "text/plain"sv, ""sv, "two"sv);
+		log.append("a"sv, ""sv, ""sv, ""sv, true);
+	}
+	auto path = dir.segment(1);
+	auto size = std::filesystem::file_size(path);
+	for(bool clean: {true, false}) {
+		if(!clean)
+			write_at(path, size, std::string(8, '\0'));
+		auto found = recover(dir.path);
+		ASSERT_EQ(found.size(), 3u) << clean;
+		EXPECT_EQ(found[0].body, "one");
+		EXPECT_EQ(found[1].key, "b");
+		EXPECT_EQ(found[1].body, "two");
+		EXPECT_EQ(found[2].key, "a");
+		EXPECT_TRUE(found[2].tombstone);
+		EXPECT_EQ(std::filesystem::file_size(path), size);
+	}
+}
+
+TEST(SegmentLog, CompactsAMostlyDeadSegment) {
+	TempDir dir;
+	std::string body(1000, 'x');
+	{
+		SegmentLog log(dir.path, 4096);
+		Index index{log, {}};
+		log.recover([](auto&, auto, auto&) {});
+		log.start([&](const std::shared_ptr<Segment> &s, uint64_t offset, const Record &r) {
+			auto &place = index.places.at(std::string(r.key));
+			if(place.segment == s && place.offset == offset)
+				index.set(std::string(r.key), r.body);
+		});
+		// Three records fit in a segment, so 1 and 2 are sealed.
+		for(int i = 0; i < 8; ++i) {
+			index.set("k" + std::to_string(i), body + std::to_string(i));
+		}
+		ASSERT_EQ(index.places["k2"].segment->id, 1u);
+		// Most of the first is replaced, which relocates k2.
+		index.set("k0", "new0");
+		index.set("k1", "new1");
+		EXPECT_TRUE(eventually([&] { return !std::filesystem::exists(dir.segment(1)); }));
+	}
+	std::map<std::string, std::string> latest;
+	for(auto &f: recover(dir.path)) {
+		latest[f.key] = f.body;
+	}
+	EXPECT_EQ(latest["k0"], "new0");
+	EXPECT_EQ(latest["k1"], "new1");
+	EXPECT_EQ(latest["k2"], body + "2");
+	EXPECT_EQ(latest.size(), 8u);
+}
+
+TEST(SegmentLog, KeepsASegmentItCannotReadThrough) {
+	TempDir dir;
+	std::string body(1000, 'x');
+	SegmentLog log(dir.path, 4096);
+	Index index{log, {}};
+	log.recover([](auto&, auto, auto&) {});
+	std::atomic<int> relocated{0};
+	log.start([&](const std::shared_ptr<Segment> &s, uint64_t offset, const Record &r) {
+		auto &place = index.places.at(std::string(r.key));
+		if(place.segment == s && place.offset == offset)
+			++relocated;
+	});
+	for(int i = 0; i < 8; ++i) {
+		index.set("k" + std::to_string(i), body);
+	}
+	// Break the header of k1, with k2 still live after it.
+	write_at(dir.segment(1), index.places["k1"].offset, std::string(sizeof(RecordHeader), '\0'));
+	index.set("k0", "new0");
+	index.set("k1", "new1");
+	std::this_thread::sleep_for(2500ms);
+	EXPECT_TRUE(std::filesystem::exists(dir.segment(1)));
+	EXPECT_EQ(relocated, 0);
+}